@@ -33,10 +33,12 @@ extern "C" {
 #include <glib.h>
 
 #include "logger.h"
+#include "logger-event.h"
 #include "parser-interface.h"
 #include "python-embedding.h"
 #include "parser-interface.h"
 #include "libbungee.h"
+#include "trie.h"
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,117 @@
+/*
+compile-cache.c: persistent cache of compiled scripts
+
+This file is part of Bungee.
+
+Copyright 2012 Red Hat, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+/*
+  Compiled scripts are cached under $XDG_CACHE_HOME/bungee (usually
+  ~/.cache/bungee) as
+
+    <key>.bngo           generated Python source
+    <key>-<magic>.bngc   marshalled code object of the above
+
+  where <key> is a SHA1 over VERSION, BNG_CACHE_FORMAT and the .bng
+  source, and <magic> is the Python bytecode magic number. Entries are
+  never invalidated, a changed script, parser or upgrade simply produces
+  a new key.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "local-defs.h"
+#include "logger.h"
+#include "compile-cache.h"
+
+gchar *
+bng_cache_key (const gchar *source, gsize len)
+{
+  GChecksum *checksum;
+  gchar *key;
+
+  checksum = g_checksum_new (G_CHECKSUM_SHA1);
+  g_checksum_update (checksum, (const guchar *) VERSION, sizeof (VERSION));
+  g_checksum_update (checksum, (const guchar *) BNG_CACHE_FORMAT, sizeof (BNG_CACHE_FORMAT));
+  g_checksum_update (checksum, (const guchar *) source, len);
+  key = g_strdup (g_checksum_get_string (checksum));
+  g_checksum_free (checksum);
+
+  return (key);
+}
+
+gchar *
+bng_cache_path (const gchar *key, const gchar *suffix)
+{
+  static gchar *cache_dir;
+  static gboolean disabled;
+  gchar *name, *path;
+
+  if (disabled)
+    return (NULL);
+
+  if (cache_dir == NULL)
+    {
+      if (g_getenv ("BUNGEE_NO_CACHE"))
+	{
+	  disabled = TRUE;
+	  return (NULL);
+	}
+
+      cache_dir = g_build_filename (g_get_user_cache_dir (), PACKAGE, NULL);
+      if (g_mkdir_with_parents (cache_dir, 0700) != 0)
+	{
+	  BNG_DBG (_("Unable to create cache directory [%s], %s"), cache_dir, strerror (errno));
+	  g_free (cache_dir);
+	  cache_dir = NULL;
+	  disabled = TRUE;
+	  return (NULL);
+	}
+    }
+
+  name = g_strconcat (key, suffix, NULL);
+  path = g_build_filename (cache_dir, name, NULL);
+  g_free (name);
+
+  return (path);
+}
+
+gint
+bng_cache_store (const gchar *key, const gchar *suffix, const gchar *data, gsize len)
+{
+  GError *error = NULL;
+  gchar *path;
+
+  path = bng_cache_path (key, suffix);
+  if (path == NULL)
+    return (1);
+
+  /* Written to a temporary file and renamed, readers never see partial entries. */
+  if (!g_file_set_contents (path, data, len, &error))
+    {
+      BNG_DBG (_("Unable to write cache entry [%s], %s"), path, error->message);
+      g_error_free (error);
+      g_free (path);
+      return (1);
+    }
+
+  g_free (path);
+  return (0);
+}
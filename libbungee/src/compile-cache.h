@@ -0,0 +1,52 @@
+/*
+compile-cache.h: persistent cache of compiled scripts
+
+This file is part of Bungee.
+
+Copyright 2012 Red Hat, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef _COMPILE_CACHE_H
+#define _COMPILE_CACHE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Suffix of the generated Python source in the cache. */
+#define BNG_CACHE_SUFFIX_SOURCE ".bngo"
+
+/* Version of the Python the parser generates. Bump it whenever the
+   output of parser.y changes, scripts cached before are then compiled
+   again even within a VERSION. */
+#define BNG_CACHE_FORMAT "1"
+
+/* Cache key of a .bng script: SHA1 over Bungee VERSION, BNG_CACHE_FORMAT
+   and the script source. Free with g_free. */
+gchar *bng_cache_key (const gchar *source, gsize len);
+
+/* Path of the cache entry key+suffix under $XDG_CACHE_HOME/bungee, which
+   is created on demand. NULL if the cache is unavailable or disabled
+   through BUNGEE_NO_CACHE. Free with g_free. */
+gchar *bng_cache_path (const gchar *key, const gchar *suffix);
+
+/* Atomically store data as the cache entry key+suffix. */
+gint bng_cache_store (const gchar *key, const gchar *suffix, const gchar *data, gsize len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _COMPILE_CACHE_H */
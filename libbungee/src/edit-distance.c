@@ -0,0 +1,334 @@
+/*
+  edit-distance.c: Edit distance row kernels for the trie search.
+
+  This file is part of Bungee.
+
+  Copyright 2012 Red Hat, Inc.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/*
+  One trie node adds one row to the Levenshtein matrix of the query:
+
+    row[i] = min (uprow[i] + 1, row[i - 1] + 1, uprow[i - 1] + cost (i))
+
+  The first and last terms only depend on the parent row and are computed
+  for a whole vector at once. The middle term chains across the row, it is
+  a running minimum in disguise: row[i] = min over j <= i of t[j] + (i - j),
+  so with s[j] = t[j] - j a prefix minimum of s plus i gives the row. The
+  prefix minimum takes log2 (lanes) shift and min steps per vector and the
+  last lane carries into the next vector.
+
+  All costs are 1. The kernel is picked on first use from what the CPU
+  supports, the scalar loop is kept for other machines and as reference.
+*/
+
+#include <string.h>
+#include <glib.h>
+
+#include "local-defs.h"
+#include "trie.h"
+
+#if defined (__GNUC__) && (defined (__x86_64__) || defined (__i386__))
+#define BNG_EDIT_DISTANCE_X86 1
+#include <immintrin.h>
+#endif
+
+#define _min(a,b) ((a) < (b) ? (a) : (b))
+
+typedef gint (*calc_dist_fn) (const gchar *word, gint len, guchar id,
+			      const gint *uprow, gint *row);
+
+static gint
+calc_dist_scalar (const gchar *word, gint len, guchar id, const gint *uprow, gint *row)
+{
+  gint i = 0;
+  gint dist = 0;
+  gint min = row[0];
+
+  for (i = 1; i <= len; i++) {
+    dist = _min ((uprow[i] + 1), (row[i - 1] + 1));
+    dist = _min (dist, (uprow[i - 1] + ((guchar) word[i - 1] == id ? 0 : 1)));
+    row[i] = dist;
+    min = _min (min, dist);
+  }
+
+  return min;
+}
+
+#ifdef BNG_EDIT_DISTANCE_X86
+
+/* 4 lanes. Requires SSE4.1 for pmovzxbd and pminsd. Rows shorter than
+   two vectors are cheaper in the scalar loop. Always inlined so that the AVX2
+   kernel finishing its row with it gets VEX encoded instructions, mixing
+   in legacy SSE encoding stalls on dirty upper halves. */
+__attribute__ ((target ("sse4.1"), always_inline)) static inline gint
+calc_dist_x4 (const gchar *word, gint len, guchar id, const gint *uprow, gint *row)
+{
+  const __m128i one = _mm_set1_epi32 (1);
+  const __m128i lane = _mm_setr_epi32 (0, 1, 2, 3);
+  const __m128i top = _mm_set1_epi32 (G_MAXINT / 2);
+  const __m128i vid = _mm_set1_epi32 (id);
+  __m128i vmin = _mm_set1_epi32 (row[0]);
+  __m128i up, diag, eq, t, s;
+  gint carry = row[0];
+  gint i, min;
+  guint32 chars;
+
+  if (len < 8)
+    return calc_dist_scalar (word, len, id, uprow, row);
+
+  for (i = 1; i + 3 <= len; i += 4)
+    {
+      up = _mm_loadu_si128 ((const __m128i *) (uprow + i));
+      diag = _mm_loadu_si128 ((const __m128i *) (uprow + i - 1));
+      memcpy (&chars, word + i - 1, sizeof (chars));
+      eq = _mm_cmpeq_epi32 (_mm_cvtepu8_epi32 (_mm_cvtsi32_si128 (chars)), vid);
+
+      /* Deletion and substitution, eq is -1 on a match. */
+      t = _mm_min_epi32 (_mm_add_epi32 (up, one),
+			 _mm_add_epi32 (_mm_add_epi32 (diag, one), eq));
+
+      /* Insertion chain: prefix minimum of t[j] - j, seeded by the last
+	 element of the previous vector. */
+      s = _mm_sub_epi32 (t, lane);
+      s = _mm_min_epi32 (s, _mm_alignr_epi8 (s, top, 12));
+      s = _mm_min_epi32 (s, _mm_alignr_epi8 (s, top, 8));
+      s = _mm_min_epi32 (s, _mm_set1_epi32 (carry + 1));
+      t = _mm_add_epi32 (s, lane);
+
+      _mm_storeu_si128 ((__m128i *) (row + i), t);
+      vmin = _mm_min_epi32 (vmin, t);
+      carry = row[i + 3];
+    }
+
+  vmin = _mm_min_epi32 (vmin, _mm_shuffle_epi32 (vmin, _MM_SHUFFLE (1, 0, 3, 2)));
+  vmin = _mm_min_epi32 (vmin, _mm_shuffle_epi32 (vmin, _MM_SHUFFLE (2, 3, 0, 1)));
+  min = _mm_cvtsi128_si32 (vmin);
+
+  for (; i <= len; i++)
+    {
+      row[i] = _min (_min (uprow[i], row[i - 1]) + 1,
+		     uprow[i - 1] + ((guchar) word[i - 1] == id ? 0 : 1));
+      min = _min (min, row[i]);
+    }
+
+  return min;
+}
+
+__attribute__ ((target ("sse4.1"))) static gint
+calc_dist_sse41 (const gchar *word, gint len, guchar id, const gint *uprow, gint *row)
+{
+  return calc_dist_x4 (word, len, id, uprow, row);
+}
+
+/* 8 lanes. Lane shifts cross the 128 bit halves, hence the permutes. */
+__attribute__ ((target ("avx2"))) static gint
+calc_dist_avx2 (const gchar *word, gint len, guchar id, const gint *uprow, gint *row)
+{
+  const __m256i one = _mm256_set1_epi32 (1);
+  const __m256i lane = _mm256_setr_epi32 (0, 1, 2, 3, 4, 5, 6, 7);
+  const __m256i top = _mm256_set1_epi32 (G_MAXINT / 2);
+  const __m256i vid = _mm256_set1_epi32 (id);
+  const __m256i shift1 = _mm256_setr_epi32 (0, 0, 1, 2, 3, 4, 5, 6);
+  const __m256i shift2 = _mm256_setr_epi32 (0, 0, 0, 1, 2, 3, 4, 5);
+  const __m256i shift4 = _mm256_setr_epi32 (0, 0, 0, 0, 0, 1, 2, 3);
+  __m256i vmin = _mm256_set1_epi32 (row[0]);
+  __m256i up, diag, eq, t, s;
+  __m128i half;
+  gint carry = row[0];
+  gint i, min;
+
+  /* Measured with Makefile.bench, below two vectors the permutes cost
+     more than they save. */
+  if (len < 16)
+    return calc_dist_x4 (word, len, id, uprow, row);
+
+  for (i = 1; i + 7 <= len; i += 8)
+    {
+      up = _mm256_loadu_si256 ((const __m256i *) (uprow + i));
+      diag = _mm256_loadu_si256 ((const __m256i *) (uprow + i - 1));
+      eq = _mm256_cmpeq_epi32 (_mm256_cvtepu8_epi32 (_mm_loadl_epi64 ((const __m128i *) (word + i - 1))), vid);
+
+      t = _mm256_min_epi32 (_mm256_add_epi32 (up, one),
+			    _mm256_add_epi32 (_mm256_add_epi32 (diag, one), eq));
+
+      s = _mm256_sub_epi32 (t, lane);
+      s = _mm256_min_epi32 (s, _mm256_blend_epi32 (_mm256_permutevar8x32_epi32 (s, shift1), top, 0x01));
+      s = _mm256_min_epi32 (s, _mm256_blend_epi32 (_mm256_permutevar8x32_epi32 (s, shift2), top, 0x03));
+      s = _mm256_min_epi32 (s, _mm256_blend_epi32 (_mm256_permutevar8x32_epi32 (s, shift4), top, 0x0f));
+      s = _mm256_min_epi32 (s, _mm256_set1_epi32 (carry + 1));
+      t = _mm256_add_epi32 (s, lane);
+
+      _mm256_storeu_si256 ((__m256i *) (row + i), t);
+      vmin = _mm256_min_epi32 (vmin, t);
+      carry = row[i + 7];
+    }
+
+  half = _mm_min_epi32 (_mm256_castsi256_si128 (vmin), _mm256_extracti128_si256 (vmin, 1));
+  half = _mm_min_epi32 (half, _mm_shuffle_epi32 (half, _MM_SHUFFLE (1, 0, 3, 2)));
+  half = _mm_min_epi32 (half, _mm_shuffle_epi32 (half, _MM_SHUFFLE (2, 3, 0, 1)));
+  min = _mm_cvtsi128_si32 (half);
+
+  /* The rest is a shorter row starting at row[i - 1]. */
+  if (i <= len)
+    min = _min (min, calc_dist_x4 (word + i - 1, len - i + 1, id, uprow + i - 1, row + i - 1));
+
+  return min;
+}
+
+#endif /* BNG_EDIT_DISTANCE_X86 */
+
+static gint calc_dist_resolve (const gchar *word, gint len, guchar id,
+			       const gint *uprow, gint *row);
+
+static calc_dist_fn calc_dist = calc_dist_resolve;
+
+/* Pick the widest kernel the CPU runs. BUNGEE_EDIT_DISTANCE=scalar|sse4.1
+   overrides the choice, mostly for comparing them. */
+static calc_dist_fn
+calc_dist_select (void)
+{
+  const gchar *force = g_getenv ("BUNGEE_EDIT_DISTANCE");
+
+  if (force && g_str_equal (force, "scalar"))
+    return calc_dist_scalar;
+
+#ifdef BNG_EDIT_DISTANCE_X86
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("avx2") && !(force && g_str_equal (force, "sse4.1")))
+    return calc_dist_avx2;
+  if (__builtin_cpu_supports ("sse4.1"))
+    return calc_dist_sse41;
+#endif
+
+  return calc_dist_scalar;
+}
+
+static gint
+calc_dist_resolve (const gchar *word, gint len, guchar id, const gint *uprow, gint *row)
+{
+  calc_dist_fn fn = calc_dist_select ();
+
+  /* Every thread resolves to the same kernel, a racing store is harmless. */
+  g_atomic_pointer_set (&calc_dist, fn);
+  return fn (word, len, id, uprow, row);
+}
+
+/* Edit distance row of a node from the row of its parent. uprow[j] is
+   the distance between the parent's prefix and word[0..j), row[0] is
+   already set to the node's depth. Returns the row minimum, no word below
+   the node can get any closer. */
+gint
+bng_calc_dist (const gchar *word, gint len, guchar id, const gint *uprow, gint *row)
+{
+  return calc_dist (word, len, id, uprow, row);
+}
+
+#ifdef _BENCH_EDIT_DISTANCE
+/* Standalone benchmark and cross check of the kernels, see Makefile.bench. */
+#include <stdio.h>
+#include <stdlib.h>
+
+#define BENCH_ROWS 4096
+
+static gdouble
+bench (calc_dist_fn fn, const gchar *word, gint len, const gchar *ids,
+       gint *rows, gint rounds, gint64 *sum)
+{
+  gint64 start = g_get_monotonic_time ();
+  gint r, d;
+
+  for (r = 0; r < rounds; r++)
+    for (d = 1; d < BENCH_ROWS; d++)
+      {
+	gint *row = rows + d * (len + 1);
+	row[0] = d;
+	*sum += fn (word, len, ids[d], row - (len + 1), row);
+      }
+
+  return (g_get_monotonic_time () - start) * 1000.0 / ((gdouble) rounds * (BENCH_ROWS - 1));
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct { const gchar *name; calc_dist_fn fn; gboolean supported; } kernels[] = {
+    { "scalar", calc_dist_scalar, TRUE },
+#ifdef BNG_EDIT_DISTANCE_X86
+    { "sse4.1", calc_dist_sse41, __builtin_cpu_supports ("sse4.1") },
+    { "avx2", calc_dist_avx2, __builtin_cpu_supports ("avx2") },
+#endif
+  };
+  static const gint lens[] = { 4, 8, 12, 16, 24, 32, 48, 64 };
+  gint rounds = argc > 1 ? atoi (argv[1]) : 200;
+  gchar word[64], ids[BENCH_ROWS];
+  gint *rows, *check;
+  guint l, k;
+  gint j, d;
+
+  rows = g_new (gint, BENCH_ROWS * 65);
+  check = g_new (gint, BENCH_ROWS * 65);
+  for (d = 0; d < BENCH_ROWS; d++)
+    ids[d] = 'a' + g_random_int_range (0, 4);
+
+  printf ("%4s", "len");
+  for (k = 0; k < G_N_ELEMENTS (kernels); k++)
+    printf ("  %8s ns/row", kernels[k].name);
+  printf ("\n");
+
+  for (l = 0; l < G_N_ELEMENTS (lens); l++)
+    {
+      gint len = lens[l];
+      gint64 sum, ref = 0;
+
+      for (j = 0; j < len; j++)
+	word[j] = 'a' + g_random_int_range (0, 4);
+      for (j = 0; j <= len; j++)
+	rows[j] = check[j] = j;
+
+      /* Reference rows from the scalar kernel. */
+      for (d = 1; d < BENCH_ROWS; d++)
+	{
+	  check[d * (len + 1)] = d;
+	  calc_dist_scalar (word, len, ids[d], check + (d - 1) * (len + 1), check + d * (len + 1));
+	}
+
+      printf ("%4d", len);
+      for (k = 0; k < G_N_ELEMENTS (kernels); k++)
+	{
+	  if (!kernels[k].supported)
+	    {
+	      printf ("  %15s", "n/a");
+	      continue;
+	    }
+
+	  sum = 0;
+	  printf ("  %15.2f", bench (kernels[k].fn, word, len, ids, rows, rounds, &sum));
+	  if (k == 0)
+	    ref = sum;
+	  if (sum != ref || memcmp (rows, check, sizeof (gint) * BENCH_ROWS * (len + 1)) != 0)
+	    {
+	      fprintf (stderr, "\n%s: rows differ from scalar at len %d\n", kernels[k].name, len);
+	      return 1;
+	    }
+	}
+      printf ("\n");
+    }
+
+  g_free (rows);
+  g_free (check);
+  return 0;
+}
+#endif /* _BENCH_EDIT_DISTANCE */
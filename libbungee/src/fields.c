@@ -0,0 +1,279 @@
+/*
+fields.c: Split records in to fields
+
+This file is part of Bungee.
+
+Copyright 2012 Red Hat, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+/*
+  Field separators follow AWK: " " splits on runs of blanks and ignores
+  leading and trailing ones, any other single character splits on each
+  occurrence, anything longer is a regular expression. An empty record
+  has no fields.
+
+  The blank and single byte splitters classify 16 bytes per step with
+  SSE2 and walk the resulting bit mask, a record is read once no matter
+  how short its fields are. Other machines use the byte loops, which are
+  also used for the tail of every record.
+*/
+
+#include <string.h>
+#include <glib.h>
+
+#include "local-defs.h"
+#include "logger.h"
+#include "fields.h"
+
+#if defined (__GNUC__) && defined (__SSE2__)
+#define BNG_FIELDS_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#define is_blank(c) ((c) == ' ' || (c) == '\t' || (c) == '\n')
+
+static inline void
+field_add (GArray *fields, gsize start, gsize end)
+{
+  bng_field_t field = { start, end - start };
+
+  g_array_append_val (fields, field);
+}
+
+/************* SEPARATORS *************/
+
+bng_fields_sep_t *
+bng_fields_sep_new (const gchar *fs, GError **error)
+{
+  bng_fields_sep_t *sep = g_new0 (bng_fields_sep_t, 1);
+
+  if (fs == NULL || g_strcmp0 (fs, " ") == 0)
+    sep->mode = BNG_FIELDS_BLANKS;
+  else if (fs[0] && fs[1] == '\0')
+    {
+      sep->mode = BNG_FIELDS_CHAR;
+      sep->sep = fs[0];
+    }
+  else
+    {
+      sep->mode = BNG_FIELDS_REGEX;
+      sep->pattern = g_strdup (fs);
+      sep->regex = g_regex_new (fs, G_REGEX_OPTIMIZE, 0, error);
+      if (sep->regex == NULL)
+	{
+	  bng_fields_sep_free (sep);
+	  return NULL;
+	}
+    }
+
+  return sep;
+}
+
+bng_fields_sep_t *
+bng_fields_sep_new_widths (const guint *widths, guint nwidths)
+{
+  bng_fields_sep_t *sep = g_new0 (bng_fields_sep_t, 1);
+
+  sep->mode = BNG_FIELDS_WIDTHS;
+  sep->widths = g_new (guint, nwidths);
+  memcpy (sep->widths, widths, nwidths * sizeof (guint));
+  sep->nwidths = nwidths;
+
+  return sep;
+}
+
+void
+bng_fields_sep_free (bng_fields_sep_t *sep)
+{
+  if (sep == NULL)
+    return;
+
+  if (sep->regex)
+    g_regex_unref (sep->regex);
+  if (sep->regex_raw)
+    g_regex_unref (sep->regex_raw);
+  g_free (sep->pattern);
+  g_free (sep->widths);
+  g_free (sep);
+}
+
+/************* SPLITTERS *************/
+
+static void
+split_blanks (const gchar *rec, gsize len, GArray *fields)
+{
+  gsize i = 0, start = 0;
+  gboolean in_field = FALSE;
+
+#ifdef BNG_FIELDS_SSE2
+  const __m128i space = _mm_set1_epi8 (' ');
+  const __m128i tab = _mm_set1_epi8 ('\t');
+  const __m128i nl = _mm_set1_epi8 ('\n');
+
+  for (; i + 16 <= len; i += 16)
+    {
+      __m128i v = _mm_loadu_si128 ((const __m128i *) (rec + i));
+      __m128i blank = _mm_or_si128 (_mm_or_si128 (_mm_cmpeq_epi8 (v, space),
+						  _mm_cmpeq_epi8 (v, tab)),
+				    _mm_cmpeq_epi8 (v, nl));
+      guint word = ~_mm_movemask_epi8 (blank) & 0xffff;
+      /* Bits where a field starts or ends, they alternate. */
+      guint edges = word ^ ((word << 1) | in_field);
+
+      edges &= 0xffff;
+      while (edges)
+	{
+	  guint bit = __builtin_ctz (edges);
+	  if (!in_field)
+	    start = i + bit;
+	  else
+	    field_add (fields, start, i + bit);
+	  in_field = !in_field;
+	  edges &= edges - 1;
+	}
+    }
+#endif
+
+  for (; i < len; i++)
+    {
+      if (is_blank (rec[i]) == !in_field)
+	continue;
+      if (!in_field)
+	start = i;
+      else
+	field_add (fields, start, i);
+      in_field = !in_field;
+    }
+
+  if (in_field)
+    field_add (fields, start, len);
+}
+
+static void
+split_char (const gchar *rec, gsize len, gchar sep, GArray *fields)
+{
+  gsize i = 0, start = 0;
+
+#ifdef BNG_FIELDS_SSE2
+  const __m128i needle = _mm_set1_epi8 (sep);
+
+  for (; i + 16 <= len; i += 16)
+    {
+      __m128i v = _mm_loadu_si128 ((const __m128i *) (rec + i));
+      guint mask = _mm_movemask_epi8 (_mm_cmpeq_epi8 (v, needle));
+
+      while (mask)
+	{
+	  gsize end = i + __builtin_ctz (mask);
+	  field_add (fields, start, end);
+	  start = end + 1;
+	  mask &= mask - 1;
+	}
+    }
+#endif
+
+  for (; i < len; i++)
+    if (rec[i] == sep)
+      {
+	field_add (fields, start, i);
+	start = i + 1;
+      }
+
+  field_add (fields, start, len);
+}
+
+static void
+split_regex (bng_fields_sep_t *sep, const gchar *rec, gsize len, gboolean utf8, GArray *fields)
+{
+  GMatchInfo *match = NULL;
+  GRegex *regex = sep->regex;
+  gsize start = 0;
+  gint from, to;
+
+  if (!utf8)
+    {
+      /* Any bytes, the UTF-8 regex would refuse invalid sequences. */
+      if (sep->regex_raw == NULL)
+	sep->regex_raw = g_regex_new (sep->pattern, G_REGEX_OPTIMIZE | G_REGEX_RAW, 0, NULL);
+      regex = sep->regex_raw;
+    }
+
+  /* Separators never match empty, "a*" must not split between letters. */
+  g_regex_match_full (regex, rec, len, 0, G_REGEX_MATCH_NOTEMPTY, &match, NULL);
+  while (g_match_info_matches (match))
+    {
+      g_match_info_fetch_pos (match, 0, &from, &to);
+      field_add (fields, start, from);
+      start = to;
+      g_match_info_next (match, NULL);
+    }
+  g_match_info_free (match);
+
+  field_add (fields, start, len);
+}
+
+/* Widths count characters of UTF-8 text, bytes otherwise. */
+static void
+split_widths (const bng_fields_sep_t *sep, const gchar *rec, gsize len, gboolean utf8,
+	      GArray *fields)
+{
+  gsize start = 0, end;
+  guint i, n;
+
+  for (i = 0; i < sep->nwidths && start < len; i++)
+    {
+      if (utf8)
+	{
+	  for (end = start, n = 0; n < sep->widths[i] && end < len; n++)
+	    end = g_utf8_next_char (rec + end) - rec;
+	  end = MIN (end, len);
+	}
+      else
+	end = MIN (start + sep->widths[i], len);
+
+      field_add (fields, start, end);
+      start = end;
+    }
+}
+
+/* Split rec in to fields, replacing the contents of fields. utf8 tells
+   that rec is text with multi-byte characters, for regexes and widths.
+   Returns the number of fields. */
+guint
+bng_fields_split (bng_fields_sep_t *sep, const gchar *rec, gsize len,
+		  gboolean utf8, GArray *fields)
+{
+  g_array_set_size (fields, 0);
+  if (len == 0)
+    return 0;
+
+  switch (sep ? sep->mode : BNG_FIELDS_BLANKS)
+    {
+    case BNG_FIELDS_BLANKS:
+      split_blanks (rec, len, fields);
+      break;
+    case BNG_FIELDS_CHAR:
+      split_char (rec, len, sep->sep, fields);
+      break;
+    case BNG_FIELDS_REGEX:
+      split_regex (sep, rec, len, utf8, fields);
+      break;
+    case BNG_FIELDS_WIDTHS:
+      split_widths (sep, rec, len, utf8, fields);
+      break;
+    }
+
+  return fields->len;
+}
@@ -0,0 +1,64 @@
+/*
+fields.h: Split records in to fields
+
+This file is part of Bungee.
+
+Copyright 2012 Red Hat, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef _FIELDS_H
+#define _FIELDS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+  BNG_FIELDS_BLANKS,  /* Runs of spaces, tabs and newlines, AWK's FS=" " */
+  BNG_FIELDS_CHAR,    /* Every occurrence of one byte */
+  BNG_FIELDS_REGEX,   /* Every match of a regular expression */
+  BNG_FIELDS_WIDTHS   /* Fixed widths, like gawk's FIELDWIDTHS */
+} bng_fields_mode_t;
+
+/* Field separator. */
+typedef struct
+{
+  bng_fields_mode_t mode;
+  gchar sep;          /* BNG_FIELDS_CHAR */
+  GRegex *regex;      /* BNG_FIELDS_REGEX, on UTF-8 text */
+  GRegex *regex_raw;  /* BNG_FIELDS_REGEX, on bytes, compiled on first use */
+  gchar *pattern;
+  guint *widths;      /* BNG_FIELDS_WIDTHS */
+  guint nwidths;
+} bng_fields_sep_t;
+
+/* A field, as offset and length in to the record. */
+typedef struct
+{
+  gsize start;
+  gsize len;
+} bng_field_t;
+
+bng_fields_sep_t *bng_fields_sep_new (const gchar *fs, GError **error);
+bng_fields_sep_t *bng_fields_sep_new_widths (const guint *widths, guint nwidths);
+void bng_fields_sep_free (bng_fields_sep_t *sep);
+guint bng_fields_split (bng_fields_sep_t *sep, const gchar *rec, gsize len,
+			gboolean utf8, GArray *fields);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _FIELDS_H */
@@ -0,0 +1,246 @@
+/*
+fuzzy.c: Levenshtein automaton matching against a trie
+
+This file is part of Bungee.
+
+Copyright 2012 Red Hat, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+/*
+  The query word is compiled in to a Levenshtein automaton, simulated
+  bit-parallel (Wu-Manber): R[e] has bit i set when the first i letters
+  of the query can turn in to the text read so far with e edits. Reading
+  letter c from a trie edge:
+
+    R'[0] = (R[0] << 1) & B[c]
+    R'[e] = (R[e] << 1) & B[c]        match
+	  | R[e-1]                    insertion
+	  | R[e-1] << 1               substitution
+	  | R'[e-1] << 1              deletion
+
+  where B[c] has bit i + 1 set for every query position i holding c. A
+  word is accepted with e edits when bit len of R[e] is set.
+
+  Walking the trie intersects the automaton with the dictionary: every
+  depth keeps its R vector, and a subtree dies as soon as R[max_dist] has
+  no bit left. Each step is max_dist + 1 shifts and ors, independent of
+  the query length.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <glib.h>
+
+#include "local-defs.h"
+#include "logger.h"
+#include "trie.h"
+#include "fuzzy.h"
+
+typedef struct
+{
+  guint64 mask[256];  /* B[c] */
+  guint64 all;        /* Bits 0 .. len */
+  guint64 accept;     /* Bit len */
+  gint bound;         /* Highest error level still of interest */
+  gint nerr;          /* Error levels tracked, max_dist + 1 */
+  guint64 *states;    /* nerr vectors per depth */
+
+  /* bng_fuzzy_match */
+  gboolean best_only;
+  guint32 best;
+  gint best_dist;
+
+  /* bng_fuzzy_matches */
+  GArray *found;      /* bng_trie_match_t */
+} lev_t;
+
+static gint
+lev_init (lev_t *lev, bng_trie_t *trie, const gchar *word, gsize len, gint max_dist)
+{
+  gsize i;
+  gint e;
+
+  /* No word is farther than this, larger bounds only cost memory. */
+  max_dist = MIN ((gsize) max_dist, MAX (len, trie->max_depth));
+
+  memset (lev->mask, 0, sizeof (lev->mask));
+  for (i = 0; i < len; i++)
+    lev->mask[(guchar) word[i]] |= G_GUINT64_CONSTANT (1) << (i + 1);
+
+  lev->accept = G_GUINT64_CONSTANT (1) << len;
+  lev->all = (lev->accept << 1) - 1;
+  lev->bound = max_dist;
+  lev->nerr = max_dist + 1;
+
+  lev->states = g_try_new (guint64, (gsize) (trie->max_depth + 1) * lev->nerr);
+  if (lev->states == NULL)
+    {
+      errno = ENOMEM;
+      return -1;
+    }
+
+  /* Before any letter, e edits delete up to e query letters. */
+  for (e = 0; e < lev->nerr; e++)
+    lev->states[e] = ((G_GUINT64_CONSTANT (2) << MIN ((gsize) e, len)) - 1) & lev->all;
+
+  return 0;
+}
+
+/* Smallest error level accepting in R, -1 if none within the bound. */
+static inline gint
+lev_accepts (const lev_t *lev, const guint64 *R)
+{
+  gint e;
+
+  for (e = 0; e <= lev->bound; e++)
+    if (R[e] & lev->accept)
+      return e;
+  return -1;
+}
+
+static gint
+lev_node (bng_trie_t *trie, bng_trie_node_t *node, gpointer data)
+{
+  lev_t *lev = data;
+  guint64 *R, *next, b;
+  gint e, dist;
+
+  next = lev->states + (gsize) node->depth * lev->nerr;
+  if (node->depth > 0)
+    {
+      R = next - lev->nerr;
+      b = lev->mask[node->id];
+
+      next[0] = (R[0] << 1) & b;
+      for (e = 1; e <= lev->bound; e++)
+	next[e] = (((R[e] << 1) & b) | R[e - 1] | (R[e - 1] << 1) | (next[e - 1] << 1))
+	  & lev->all;
+
+      if (next[lev->bound] == 0)
+	return 1; /* Nothing reachable below, prune */
+    }
+
+  if (!node->eow || (dist = lev_accepts (lev, next)) < 0)
+    return 0;
+
+  if (lev->best_only)
+    {
+      /* Words come in sorted order, only strictly closer ones replace. */
+      lev->best = BNG_TRIE_NODE_INDEX (trie, node);
+      lev->best_dist = dist;
+      if (dist == 0)
+	return -1; /* Exact match, done */
+      lev->bound = dist - 1;
+    }
+  else
+    {
+      bng_trie_match_t match;
+      match.word = g_malloc (node->depth + 1);
+      bng_trie_node_word (trie, node, match.word, node->depth + 1);
+      match.dist = dist;
+      g_array_append_val (lev->found, match);
+    }
+
+  return 0;
+}
+
+gint
+bng_fuzzy_match (bng_trie_t *trie, const gchar *word, gsize len, gint max_dist,
+		 bng_trie_node_t **match)
+{
+  lev_t lev;
+
+  if (max_dist < 0)
+    {
+      errno = EINVAL;
+      return -2;
+    }
+
+  if (len > BNG_FUZZY_MAX_LEN)
+    {
+      GArray *found = g_array_new (FALSE, FALSE, sizeof (bng_trie_match_t));
+      gint dist, count;
+
+      count = bng_trie_search_len (trie, word, len, max_dist, 1, found);
+      if (count > 0)
+	{
+	  bng_trie_match_t *best = &g_array_index (found, bng_trie_match_t, 0);
+	  dist = best->dist;
+	  *match = bng_trie_lookup (trie, best->word);
+	  bng_trie_match_clear (best);
+	}
+      else
+	dist = (count < 0) ? -2 : -1;
+      g_array_free (found, TRUE);
+      return dist;
+    }
+
+  lev.best_only = TRUE;
+  lev.best_dist = -1;
+  if (lev_init (&lev, trie, word, len, max_dist) != 0)
+    return -2;
+
+  bng_trie_walk (trie, lev_node, &lev, 0);
+  g_free (lev.states);
+
+  if (lev.best_dist >= 0)
+    *match = &trie->nodes[lev.best];
+
+  return lev.best_dist;
+}
+
+static gint
+match_cmp (gconstpointer a, gconstpointer b)
+{
+  return ((const bng_trie_match_t *) a)->dist - ((const bng_trie_match_t *) b)->dist;
+}
+
+gint
+bng_fuzzy_matches (bng_trie_t *trie, const gchar *word, gsize len, gint max_dist,
+		   GArray *matches)
+{
+  lev_t lev;
+  guint i;
+
+  if (max_dist < 0)
+    {
+      errno = EINVAL;
+      return -1;
+    }
+
+  if (len > BNG_FUZZY_MAX_LEN)
+    return bng_trie_search_len (trie, word, len, max_dist, 0, matches);
+
+  lev.best_only = FALSE;
+  lev.found = g_array_new (FALSE, FALSE, sizeof (bng_trie_match_t));
+  if (lev_init (&lev, trie, word, len, max_dist) != 0)
+    {
+      g_array_free (lev.found, TRUE);
+      return -1;
+    }
+
+  bng_trie_walk (trie, lev_node, &lev, 0);
+  g_free (lev.states);
+
+  /* Found in word order, a stable sort keeps it among equal distances. */
+  g_array_sort (lev.found, match_cmp);
+  for (i = 0; i < lev.found->len; i++)
+    g_array_append_val (matches, g_array_index (lev.found, bng_trie_match_t, i));
+
+  i = lev.found->len;
+  g_array_free (lev.found, TRUE);
+  return i;
+}
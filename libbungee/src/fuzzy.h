@@ -0,0 +1,49 @@
+/*
+fuzzy.h: Levenshtein automaton matching against a trie
+
+This file is part of Bungee.
+
+Copyright 2012 Red Hat, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef _FUZZY_H
+#define _FUZZY_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Longest word the bit-parallel automaton handles, longer words fall
+   back to bng_trie_search. */
+#define BNG_FUZZY_MAX_LEN 63
+
+/* word is len bytes long and may hold NULs. Distances count bytes. */
+
+/* Closest word of trie within max_dist edits of word. Returns its
+   distance and points *match at its node, -1 when there is none, or -2
+   on error with errno set. Ties go to the word that sorts first. */
+gint bng_fuzzy_match (bng_trie_t *trie, const gchar *word, gsize len, gint max_dist,
+		      bng_trie_node_t **match);
+
+/* Every word of trie within max_dist edits of word, closest first.
+   Appends bng_trie_match_t to matches and returns how many, or -1. */
+gint bng_fuzzy_matches (bng_trie_t *trie, const gchar *word, gsize len, gint max_dist,
+			GArray *matches);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _FUZZY_H */
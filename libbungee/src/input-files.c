@@ -0,0 +1,384 @@
+/*
+input-files.c: native input source over many files
+
+This file is part of Bungee.
+
+Copyright 2012 Red Hat, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+/*
+  The files a pattern expands to are read one after the other, each by a
+  line reader of its own (bng_input_lines_open), so every file is memory
+  mapped or inflated as it would be alone.
+
+  In a parallel run the files are not split up front. Every worker builds
+  the same list of work items: the files, with large ones cut in to
+  parts the line reader shards on, largest first. A counter in memory
+  shared by the workers hands out the next item to whichever worker asks
+  for one, so a worker stuck on a large file does not hold up the rest,
+  they keep taking the smaller items behind it.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <wordexp.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <glib.h>
+
+#include "local-defs.h"
+#include "logger.h"
+#include "input.h"
+
+/* A parallel run aims at this many items per worker, so that the last
+   ones are small enough to even out the load. */
+#define FILES_ITEMS_PER_WORKER 4
+/* Files are not cut in to parts smaller than this. */
+#define FILES_MIN_PART (32 * 1024 * 1024)
+/* Reading many files is mostly opening, mapping and inflating them, in a
+   reader thread of its own that overlaps with the rules. */
+#define FILES_READAHEAD 4
+
+typedef struct
+{
+  const gchar *path;
+  goffset size;  /* Bytes of the part */
+  guint part;
+  guint parts;
+} files_item_t;
+
+typedef struct
+{
+  bng_input_t input;
+
+  gchar **paths;
+  goffset *sizes;
+  guint npaths;
+
+  GArray *items;
+  gint *claimed;      /* Items handed out, shared by the workers */
+
+  bng_input_t *cur;   /* Line reader of the current item */
+  const gchar *cur_path;
+  bng_input_t *held;  /* Previous reader, its last record is still in use */
+} input_files_t;
+
+/* Line reader of the next item, NULL at the end of the items or on
+   error with errno set. */
+static bng_input_t *
+files_open_next (input_files_t *files)
+{
+  while (1)
+    {
+      guint i = g_atomic_int_add (files->claimed, 1);
+      files_item_t *item;
+      bng_input_t *reader;
+
+      if (i >= files->items->len)
+	{
+	  errno = 0;
+	  return NULL;
+	}
+
+      item = &g_array_index (files->items, files_item_t, i);
+      reader = bng_input_lines_open (item->path);
+      if (reader == NULL)
+	{
+	  gint _errno = errno;
+	  BNG_DBG (_("Unable to read [%s], %s"), item->path, strerror (errno));
+	  errno = _errno;
+	  return NULL;
+	}
+
+      if (item->parts > 1)
+	{
+	  /* Whole in the first part when it cannot be split after all. */
+	  if (reader->shard)
+	    reader->shard (reader, item->part, item->parts);
+	  else if (item->part > 0)
+	    {
+	      bng_input_close (reader);
+	      continue;
+	    }
+	}
+
+      reader->wakeup_fd = files->input.wakeup_fd;
+      files->cur_path = item->path;
+      return reader;
+    }
+}
+
+static gint
+files_next (bng_input_t *input, const gchar **rec, gsize *len)
+{
+  input_files_t *files = (input_files_t *) input;
+  gint status;
+
+  /* Records of the call before last are no longer referenced. */
+  if (files->held)
+    {
+      bng_input_close (files->held);
+      files->held = NULL;
+    }
+
+  while (1)
+    {
+      if (files->cur == NULL)
+	{
+	  files->cur = files_open_next (files);
+	  if (files->cur == NULL)
+	    return (errno == 0) ? 0 : -1;
+	}
+
+      status = files->cur->next (files->cur, rec, len);
+      if (status != 0)
+	{
+	  if (status < 0)
+	    {
+	      gint _errno = errno;
+	      BNG_DBG (_("Unable to read [%s], %s"), files->cur_path, strerror (errno));
+	      errno = _errno;
+	    }
+	  return status;
+	}
+
+      /* Closed next call, the last record may be still in use. Readers
+	 opened during this call have not returned any. */
+      if (files->held == NULL)
+	files->held = files->cur;
+      else
+	bng_input_close (files->cur);
+      files->cur = NULL;
+    }
+}
+
+static const gchar *
+files_file (bng_input_t *input)
+{
+  return ((input_files_t *) input)->cur_path;
+}
+
+/* Largest first. Ties in the order of the paths, then of the parts. */
+static gint
+files_item_compare (gconstpointer a, gconstpointer b)
+{
+  const files_item_t *item_a = a, *item_b = b;
+  gint order;
+
+  if (item_a->size != item_b->size)
+    return (item_a->size > item_b->size) ? -1 : 1;
+
+  order = strcmp (item_a->path, item_b->path);
+  if (order != 0)
+    return order;
+  return (gint) item_a->part - (gint) item_b->part;
+}
+
+/* Cut the files in to parts and order the items largest first, for
+   count workers to take from. */
+static void
+files_shard (bng_input_t *input, guint index, guint count)
+{
+  input_files_t *files = (input_files_t *) input;
+  goffset total = 0, part_size;
+  files_item_t item;
+  guint i;
+
+  for (i = 0; i < files->npaths; i++)
+    total += files->sizes[i];
+  part_size = MAX (total / ((goffset) count * FILES_ITEMS_PER_WORKER), FILES_MIN_PART);
+
+  g_array_set_size (files->items, 0);
+  for (i = 0; i < files->npaths; i++)
+    {
+      item.path = files->paths[i];
+      item.parts = MAX ((files->sizes[i] + part_size - 1) / part_size, 1);
+      for (item.part = 0; item.part < item.parts; item.part++)
+	{
+	  item.size = files->sizes[i] / item.parts;
+	  g_array_append_val (files->items, item);
+	}
+    }
+
+  /* Every worker sorts the same way, the shared counter indexes the
+     same list in all of them. */
+  g_array_sort (files->items, files_item_compare);
+}
+
+static void
+files_close (bng_input_t *input)
+{
+  input_files_t *files = (input_files_t *) input;
+
+  bng_input_close (files->held);
+  bng_input_close (files->cur);
+
+  munmap (files->claimed, sizeof (gint));
+  g_array_free (files->items, TRUE);
+  g_strfreev (files->paths);
+  g_free (files->sizes);
+  g_free (files->input.name);
+  g_free (files);
+}
+
+static gint
+files_name_compare (gconstpointer a, gconstpointer b)
+{
+  return strcmp (*(const gchar **) a, *(const gchar **) b);
+}
+
+/* Add path to paths, or the files in it when it is a directory. Returns
+   FALSE with errno set when path cannot be read. */
+static gboolean
+files_add (GPtrArray *paths, GArray *sizes, const gchar *path, gboolean top)
+{
+  struct stat stat_buf;
+  goffset size;
+
+  if (stat (path, &stat_buf) != 0)
+    {
+      gint _errno = errno;
+      BNG_DBG (_("Unable to stat [%s], %s"), path, strerror (errno));
+      errno = _errno;
+      return FALSE;
+    }
+
+  if (S_ISDIR (stat_buf.st_mode))
+    {
+      GError *error = NULL;
+      GPtrArray *names;
+      const gchar *name;
+      GDir *dir;
+      guint i;
+
+      /* Only the files right in the directory, not in the ones below. */
+      if (!top)
+	return TRUE;
+
+      dir = g_dir_open (path, 0, &error);
+      if (dir == NULL)
+	{
+	  BNG_DBG (_("Unable to open [%s], %s"), path, error->message);
+	  g_error_free (error);
+	  errno = EACCES;
+	  return FALSE;
+	}
+
+      names = g_ptr_array_new_with_free_func (g_free);
+      while ((name = g_dir_read_name (dir)) != NULL)
+	if (name[0] != '.')
+	  g_ptr_array_add (names, g_build_filename (path, name, NULL));
+      g_dir_close (dir);
+
+      g_ptr_array_sort (names, files_name_compare);
+      for (i = 0; i < names->len; i++)
+	if (!files_add (paths, sizes, g_ptr_array_index (names, i), FALSE))
+	  {
+	    g_ptr_array_free (names, TRUE);
+	    return FALSE;
+	  }
+
+      g_ptr_array_free (names, TRUE);
+      return TRUE;
+    }
+
+  size = S_ISREG (stat_buf.st_mode) ? stat_buf.st_size : 0;
+  g_ptr_array_add (paths, g_strdup (path));
+  g_array_append_val (sizes, size);
+  return TRUE;
+}
+
+bng_input_t *
+bng_input_files_open (const gchar *pattern)
+{
+  input_files_t *files;
+  wordexp_t exp_pattern;
+  gboolean expanded = FALSE;
+  GPtrArray *paths;
+  GArray *sizes;
+  files_item_t item;
+  gboolean ok = TRUE;
+  guint i;
+  void *claimed;
+
+  if (pattern == NULL || pattern[0] == '\0')
+    {
+      errno = EINVAL;
+      return (NULL);
+    }
+
+  claimed = mmap (NULL, sizeof (gint), PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (claimed == MAP_FAILED)
+    return (NULL);
+
+  paths = g_ptr_array_new ();
+  sizes = g_array_new (FALSE, FALSE, sizeof (goffset));
+
+  /* Patterns that do not match are left as they are, like in the shell,
+     and fail to open. */
+  if (wordexp (pattern, &exp_pattern, WRDE_NOCMD) == 0)
+    {
+      expanded = TRUE;
+      for (i = 0; ok && i < exp_pattern.we_wordc; i++)
+	ok = files_add (paths, sizes, exp_pattern.we_wordv[i], TRUE);
+    }
+  else
+    ok = files_add (paths, sizes, pattern, TRUE);
+
+  if (expanded)
+    wordfree (&exp_pattern);
+
+  if (!ok)
+    {
+      gint _errno = errno;
+      g_ptr_array_set_free_func (paths, g_free);
+      g_ptr_array_free (paths, TRUE);
+      g_array_free (sizes, TRUE);
+      munmap (claimed, sizeof (gint));
+      errno = _errno;
+      return (NULL);
+    }
+
+  files = g_new0 (input_files_t, 1);
+  files->input.name = g_strdup (pattern);
+  files->input.next = files_next;
+  files->input.shard = files_shard;
+  files->input.file = files_file;
+  files->input.close = files_close;
+  files->input.readahead = FILES_READAHEAD;
+  files->input.wakeup_fd = -1;
+  files->claimed = claimed;
+
+  files->npaths = paths->len;
+  g_ptr_array_add (paths, NULL);
+  files->paths = (gchar **) g_ptr_array_free (paths, FALSE);
+  files->sizes = (goffset *) g_array_free (sizes, FALSE);
+
+  /* Read alone, the files are read whole and in order. */
+  files->items = g_array_new (FALSE, FALSE, sizeof (files_item_t));
+  item.part = 0;
+  item.parts = 1;
+  for (i = 0; i < files->npaths; i++)
+    {
+      item.path = files->paths[i];
+      item.size = files->sizes[i];
+      g_array_append_val (files->items, item);
+    }
+
+  return (bng_input_t *) files;
+}
@@ -0,0 +1,364 @@
+/*
+input-ring.c: read-ahead thread for native input sources
+
+This file is part of Bungee.
+
+Copyright 2012 Red Hat, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+/*
+  A reader thread pulls records out of the wrapped source and packs them
+  in to chunks. Chunks travel to the engine thread through a single
+  producer, single consumer ring of depth slots:
+
+         reader thread                         engine thread
+    source->next -> chunk[head % depth]   chunk[taken % depth] -> rules
+                           |                        |
+                           +---- head - tail <= depth ----+
+
+  head and tail only ever grow, each is written by one side only. The
+  fast path is a pair of atomic loads and stores. A side only takes the
+  mutex to park, when the ring is full (backpressure) or empty, and the
+  other side only takes it to wake a parked peer.
+
+  Records of different files never share a chunk, each chunk carries the
+  name of its file for bng_input_t.file.
+
+  Records stay valid through the next call, so the engine holds on to a
+  chunk until the call after the one that returned its last record. The
+  ring has a slot more than the requested read-ahead for that chunk.
+
+  The engine may close the ring while the reader waits on a pipe or
+  terminal that may never deliver another line. Closing writes to a
+  wakeup pipe the source polls along with its input (wakeup_fd), so the
+  reader returns and can be joined.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <glib.h>
+
+#include "local-defs.h"
+#include "logger.h"
+#include "input.h"
+
+/* Bytes of records per chunk. A chunk grows beyond it to hold a single
+   larger record. */
+#define RING_CHUNK_SIZE (256 * 1024)
+/* Records per chunk at most. */
+#define RING_CHUNK_RECORDS 4096
+
+typedef struct
+{
+  gchar *buf;
+  gsize size;
+  gsize used;
+  gsize ends[RING_CHUNK_RECORDS]; /* End offset of every record */
+  guint nrec;
+  const gchar *file; /* Sources reading several files: file of the records */
+} chunk_t;
+
+typedef struct
+{
+  bng_input_t input;
+  bng_input_t *source; /* Wrapped source, not owned */
+
+  chunk_t *chunks;
+  guint depth;
+  gint head;           /* Chunks published, written by the reader */
+  gint tail;           /* Chunks released, written by the engine */
+  gint done;           /* Reader finished: 1 end of input, -1 error */
+  gint error;          /* errno of the failed read */
+  gint stop;           /* Engine asks the reader to quit */
+  gint wakeup[2];      /* Pipe interrupting a blocked source->next */
+  gint source_wakeup;  /* wakeup_fd of the source before the ring */
+
+  GThread *thread;
+  GMutex lock;
+  GCond readable;
+  GCond writable;
+  gint reader_waiting;
+  gint engine_waiting;
+
+  /* Engine side */
+  chunk_t *cur;
+  guint cur_rec;
+  gint taken;          /* Chunks the engine moved to, held ones included */
+  chunk_t *held;       /* Previous chunk, its last record is still in use */
+} input_ring_t;
+
+/************* PARKING *************/
+
+static gboolean
+ring_readable (input_ring_t *ring)
+{
+  return g_atomic_int_get (&ring->head) != ring->taken || g_atomic_int_get (&ring->done);
+}
+
+static gboolean
+ring_writable (input_ring_t *ring)
+{
+  return (guint) ring->head - (guint) g_atomic_int_get (&ring->tail) < ring->depth
+    || g_atomic_int_get (&ring->stop);
+}
+
+/* Sleep until ready. waiting is published before the final check so a
+   peer that changes the state afterwards is bound to see it. */
+static void
+ring_park (input_ring_t *ring, GCond *cond, gint *waiting,
+	   gboolean (*ready) (input_ring_t *))
+{
+  g_mutex_lock (&ring->lock);
+  g_atomic_int_set (waiting, 1);
+  while (!ready (ring))
+    g_cond_wait (cond, &ring->lock);
+  g_atomic_int_set (waiting, 0);
+  g_mutex_unlock (&ring->lock);
+}
+
+static void
+ring_wake (input_ring_t *ring, GCond *cond, gint *waiting)
+{
+  if (!g_atomic_int_get (waiting))
+    return;
+
+  g_mutex_lock (&ring->lock);
+  g_cond_signal (cond);
+  g_mutex_unlock (&ring->lock);
+}
+
+/************* READER THREAD *************/
+
+/* Next free chunk, NULL if asked to stop. */
+static chunk_t *
+ring_acquire (input_ring_t *ring)
+{
+  chunk_t *chunk;
+
+  if (!ring_writable (ring))
+    ring_park (ring, &ring->writable, &ring->reader_waiting, ring_writable);
+
+  if (g_atomic_int_get (&ring->stop))
+    return NULL;
+
+  chunk = &ring->chunks[(guint) ring->head % ring->depth];
+  chunk->used = 0;
+  chunk->nrec = 0;
+  return chunk;
+}
+
+static void
+ring_publish (input_ring_t *ring)
+{
+  g_atomic_int_inc (&ring->head);
+  ring_wake (ring, &ring->readable, &ring->engine_waiting);
+}
+
+static gpointer
+ring_read (gpointer data)
+{
+  input_ring_t *ring = data;
+  chunk_t *chunk = NULL;
+  const gchar *rec;
+  gsize len;
+  gint status;
+
+  while ((status = ring->source->next (ring->source, &rec, &len)) > 0)
+    {
+      const gchar *file = ring->source->file ? ring->source->file (ring->source) : NULL;
+
+      /* Publish a chunk when the record does not fit any more, or comes
+	 from another file. */
+      if (chunk && chunk->nrec > 0
+	  && (chunk->used + len > chunk->size || chunk->nrec == RING_CHUNK_RECORDS
+	      || chunk->file != file))
+	{
+	  ring_publish (ring);
+	  chunk = NULL;
+	}
+
+      if (chunk == NULL && (chunk = ring_acquire (ring)) == NULL)
+	return NULL; /* Stopped */
+      chunk->file = file;
+
+      if (len > chunk->size)
+	{
+	  chunk->size = len;
+	  chunk->buf = g_realloc (chunk->buf, chunk->size);
+	}
+
+      memcpy (chunk->buf + chunk->used, rec, len);
+      chunk->used += len;
+      chunk->ends[chunk->nrec++] = chunk->used;
+    }
+
+  if (chunk && chunk->nrec > 0)
+    g_atomic_int_inc (&ring->head);
+
+  ring->error = errno;
+  g_atomic_int_set (&ring->done, status < 0 ? -1 : 1);
+  ring_wake (ring, &ring->readable, &ring->engine_waiting);
+  return NULL;
+}
+
+/************* ENGINE SIDE *************/
+
+static gint
+ring_next (bng_input_t *input, const gchar **rec, gsize *len)
+{
+  input_ring_t *ring = (input_ring_t *) input;
+  gint done;
+
+  if (ring->thread == NULL)
+    ring->thread = g_thread_new ("bungee-input", ring_read, ring);
+
+  /* Records of the call before last are no longer referenced. */
+  if (ring->held)
+    {
+      ring->held = NULL;
+      g_atomic_int_inc (&ring->tail);
+      ring_wake (ring, &ring->writable, &ring->reader_waiting);
+    }
+
+  while (1)
+    {
+      if (ring->cur)
+	{
+	  if (ring->cur_rec < ring->cur->nrec)
+	    {
+	      gsize start = ring->cur_rec ? ring->cur->ends[ring->cur_rec - 1] : 0;
+	      *rec = ring->cur->buf + start;
+	      *len = ring->cur->ends[ring->cur_rec] - start;
+	      ring->cur_rec++;
+	      return 1;
+	    }
+
+	  /* Released next call, the last record is still in use. */
+	  ring->held = ring->cur;
+	  ring->cur = NULL;
+	}
+
+      if (g_atomic_int_get (&ring->head) != ring->taken)
+	{
+	  ring->cur = &ring->chunks[(guint) ring->taken % ring->depth];
+	  ring->cur_rec = 0;
+	  ring->taken++;
+	  continue;
+	}
+
+      /* Everything before done was published before it. */
+      done = g_atomic_int_get (&ring->done);
+      if (done)
+	{
+	  if (g_atomic_int_get (&ring->head) != ring->taken)
+	    continue;
+	  if (done < 0)
+	    {
+	      errno = ring->error;
+	      return -1;
+	    }
+	  return 0;
+	}
+
+      ring_park (ring, &ring->readable, &ring->engine_waiting, ring_readable);
+    }
+}
+
+static const gchar *
+ring_file (bng_input_t *input)
+{
+  input_ring_t *ring = (input_ring_t *) input;
+
+  return ring->cur ? ring->cur->file : NULL;
+}
+
+static void
+ring_close (bng_input_t *input)
+{
+  input_ring_t *ring = (input_ring_t *) input;
+  guint i;
+
+  if (ring->thread)
+    {
+      g_atomic_int_set (&ring->stop, 1);
+      ring_wake (ring, &ring->writable, &ring->reader_waiting);
+      if (write (ring->wakeup[1], "", 1) < 0)
+	BNG_DBG (_("Unable to interrupt the reader of [%s], %s"), ring->input.name,
+		 strerror (errno));
+      g_thread_join (ring->thread);
+    }
+
+  ring->source->wakeup_fd = ring->source_wakeup;
+  close (ring->wakeup[0]);
+  close (ring->wakeup[1]);
+
+  for (i = 0; i < ring->depth; i++)
+    g_free (ring->chunks[i].buf);
+  g_free (ring->chunks);
+
+  g_mutex_clear (&ring->lock);
+  g_cond_clear (&ring->readable);
+  g_cond_clear (&ring->writable);
+  g_free (ring->input.name);
+  g_free (ring);
+}
+
+bng_input_t *
+bng_input_ring_new (bng_input_t *source, guint depth)
+{
+  input_ring_t *ring;
+  guint i;
+
+  if (source == NULL || depth == 0)
+    {
+      errno = EINVAL;
+      return (NULL);
+    }
+
+  ring = g_new0 (input_ring_t, 1);
+  if (pipe (ring->wakeup) != 0)
+    {
+      gint _errno = errno;
+      g_free (ring);
+      errno = _errno;
+      return (NULL);
+    }
+
+  ring->input.name = g_strdup (source->name);
+  ring->input.next = ring_next;
+  ring->input.close = ring_close;
+  ring->input.wakeup_fd = -1;
+  if (source->file)
+    ring->input.file = ring_file;
+  ring->source = source;
+  ring->source_wakeup = source->wakeup_fd;
+  source->wakeup_fd = ring->wakeup[0];
+  ring->depth = depth + 1; /* One more for the held chunk */
+
+  ring->chunks = g_new0 (chunk_t, ring->depth);
+  for (i = 0; i < ring->depth; i++)
+    {
+      ring->chunks[i].size = RING_CHUNK_SIZE;
+      ring->chunks[i].buf = g_malloc (RING_CHUNK_SIZE);
+    }
+
+  g_mutex_init (&ring->lock);
+  g_cond_init (&ring->readable);
+  g_cond_init (&ring->writable);
+
+  return (bng_input_t *) ring;
+}
@@ -0,0 +1,682 @@
+/*
+input.c: native input sources
+
+This file is part of Bungee.
+
+Copyright 2012 Red Hat, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <glib.h>
+#include <zlib.h>
+
+#include "local-defs.h"
+#include "logger.h"
+#include "input.h"
+
+/* Initial read() buffer size for sources that cannot be memory mapped. It
+   doubles whenever a single line does not fit. */
+#define LINES_BUF_SIZE (1024 * 1024)
+
+/* Compressed read() buffer of gzip sources that cannot be memory mapped. */
+#define GZIP_IN_SIZE (256 * 1024)
+/* Mapped compressed data handed to zlib at once, avail_in is 32 bits. */
+#define GZIP_MAP_STEP (1024 * 1024 * 1024)
+/* When splitting, a gzip header found in the data starts a member only if
+   what follows inflates without error to the end of the member, or for
+   this many bytes. A false match fails long before. */
+#define GZIP_CHECK_SIZE (1024 * 1024)
+/* Read-ahead depth of gzip sources, inflating gets a thread of its own. */
+#define GZIP_READAHEAD 4
+
+#define GZIP_MAGIC(p) ((guchar) (p)[0] == 0x1f && (guchar) (p)[1] == 0x8b)
+
+/* Source consumed by the next bng_engine run. */
+static bng_input_t *input_source;
+
+/* Read-ahead depth, see bng_input_ring_new. */
+static guint input_readahead;
+
+/* File of the current record. */
+static gchar *input_filename;
+
+typedef struct input_lines input_lines_t;
+
+typedef struct
+{
+  z_stream z;
+  guchar *in;          /* Compressed data, read() mode only */
+  gboolean in_eof;
+  gboolean member_end; /* Between two members, or before the first */
+} input_gzip_t;
+
+struct input_lines
+{
+  bng_input_t input;
+  gint fd;
+
+  /* mmap mode */
+  const gchar *map;
+  gsize map_len;
+  gsize pos;
+  gsize end;       /* End of this reader's part, map_len unless sharded */
+
+  /* read() mode */
+  gchar *buf;
+  gsize buf_size;
+  gsize buf_start; /* Start of unconsumed data */
+  gsize buf_end;   /* End of valid data */
+  gchar *spare;    /* Previous buffer, may hold the previous record */
+  gsize spare_size;
+  gboolean returned; /* A line was returned from buf */
+  gboolean eof;
+  /* Fill buf, like read(). Inflates gzip sources. */
+  gssize (*fill) (input_lines_t *lines, gchar *buf, gsize size);
+
+  input_gzip_t *gzip;  /* gzip compressed source */
+
+  gboolean skip_blank; /* JSON lines, blank lines are not records */
+};
+
+/* A line of blanks only, when those are skipped. */
+static gboolean
+lines_skip (input_lines_t *lines, const gchar *line, gsize len)
+{
+  gsize i;
+
+  if (!lines->skip_blank)
+    return FALSE;
+
+  for (i = 0; i < len; i++)
+    if (line[i] != ' ' && line[i] != '\t' && line[i] != '\r')
+      return FALSE;
+  return TRUE;
+}
+
+/* Next line from a memory mapped file. memchr is SIMD accelerated in
+   glibc, so the scan runs close to memory bandwidth. */
+static gint
+lines_next_mmap (bng_input_t *input, const gchar **rec, gsize *len)
+{
+  input_lines_t *lines = (input_lines_t *) input;
+  const gchar *start, *nl;
+
+  do
+    {
+      if (lines->pos >= lines->end)
+	return 0;
+
+      start = lines->map + lines->pos;
+      nl = memchr (start, '\n', lines->end - lines->pos);
+      if (nl)
+	{
+	  *len = nl - start;
+	  lines->pos += *len + 1;
+	}
+      else /* Last line without a newline */
+	{
+	  *len = lines->end - lines->pos;
+	  lines->pos = lines->end;
+	}
+    }
+  while (lines_skip (lines, start, *len));
+
+  *rec = start;
+  return 1;
+}
+
+/* Move offset forward to the start of a line. */
+static gsize
+lines_align (input_lines_t *lines, gsize offset)
+{
+  const gchar *nl;
+
+  if (offset == 0 || offset >= lines->map_len)
+    return MIN (offset, lines->map_len);
+
+  if (lines->map[offset - 1] == '\n')
+    return offset;
+
+  nl = memchr (lines->map + offset, '\n', lines->map_len - offset);
+  return nl ? (gsize) (nl - lines->map) + 1 : lines->map_len;
+}
+
+/* Byte range of part index, both ends moved to the next line start. A
+   line belongs to the part its first byte falls in. */
+static void
+lines_shard (bng_input_t *input, guint index, guint count)
+{
+  input_lines_t *lines = (input_lines_t *) input;
+  guint64 len = lines->map_len;
+
+  lines->pos = lines_align (lines, len * index / count);
+  lines->end = lines_align (lines, len * (index + 1) / count);
+}
+
+/* Fill from the file descriptor. */
+static gssize
+lines_fill_read (input_lines_t *lines, gchar *buf, gsize size)
+{
+  gssize n;
+
+  /* Wait for data, or for the owner to give up on it. */
+  if (lines->input.wakeup_fd >= 0)
+    {
+      struct pollfd fds[2] = {
+	{ lines->fd, POLLIN, 0 },
+	{ lines->input.wakeup_fd, POLLIN, 0 }
+      };
+
+      while (poll (fds, 2, -1) < 0)
+	if (errno != EINTR)
+	  return -1;
+
+      if (fds[1].revents)
+	{
+	  errno = EINTR;
+	  return -1;
+	}
+    }
+
+  do
+    n = read (lines->fd, buf, size);
+  while (n < 0 && errno == EINTR);
+
+  return n;
+}
+
+/************* GZIP *************/
+
+/*
+  gzip sources are inflated in to the read() buffer and split in to lines
+  from there. Concatenated members are read one after the other, as gzip
+  does. Memory mapped files are split between workers on member
+  boundaries: a member belongs to the part its header falls in, and a
+  part starts at the first member that passes gzip_check. Members should
+  end with a line, as they do when gzip files are concatenated.
+*/
+
+/* Make at least want bytes of compressed data available to zlib, fewer
+   only at the end of the input. Returns the bytes available, -1 on error
+   with errno set. */
+static gssize
+gzip_input (input_lines_t *lines, gsize want)
+{
+  input_gzip_t *gz = lines->gzip;
+  z_stream *z = &gz->z;
+
+  if (z->avail_in >= want)
+    return z->avail_in;
+
+  if (lines->map)
+    {
+      gsize pos = (const gchar *) z->next_in - lines->map;
+      z->avail_in = MIN (lines->map_len - pos, GZIP_MAP_STEP);
+      return z->avail_in;
+    }
+
+  memmove (gz->in, z->next_in, z->avail_in);
+  z->next_in = gz->in;
+  while (z->avail_in < want && !gz->in_eof)
+    {
+      gssize n = lines_fill_read (lines, (gchar *) gz->in + z->avail_in,
+				  GZIP_IN_SIZE - z->avail_in);
+      if (n < 0)
+	return -1;
+      if (n == 0)
+	gz->in_eof = TRUE;
+      z->avail_in += n;
+    }
+
+  return z->avail_in;
+}
+
+/* Inflate in to buf, member after member. A member is only started when
+   it begins in this reader's part. */
+static gssize
+gzip_fill (input_lines_t *lines, gchar *buf, gsize size)
+{
+  input_gzip_t *gz = lines->gzip;
+  z_stream *z = &gz->z;
+  uInt out = MIN (size, G_MAXUINT32);
+  gssize avail;
+  gint ret;
+
+  z->next_out = (Bytef *) buf;
+  z->avail_out = out;
+
+  while (z->avail_out == out)
+    {
+      if (gz->member_end)
+	{
+	  avail = gzip_input (lines, 2);
+	  if (avail <= 0)
+	    return avail;
+
+	  if (lines->map && (gsize) ((const gchar *) z->next_in - lines->map) >= lines->end)
+	    return 0; /* Next part */
+
+	  if (avail < 2 || !GZIP_MAGIC (z->next_in))
+	    {
+	      BNG_WARN (_("Ignoring trailing garbage after gzip data in [%s]"), lines->input.name);
+	      return 0;
+	    }
+
+	  inflateReset (z);
+	  gz->member_end = FALSE;
+	}
+
+      avail = gzip_input (lines, 1);
+      if (avail < 0)
+	return -1;
+      if (avail == 0)
+	{
+	  BNG_WARN (_("Unexpected end of gzip data in [%s]"), lines->input.name);
+	  errno = EIO;
+	  return -1;
+	}
+
+      ret = inflate (z, Z_NO_FLUSH);
+      if (ret == Z_STREAM_END)
+	gz->member_end = TRUE;
+      else if (ret != Z_OK)
+	{
+	  BNG_WARN (_("Corrupt gzip data in [%s], %s"), lines->input.name,
+		    z->msg ? z->msg : zError (ret));
+	  errno = EIO;
+	  return -1;
+	}
+    }
+
+  return out - z->avail_out;
+}
+
+/* Does a gzip member start at data? See GZIP_CHECK_SIZE. */
+static gboolean
+gzip_check (const gchar *data, gsize len)
+{
+  z_stream z;
+  gchar *out;
+  gsize total = 0;
+  gint ret;
+
+  memset (&z, 0, sizeof (z));
+  if (inflateInit2 (&z, 16 + MAX_WBITS) != Z_OK)
+    return FALSE;
+
+  out = g_malloc (GZIP_IN_SIZE);
+  z.next_in = (Bytef *) data;
+  z.avail_in = MIN (len, GZIP_MAP_STEP);
+  do
+    {
+      z.next_out = (Bytef *) out;
+      z.avail_out = GZIP_IN_SIZE;
+      ret = inflate (&z, Z_NO_FLUSH);
+      total += GZIP_IN_SIZE - z.avail_out;
+    }
+  while (ret == Z_OK && total < GZIP_CHECK_SIZE);
+
+  inflateEnd (&z);
+  g_free (out);
+  return ret == Z_STREAM_END || ret == Z_OK;
+}
+
+/* Offset of the first member starting at or after offset and before
+   limit, limit if there is none. */
+static gsize
+gzip_align (input_lines_t *lines, gsize offset, gsize limit)
+{
+  const gchar *p;
+
+  if (offset == 0)
+    return 0;
+
+  /* A header is 10 bytes: magic, deflate, flags with the reserved bits
+     clear, time, extra flags and OS. The member itself may run past
+     limit. */
+  while (offset < limit
+	 && (p = memchr (lines->map + offset, 0x1f, limit - offset)) != NULL)
+    {
+      offset = p - lines->map;
+      if (offset + 10 <= lines->map_len && GZIP_MAGIC (p) && p[2] == Z_DEFLATED
+	  && (p[3] & 0xe0) == 0 && gzip_check (p, lines->map_len - offset))
+	return offset;
+      offset++;
+    }
+
+  return limit;
+}
+
+static void
+gzip_shard (bng_input_t *input, guint index, guint count)
+{
+  input_lines_t *lines = (input_lines_t *) input;
+  guint64 len = lines->map_len;
+  gsize start;
+
+  /* The part ends before the first member of the next one, a part no
+     member starts in is empty. */
+  lines->end = len * (index + 1) / count;
+  start = gzip_align (lines, len * index / count, lines->end);
+
+  lines->gzip->z.next_in = (Bytef *) lines->map + start;
+  lines->gzip->z.avail_in = 0;
+}
+
+/* Switch lines to inflating what fill reads. */
+static gboolean
+gzip_setup (input_lines_t *lines)
+{
+  input_gzip_t *gz = g_new0 (input_gzip_t, 1);
+
+  if (inflateInit2 (&gz->z, 16 + MAX_WBITS) != Z_OK)
+    {
+      BNG_DBG (_("Unable to inflate [%s], %s"), lines->input.name, gz->z.msg);
+      g_free (gz);
+      errno = ENOMEM;
+      return FALSE;
+    }
+
+  gz->member_end = TRUE;
+  lines->gzip = gz;
+  lines->fill = gzip_fill;
+  lines->input.readahead = GZIP_READAHEAD;
+  return TRUE;
+}
+
+/* First fill of a source that cannot be memory mapped, it tells gzip
+   from text. */
+static gssize
+lines_fill_detect (input_lines_t *lines, gchar *buf, gsize size)
+{
+  gsize got = 0;
+  gssize n;
+
+  size = MIN (size, GZIP_IN_SIZE);
+  while (got < 2)
+    {
+      n = lines_fill_read (lines, buf + got, size - got);
+      if (n < 0)
+	return -1;
+      if (n == 0)
+	break;
+      got += n;
+    }
+
+  if (got < 2 || !GZIP_MAGIC (buf))
+    {
+      lines->fill = lines_fill_read;
+      return got;
+    }
+
+  if (!gzip_setup (lines))
+    return -1;
+  lines->gzip->in = g_malloc (GZIP_IN_SIZE);
+  memcpy (lines->gzip->in, buf, got);
+  lines->gzip->z.next_in = lines->gzip->in;
+  lines->gzip->z.avail_in = got;
+
+  return gzip_fill (lines, buf, size);
+}
+
+/* Next line from a read() buffer. Refills (and grows) the buffer when the
+   unconsumed data holds no complete line. */
+static gint
+lines_next_read (bng_input_t *input, const gchar **rec, gsize *len)
+{
+  input_lines_t *lines = (input_lines_t *) input;
+  gchar *start, *nl;
+
+  while (1)
+    {
+      start = lines->buf + lines->buf_start;
+      nl = memchr (start, '\n', lines->buf_end - lines->buf_start);
+      if (nl || (lines->eof && lines->buf_start < lines->buf_end))
+	{
+	  /* Last line may come without a newline */
+	  *rec = start;
+	  *len = nl ? (gsize) (nl - start) : lines->buf_end - lines->buf_start;
+	  lines->buf_start += nl ? *len + 1 : *len;
+	  if (lines_skip (lines, start, *len))
+	    continue;
+	  lines->returned = TRUE;
+	  return 1;
+	}
+
+      if (lines->eof)
+	return 0;
+
+      /* Move the partial line to the front when no line was returned
+	 from this buffer. Otherwise swap buffers, the previous line must
+	 stay put. Grow when the partial line fills the buffer. */
+      if (lines->buf_start > 0 && !lines->returned)
+	{
+	  memmove (lines->buf, start, lines->buf_end - lines->buf_start);
+	  lines->buf_end -= lines->buf_start;
+	  lines->buf_start = 0;
+	}
+      else if (lines->buf_start > 0)
+	{
+	  gchar *spare = lines->spare;
+	  gsize partial = lines->buf_end - lines->buf_start;
+
+	  if (lines->spare_size < lines->buf_size)
+	    {
+	      g_free (spare);
+	      spare = g_malloc (lines->buf_size);
+	      lines->spare_size = lines->buf_size;
+	    }
+	  memcpy (spare, start, partial);
+
+	  gsize spare_size = lines->spare_size;
+	  lines->spare = lines->buf;
+	  lines->spare_size = lines->buf_size;
+	  lines->buf = spare;
+	  lines->buf_size = spare_size;
+	  lines->buf_end = partial;
+	  lines->buf_start = 0;
+	  lines->returned = FALSE;
+	}
+      else if (lines->buf_end == lines->buf_size)
+	{
+	  lines->buf_size *= 2;
+	  lines->buf = g_realloc (lines->buf, lines->buf_size);
+	}
+
+      gssize n = lines->fill (lines, lines->buf + lines->buf_end,
+			      lines->buf_size - lines->buf_end);
+      if (n < 0)
+	return -1;
+
+      if (n == 0)
+	lines->eof = TRUE;
+      else
+	lines->buf_end += n;
+    }
+}
+
+static void
+lines_close (bng_input_t *input)
+{
+  input_lines_t *lines = (input_lines_t *) input;
+
+  if (lines->gzip)
+    {
+      inflateEnd (&lines->gzip->z);
+      g_free (lines->gzip->in);
+      g_free (lines->gzip);
+    }
+  if (lines->map)
+    munmap ((void *) lines->map, lines->map_len);
+  if (lines->fd > STDERR_FILENO)
+    close (lines->fd);
+
+  g_free (lines->buf);
+  g_free (lines->spare);
+  g_free (lines->input.name);
+  g_free (lines);
+}
+
+bng_input_t *
+bng_input_lines_open (const gchar *path)
+{
+  input_lines_t *lines;
+  struct stat stat_buf;
+  gint fd;
+
+  if (path == NULL || path[0] == '\0')
+    {
+      errno = EINVAL;
+      return (NULL);
+    }
+
+  if (g_strcmp0 (path, "-") == 0)
+    fd = STDIN_FILENO;
+  else
+    fd = open (path, O_RDONLY);
+
+  if (fd < 0)
+    {
+      BNG_DBG (_("Unable to open [%s], %s"), path, strerror (errno));
+      return (NULL);
+    }
+
+  if (fstat (fd, &stat_buf) != 0)
+    {
+      gint _errno = errno;
+      BNG_DBG (_("Unable to stat [%s], %s"), path, strerror (errno));
+      if (fd > STDERR_FILENO)
+	close (fd);
+      errno = _errno;
+      return (NULL);
+    }
+
+  lines = g_new0 (input_lines_t, 1);
+  lines->input.name = g_strdup (path);
+  lines->input.close = lines_close;
+  lines->input.wakeup_fd = -1;
+  lines->fd = fd;
+
+  if (S_ISREG (stat_buf.st_mode) && stat_buf.st_size > 0)
+    {
+      void *map = mmap (NULL, stat_buf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map != MAP_FAILED)
+	{
+	  madvise (map, stat_buf.st_size, MADV_SEQUENTIAL);
+	  lines->map = map;
+	  lines->map_len = stat_buf.st_size;
+	  lines->end = lines->map_len;
+
+	  if (lines->map_len < 2 || !GZIP_MAGIC (lines->map))
+	    {
+	      lines->input.next = lines_next_mmap;
+	      lines->input.shard = lines_shard;
+	      return (bng_input_t *) lines;
+	    }
+
+	  /* Inflated in to the read() buffer, see gzip_fill. */
+	  if (!gzip_setup (lines))
+	    {
+	      gint _errno = errno;
+	      lines_close ((bng_input_t *) lines);
+	      errno = _errno;
+	      return (NULL);
+	    }
+	  lines->gzip->z.next_in = (Bytef *) lines->map;
+	  lines->input.shard = gzip_shard;
+	}
+      else
+	BNG_DBG (_("Unable to mmap [%s], %s. Falling back to read()"), path, strerror (errno));
+    }
+
+  if (lines->map == NULL)
+    {
+      posix_fadvise (fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+      lines->fill = lines_fill_detect;
+    }
+  lines->buf_size = LINES_BUF_SIZE;
+  lines->buf = g_malloc (lines->buf_size);
+  lines->input.next = lines_next_read;
+
+  return (bng_input_t *) lines;
+}
+
+bng_input_t *
+bng_input_jsonl_open (const gchar *path)
+{
+  input_lines_t *lines = (input_lines_t *) bng_input_lines_open (path);
+
+  if (lines)
+    lines->skip_blank = TRUE;
+  return (bng_input_t *) lines;
+}
+
+void
+bng_input_close (bng_input_t *input)
+{
+  if (input)
+    input->close (input);
+}
+
+void
+bng_input_set_source (bng_input_t *input)
+{
+  if (input_source && input_source != input)
+    bng_input_close (input_source);
+
+  input_source = input;
+}
+
+bng_input_t *
+bng_input_get_source (void)
+{
+  return input_source;
+}
+
+void
+bng_input_set_readahead (guint depth)
+{
+  input_readahead = depth;
+}
+
+guint
+bng_input_get_readahead (void)
+{
+  return input_readahead;
+}
+
+void
+bng_input_set_filename (const gchar *name)
+{
+  if (name == input_filename)
+    return;
+
+  g_free (input_filename);
+  input_filename = g_strdup (name);
+}
+
+const gchar *
+bng_input_get_filename (void)
+{
+  return input_filename;
+}
@@ -0,0 +1,116 @@
+/*
+input.h: native input sources
+
+This file is part of Bungee.
+
+Copyright 2012 Red Hat, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef _INPUT_H
+#define _INPUT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A native input source feeds records to bng_engine without going
+   through a Python INPUT hook. */
+typedef struct bng_input bng_input_t;
+
+struct bng_input
+{
+  gchar *name; /* Used in log messages only. */
+
+  /* Point rec and len to the next record. Returns 1 on success, 0 at the
+     end of input and -1 on error with errno set. The record stays valid
+     through the next call, until the one after it, so the previous
+     record can still be read while the next one is fetched. */
+  gint (*next) (bng_input_t *input, const gchar **rec, gsize *len);
+
+  /* Optional. Restrict the source to part index of count roughly equal
+     parts, split on record boundaries, so parallel workers can each read
+     their own part. NULL when the source cannot be split. */
+  void (*shard) (bng_input_t *input, guint index, guint count);
+
+  /* Read-ahead depth the source asks for at least, whatever
+     bng_input_set_readahead says. Sources that spend CPU time on every
+     byte, like inflating, set it to be read in a thread of their own. */
+  guint readahead;
+
+  /* Optional. Sources reading several files: name of the file the record
+     next returned last comes from. The name stays valid until the source
+     is closed, a different file has a different pointer. NULL when the
+     source is a single file, input->name tells which then. */
+  const gchar *(*file) (bng_input_t *input);
+
+  /* Read end of a pipe the owner writes to from another thread when it
+     no longer wants the records, -1 when there is none. A next call
+     waiting on a pipe or terminal then fails with EINTR instead of
+     blocking until more input comes. Set by the owner before reading,
+     sources reading through others pass it on. */
+  gint wakeup_fd;
+
+  /* Release the source and everything it holds. */
+  void (*close) (bng_input_t *input);
+};
+
+/* Line reader. Memory maps regular files, falls back to large read()
+   buffers for pipes and terminals. "-" reads stdin. Records are lines
+   without the trailing newline. Memory mapped files can be sharded.
+   gzip compressed input, told by its magic bytes, is inflated on the
+   fly, concatenated members included. Compressed files are sharded on
+   member boundaries and read ahead in a thread of their own. Returns
+   NULL with errno set on error. */
+bng_input_t *bng_input_lines_open (const gchar *path);
+
+/* JSON lines reader, a line reader that skips blank lines. Records are
+   read as JSON objects by Bungee.json on demand. */
+bng_input_t *bng_input_jsonl_open (const gchar *path);
+
+/* Every file pattern expands to, like the shell does (wordexp),
+   directories to the files in them, read in turn by line readers. Once
+   sharded, the files are handed out largest first to whichever worker
+   asks next, large ones cut in to several parts. Returns NULL with errno
+   set on error. */
+bng_input_t *bng_input_files_open (const gchar *pattern);
+
+/* Read ahead of the engine in a separate thread, buffering up to depth
+   chunks of records. The source keeps its owner, it must outlive the
+   returned input and not be used while it is open. Closing the returned
+   input interrupts a read the source is blocked in, see wakeup_fd. */
+bng_input_t *bng_input_ring_new (bng_input_t *source, guint depth);
+
+void bng_input_close (bng_input_t *input);
+
+/* Source the next bng_engine run reads from. Setting a new source closes
+   the previous one. NULL selects the INPUT hook again. */
+void bng_input_set_source (bng_input_t *input);
+bng_input_t *bng_input_get_source (void);
+
+/* Chunks of records native sources read ahead of the engine, in a
+   thread of their own. 0 (default) reads in the engine thread. */
+void bng_input_set_readahead (guint depth);
+guint bng_input_get_readahead (void);
+
+/* Name of the file the engine reads the current record from, AWK's
+   FILENAME. NULL outside native sources. */
+void bng_input_set_filename (const gchar *name);
+const gchar *bng_input_get_filename (void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _INPUT_H */
@@ -0,0 +1,46 @@
+/*
+json.h: Structural index of JSON lines
+
+This file is part of Bungee.
+
+Copyright 2012 Red Hat, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef _JSON_H
+#define _JSON_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A member of the top level object, as offsets in to the record. The
+   key excludes its quotes, the value is the JSON text of the value. */
+typedef struct
+{
+  gsize key_start;
+  gsize key_len;
+  gsize value_start;
+  gsize value_len;
+  gboolean key_escaped;    /* Key holds backslash escapes */
+  gboolean value_escaped;  /* String value holds backslash escapes */
+} bng_json_member_t;
+
+gint bng_json_index (const gchar *rec, gsize len, GArray *members);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _JSON_H */
@@ -26,13 +26,29 @@ limitations under the License.
 #include <errno.h>
 #include <wordexp.h>
 #include <glib.h>
+#include <marshal.h>
 
 #include "local-defs.h"
 #include "logger.h"
 #include "python-embedding.h"
+#include "python-bungee-globals.h"
+#include "python-bungee-record.h"
+#include "python-module-rules.h"
 #include "parser-interface.h"
+#include "compile-cache.h"
+#include "input.h"
+#include "parallel.h"
 #include "libbungee.h"
 
+/* Records handed over per INPUT call in batched mode. 0 disables batching. */
+static gint engine_batch_size;
+
+/* Worker processes of a parallel run. 0 or 1 runs in this process. */
+static gint engine_jobs;
+
+/* Records sent to a worker at a time when batching is disabled. */
+#define ENGINE_DISPATCH_SIZE 1024
+
 /* Evaluate bungee code */
 gint
 bng_eval (const gchar *code)
@@ -44,73 +60,232 @@ bng_eval (const gchar *code)
       return 1;
     }
 
+  /* Evaluated code may redefine hooks in __main__. */
+  bng_py_hooks_invalidate ();
+
   if (PyRun_SimpleString (code) == 0)
     return 0;
   else
     return 1;
 }
 
+/* Compile generated Python source to a code object. Returns a new
+   reference or NULL with a Python exception set. */
+static PyObject *
+load_compile (const gchar *code, const gchar *script_name)
+{
+  return Py_CompileString (code, script_name, Py_file_input);
+}
+
+/* Execute a compiled script in __main__, the way PyRun_SimpleFile would,
+   with __file__ set while it runs. */
+static gint
+load_eval (PyObject *py_code, const gchar *script_name)
+{
+  PyObject *_mod_main, *_main_dict, *py_file, *py_result;
+
+  /* Barrowed reference to main module*/
+  _mod_main = PyImport_AddModule ("__main__");
+  if (_mod_main == NULL)
+    return 1;
+  _main_dict = PyModule_GetDict (_mod_main);
+
+  py_file = PyUnicode_DecodeFSDefault (script_name);
+  if (py_file == NULL || PyDict_SetItemString (_main_dict, "__file__", py_file) != 0)
+    {
+      Py_XDECREF (py_file);
+      PyErr_Print ();
+      return 1;
+    }
+  Py_DECREF (py_file);
+
+  /* Script is about to (re)define hooks in __main__. */
+  bng_py_hooks_invalidate ();
+
+  py_result = PyEval_EvalCode (py_code, _main_dict, _main_dict);
+  if (py_result == NULL)
+    PyErr_Print ();
+  Py_XDECREF (py_result);
+
+  if (PyDict_DelItemString (_main_dict, "__file__") != 0)
+    PyErr_Clear ();
+
+  if (py_result == NULL)
+    return 1;
+
+  bng_py_hooks_resolve ();
+  return 0;
+}
+
+/* Cache suffix of marshalled code objects, tied to the running
+   interpreter's bytecode magic number. */
+static gchar *
+load_code_suffix (void)
+{
+  return g_strdup_printf ("-%08lx.bngc", (gulong) PyImport_GetMagicNumber () & 0xffffffffUL);
+}
+
+/* Look up a marshalled code object in the compile cache. Returns a new
+   reference or NULL on a miss, without a Python exception set. */
+static PyObject *
+load_cached_code (const gchar *key)
+{
+  GMappedFile *mapped;
+  gchar *suffix, *path;
+  PyObject *py_code = NULL;
+
+  suffix = load_code_suffix ();
+  path = bng_cache_path (key, suffix);
+  g_free (suffix);
+  if (path == NULL)
+    return NULL;
+
+  mapped = g_mapped_file_new (path, FALSE, NULL);
+  if (mapped != NULL)
+    {
+      if (g_mapped_file_get_length (mapped) > 0)
+	py_code = PyMarshal_ReadObjectFromString (g_mapped_file_get_contents (mapped),
+						  g_mapped_file_get_length (mapped));
+      g_mapped_file_unref (mapped);
+
+      if (py_code != NULL && !PyCode_Check (py_code))
+	Py_CLEAR (py_code);
+      if (py_code == NULL)
+	{
+	  BNG_DBG (_("Ignoring corrupt cache entry [%s]"), path);
+	  PyErr_Clear ();
+	}
+    }
+
+  g_free (path);
+  return py_code;
+}
+
+/* Store a marshalled code object in the compile cache. */
+static void
+load_store_code (const gchar *key, PyObject *py_code)
+{
+  PyObject *py_data;
+  gchar *suffix;
+
+  py_data = PyMarshal_WriteObjectToString (py_code, Py_MARSHAL_VERSION);
+  if (py_data == NULL)
+    {
+      PyErr_Clear ();
+      return;
+    }
+
+  suffix = load_code_suffix ();
+  bng_cache_store (key, suffix, PyBytes_AS_STRING (py_data), PyBytes_GET_SIZE (py_data));
+  g_free (suffix);
+  Py_DECREF (py_data);
+}
+
+/* Code object of a .bng source: from the compile cache if possible,
+   otherwise compiled and added to the cache. Returns a new reference or
+   NULL. */
+static PyObject *
+load_code (const gchar *source, gsize source_len, const gchar *script_name)
+{
+  gchar *key, *path;
+  gchar *code = NULL; /* Compiler output */
+  gchar *cached = NULL; /* Cached compiler output */
+  gsize code_len = 0;
+  PyObject *py_code;
+
+  key = bng_cache_key (source, source_len);
+
+  py_code = load_cached_code (key);
+  if (py_code != NULL)
+    goto END;
+
+  /* Generated Python, left behind by bng_compile_file or an earlier
+     load under a different interpreter. */
+  path = bng_cache_path (key, BNG_CACHE_SUFFIX_SOURCE);
+  if (path != NULL)
+    {
+      if (g_file_get_contents (path, &cached, &code_len, NULL))
+	code = cached;
+      g_free (path);
+    }
+
+  if (cached == NULL
+      && bng_compile_string (source, source_len, script_name, &code, &code_len, stderr) != 0)
+    {
+      BNG_DBG (_("Failed to compile %s script, %s"), script_name, strerror (errno));
+      goto END;
+    }
+
+  py_code = load_compile (code, script_name);
+  if (py_code == NULL)
+    {
+      PyErr_Print ();
+      goto END;
+    }
+
+  if (cached == NULL)
+    bng_cache_store (key, BNG_CACHE_SUFFIX_SOURCE, code, code_len);
+  load_store_code (key, py_code);
+
+ END:
+  if (cached != NULL)
+    g_free (cached);
+  else
+    free (code);
+  g_free (key);
+  return py_code;
+}
+
 /*************************/
 /* Load bungee extension */
 /*************************/
 gint
 bng_load (const gchar *script_name)
 {
-  struct stat stat_buf;
   wordexp_t exp_script_name;
+  gboolean expanded = FALSE;
   const gchar *_script_name = NULL;
   gint status = 0;
+  gchar *source = NULL;
+  gsize source_len = 0;
+  PyObject *py_code = NULL;
 
   if (wordexp(script_name, &exp_script_name, 0) == 0)
-    _script_name = exp_script_name.we_wordv[0];
+    {
+      expanded = TRUE;
+      _script_name = exp_script_name.we_wordv[0];
+    }
   else
     _script_name = script_name;
 
-  if (stat (_script_name, &stat_buf) !=0)
+  if (!g_file_get_contents (_script_name, &source, &source_len, NULL))
     {
       status = 1; /* File likely doesn't exist */
       goto END;
     }
 
-  if (stat_buf.st_size == 0)
-    {
-      status = 1;
-      goto END;
-    }
-
-  FILE* script_fp = fopen (_script_name, "r");
-  if (script_fp == NULL)
-    {
-      BNG_DBG (_("Unable to read [%s], %s"), _script_name, strerror (errno));
-      status = 1;
-      goto END;
-    }
-
-  FILE *out_fp = tmpfile ();
-
-  if (out_fp == NULL)
+  if (source_len == 0)
     {
-      BNG_DBG (_("Unable to create temporary file, %s"), strerror (errno));
       status = 1;
       goto END;
     }
 
-  if (bng_compile (script_fp, _script_name, out_fp, stderr) != 0)
+  py_code = load_code (source, source_len, _script_name);
+  if (py_code == NULL)
     {
-      BNG_DBG (_("Failed to compile %s script, %s"), _script_name, strerror (errno));
       status = 1;
       goto END;
     }
 
-  fclose (script_fp); /* Source no longer needed. */
-  rewind (out_fp); /* Rewind from compiler output to execute the script. */
-
-  status = PyRun_SimpleFileEx (out_fp, _script_name, TRUE);
+  status = load_eval (py_code, _script_name);
   if (status != 0)
     BNG_DBG (_("Failed to execute %s script"), _script_name);
 
  END:
-  wordfree (&exp_script_name);
+  Py_XDECREF (py_code);
+  g_free (source);
+  if (expanded)
+    wordfree (&exp_script_name);
   return (status);
 }
 
@@ -121,7 +296,11 @@ bng_load (const gchar *script_name)
 gint
 bng_init (bng_console_t msg, bng_console_t log, bng_log_level_t log_level)
 {
-  bng_console_init (msg, log, log_level);
+  if (bng_console_init (msg, log, log_level) != 0)
+    {
+      BNG_ERR (_("Unable to open log targets, %s"), strerror (errno));
+      return 1;
+    }
 
   if (PY_MAJOR_VERSION < 3)
     {
@@ -143,6 +322,7 @@ bng_fini (void)
 {
   bng_py_fini ();
   Py_Finalize ();
+  bng_console_fini ();
 
   return 0;
 }
@@ -151,43 +331,494 @@ bng_fini (void)
 /*********************************/
 /* Bungee core execution loop    */
 /*********************************/
+void
+bng_engine_set_batch (gint size)
+{
+  engine_batch_size = (size > 0) ? size : 0;
+}
+
+gint
+bng_engine_get_batch (void)
+{
+  return engine_batch_size;
+}
+
+void
+bng_engine_set_jobs (gint jobs)
+{
+  engine_jobs = (jobs > 1) ? jobs : 0;
+}
+
+gint
+bng_engine_get_jobs (void)
+{
+  return engine_jobs;
+}
+
+/* Process a single record: make it current and evaluate the rules. NULL
+   record means INPUT produced it through side effects (classic protocol),
+   so $0 is left untouched. */
+static gint
+engine_eval (PyObject *record)
+{
+  if (record && bungee_globals_set_record (record) != 0)
+    return 1;
+
+  if (mod_rules_eval () != 0)
+    return 1;
+
+  return 0;
+}
+
+/* Records not yet sent to the workers, coordinator of a parallel run only. */
+static PyObject *engine_pending;
+
+/* Send the pending records to the next worker. */
+static gint
+engine_flush (void)
+{
+  if (PyList_GET_SIZE (engine_pending) == 0)
+    return 0;
+
+  if (bng_parallel_send (engine_pending) != 0)
+    return 1;
+
+  return PyList_SetSlice (engine_pending, 0, PyList_GET_SIZE (engine_pending), NULL);
+}
+
+/* Coordinator of a parallel run: queue the record for the workers
+   instead of evaluating it. */
+static gint
+engine_dispatch (PyObject *record)
+{
+  gint size = engine_batch_size ? engine_batch_size : ENGINE_DISPATCH_SIZE;
+
+  /* Classic INPUT left the record in $0. */
+  if (record == NULL)
+    record = bungee_globals_get_record ();
+  if (record == NULL)
+    {
+      PyErr_SetString (PyExc_RuntimeError, "INPUT returned True without setting $0");
+      return 1;
+    }
+
+  /* Workers get str, records only live as long as the input buffer. */
+  if (bungee_record_check (record))
+    record = bungee_record_text (record);
+  if (record == NULL || PyList_Append (engine_pending, record) != 0)
+    return 1;
+
+  if (PyList_GET_SIZE (engine_pending) < size)
+    return 0;
+
+  return engine_flush ();
+}
+
+/* Where the input loops hand every record: engine_eval, or
+   engine_dispatch while coordinating workers. */
+static gint (*engine_record) (PyObject *record) = engine_eval;
+
+/* Records moved on from file ended to file started, either may be NULL:
+   run the ENDFILE and BEGINFILE hooks the script declares. */
+static gint
+engine_file (const gchar *ended, const gchar *started)
+{
+  PyObject *py_val;
+
+  if (ended)
+    {
+      py_val = bng_py_hook_call (BNG_HOOK_ENDFILE, NULL);
+      if (py_val == NULL && PyErr_Occurred ())
+	return 1;
+      Py_XDECREF (py_val);
+    }
+
+  if (started)
+    {
+      bng_input_set_filename (started);
+      py_val = bng_py_hook_call (BNG_HOOK_BEGINFILE, NULL);
+      if (py_val == NULL && PyErr_Occurred ())
+	return 1;
+      Py_XDECREF (py_val);
+    }
+
+  return 0;
+}
+
+/* Feed every record of a native input source to the engine. Records are
+   Bungee.Record objects over the bytes the source returned, decoded only
+   when a rule asks for a str. With read-ahead enabled, or asked for by
+   the source, the source is read by a thread of its own. Where the rules
+   are evaluated, BEGINFILE runs before the first record of every file
+   and ENDFILE after the last one. */
+static gint
+engine_native (bng_input_t *input)
+{
+  bng_input_t *ring = NULL;
+  PyObject *py_prev = NULL;
+  guint depth = MAX (bng_input_get_readahead (), input->readahead);
+  gboolean hooks = (engine_record == engine_eval);
+  const gchar *file = NULL;
+  const gchar *rec;
+  gsize len;
+  gint status;
+
+  if (depth > 0)
+    {
+      ring = bng_input_ring_new (input, depth);
+      if (ring)
+	input = ring;
+      else
+	BNG_DBG (_("Unable to read [%s] ahead, %s"), input->name, strerror (errno));
+    }
+
+  bng_input_set_filename (NULL);
+
+  while ((status = input->next (input, &rec, &len)) > 0)
+    {
+      PyObject *py_rec;
+
+      if (hooks)
+	{
+	  /* Single file sources are one file, named after the source. */
+	  const gchar *rec_file = input->file ? input->file (input) : input->name;
+
+	  if (rec_file != file && engine_file (file, rec_file) != 0)
+	    {
+	      status = 1;
+	      break;
+	    }
+	  file = rec_file;
+	}
+
+      py_rec = bungee_record_new (rec, len);
+      if (py_rec == NULL)
+	break;
+
+      status = engine_record (py_rec);
+
+      /* The source reuses the bytes of the previous record next call. */
+      if (py_prev && bungee_record_release (py_prev) != 0)
+	status = 1;
+      py_prev = py_rec;
+      if (status != 0)
+	break;
+    }
+
+  if (status < 0)
+    PyErr_SetFromErrnoWithFilename (PyExc_OSError, input->name);
+  else if (status == 0 && engine_file (file, NULL) != 0)
+    status = 1;
+
+  /* $0 keeps the last record after the source is closed. */
+  if (py_prev && bungee_record_release (py_prev) != 0 && status == 0)
+    status = 1;
+
+  bng_input_close (ring);
+  return (status == 0) ? 0 : -1;
+}
+
+/* Feed every record of a batch returned by INPUT to the engine. Lists and
+   tuples are walked in place, any other iterable is drained
+   engine_batch_size records at a time. Returns the number of records
+   processed or -1 on error. A str or bytes is one record, not a batch of
+   characters. */
+static gssize
+engine_batch (PyObject *py_batch)
+{
+  gssize count = 0;
+
+  if (PyUnicode_Check (py_batch) || PyBytes_Check (py_batch))
+    return (engine_record (py_batch) == 0) ? 1 : -1;
+
+  if (PyList_CheckExact (py_batch) || PyTuple_CheckExact (py_batch))
+    {
+      PyObject *py_seq = PySequence_Fast (py_batch, "");
+      if (py_seq == NULL)
+	return -1;
+
+      Py_ssize_t i;
+      for (i = 0; i < PySequence_Fast_GET_SIZE (py_seq); i++)
+	{
+	  PyObject *py_rec = PySequence_Fast_GET_ITEM (py_seq, i);
+	  Py_INCREF (py_rec); /* Rules may modify the batch under us. */
+	  gint status = engine_record (py_rec);
+	  Py_DECREF (py_rec);
+	  if (status != 0)
+	    {
+	      Py_DECREF (py_seq);
+	      return -1;
+	    }
+	  count++;
+	}
+      Py_DECREF (py_seq);
+      return count;
+    }
+
+  PyObject *py_iter = PyObject_GetIter (py_batch);
+  if (py_iter == NULL)
+    return -1;
+
+  PyObject *py_buf = PyList_New (0);
+  if (py_buf == NULL)
+    {
+      Py_DECREF (py_iter);
+      return -1;
+    }
+
+  /* Let the producer run in bursts, then evaluate the whole burst. */
+  while (1)
+    {
+      PyObject *py_rec;
+      while (PyList_GET_SIZE (py_buf) < engine_batch_size
+	     && (py_rec = PyIter_Next (py_iter)) != NULL)
+	{
+	  gint status = PyList_Append (py_buf, py_rec);
+	  Py_DECREF (py_rec);
+	  if (status != 0)
+	    break;
+	}
+
+      if (PyErr_Occurred ())
+	{
+	  count = -1;
+	  break;
+	}
+
+      if (PyList_GET_SIZE (py_buf) == 0)
+	break;
+
+      gssize n = engine_batch (py_buf);
+      if (n < 0)
+	{
+	  count = -1;
+	  break;
+	}
+      count += n;
+
+      if (PyList_SetSlice (py_buf, 0, PyList_GET_SIZE (py_buf), NULL) != 0)
+	{
+	  count = -1;
+	  break;
+	}
+    }
+
+  Py_DECREF (py_buf);
+  Py_DECREF (py_iter);
+  return count;
+}
+
+/* Body of a worker process of a parallel run: evaluate the rules over
+   its part of a split source, or over the batches the coordinator sends,
+   then report the globals and exit. */
+static void G_GNUC_NORETURN
+engine_worker (bng_input_t *input, guint index)
+{
+  gint status = 0;
+
+  if (input && input->shard)
+    {
+      input->shard (input, index, engine_jobs);
+      status = engine_native (input);
+    }
+  else
+    {
+      PyObject *py_batch;
+
+      while ((py_batch = bng_parallel_recv ()) != NULL)
+	{
+	  gssize count = engine_batch (py_batch);
+	  Py_DECREF (py_batch);
+	  if (count < 0)
+	    break;
+	}
+      if (PyErr_Occurred ())
+	status = -1;
+    }
+
+  if (status != 0)
+    PyErr_Print ();
+
+  bng_input_set_source (NULL);
+  bng_parallel_exit (status != 0);
+}
+
+/* Coordinator of a parallel run: hand over the last records and merge
+   the globals of the workers. */
+static gint
+engine_join (void)
+{
+  gint status = 0;
+
+  if (engine_pending)
+    {
+      status = engine_flush ();
+      Py_CLEAR (engine_pending);
+    }
+  engine_record = engine_eval;
+
+  if (status != 0)
+    {
+      PyErr_Print ();
+      bng_parallel_abort ();
+      return 1;
+    }
+
+  return bng_parallel_join ();
+}
+
 gint
 bng_engine (void)
 {
+  PyObject *py_val, *py_input = NULL;
+  bng_input_t *input;
+  gboolean forked = FALSE;
+
+  /* Hooks are looked up once here, not for every record. */
+  if (bng_py_hooks_resolve () != 0)
+    return 1;
+
   /* BEGIN hook is optional */
-  PyObject *py_val;
   py_val = bng_py_hook_call (BNG_HOOK_BEGIN, NULL);
+  if (py_val == NULL && PyErr_Occurred ())
+    {
+      PyErr_Print ();
+      return 1;
+    }
   Py_XDECREF (py_val);
 
+  /* Flatten the rules declared by the script (and BEGIN) for the loop. */
+  if (mod_rules_compile () != 0)
+    return 1;
+
+  /* A native source selected by the script (Bungee.input.*) replaces INPUT. */
+  input = bng_input_get_source ();
+  if (input)
+    {
+      if (bng_py_hook_get (BNG_HOOK_INPUT))
+	BNG_DBG (_("Native input source [%s] selected, [%s] hook is ignored"),
+		 input->name, BNG_HOOK_INPUT);
+    }
+  else
+    {
+      /* Hold our own reference, BEGIN or INPUT may rebind the name. */
+      py_input = bng_py_hook_get (BNG_HOOK_INPUT);
+      if (py_input == NULL)
+	{
+	  BNG_DBG (_("[%s] hook is required to feed data"), BNG_HOOK_INPUT);
+	  return 1;
+	}
+      Py_INCREF (py_input);
+    }
+
+  /* Parallel run: workers start from the state BEGIN left behind and
+     evaluate the rules, this process only feeds them. */
+  if (engine_jobs > 1)
+    {
+      gint worker = bng_parallel_fork (engine_jobs);
+      if (worker == -2)
+	goto ERROR;
+      if (worker >= 0)
+	engine_worker (input, worker);
+      forked = TRUE;
+
+      /* Workers read their own parts of a split source. */
+      if (input && input->shard)
+	{
+	  bng_input_set_source (NULL);
+	  goto FINISH;
+	}
+
+      engine_pending = PyList_New (0);
+      if (engine_pending == NULL)
+	goto ERROR;
+      engine_record = engine_dispatch;
+    }
+
+  if (input)
+    {
+      gint status = engine_native (input);
+      bng_input_set_source (NULL); /* Sources are consumed by one run. */
+      if (status != 0)
+	goto ERROR;
+
+      goto FINISH;
+    }
+
   /*
     Heart of Bungee!. As data flows from INPUT hook, call MATCH and TARGET appropriately.
+
+    Classic protocol: INPUT returns True for every record it produced.
+    Batched protocol (Bungee.batch(N) with N > 0): INPUT may also return a
+    list, tuple or iterator of records, which are all evaluated before
+    INPUT is called again. An empty batch ends the input. A generator
+    (INPUT that yields) is the whole input stream and is drained once.
    */
   while (1)
     {
-      py_val = bng_py_hook_call (BNG_HOOK_INPUT, NULL);
+      py_val = bng_py_call_noargs (py_input);
 
       /* Some error occured */
       if (py_val == NULL)
+	goto ERROR;
+
+      if (py_val == Py_True)
 	{
-	  PyErr_Print ();
-	  return 1;
+	  Py_DECREF (py_val);
+	  if (engine_record (NULL) != 0)
+	    goto ERROR;
+	  continue;
 	}
 
       /* No more data to process. Reached end of data source. */
-      if (py_val != Py_True)
+      if (engine_batch_size == 0 || py_val == Py_None || py_val == Py_False)
 	{
-	  Py_XDECREF (py_val);
+	  Py_DECREF (py_val);
 	  break;
 	}
 
-      Py_XDECREF (py_val);
+      gboolean is_stream = PyGen_Check (py_val);
+      gssize count = engine_batch (py_val);
+      Py_DECREF (py_val);
+
+      if (count < 0)
+	goto ERROR;
+
+      if (count == 0 || is_stream)
+	break;
+    }
+  Py_CLEAR (py_input);
+
+ FINISH:
+  /* Merge the results of the workers before END sees them. */
+  if (forked)
+    {
+      forked = FALSE;
+      if (engine_join () != 0)
+	goto ERROR;
     }
 
   /* END hook is optional */
   py_val = bng_py_hook_call (BNG_HOOK_END, NULL);
+  if (py_val == NULL && PyErr_Occurred ())
+    {
+      PyErr_Print ();
+      return 1;
+    }
   Py_XDECREF (py_val);
 
   return 0;
+
+ ERROR:
+  PyErr_Print ();
+  Py_XDECREF (py_input);
+  if (forked)
+    {
+      Py_CLEAR (engine_pending);
+      engine_record = engine_eval;
+      bng_parallel_abort ();
+    }
+  return 1;
 }
 
 /*********************************/
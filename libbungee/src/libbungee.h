@@ -29,6 +29,8 @@ extern "C" {
 #define BNG_HOOK_BEGIN  "BEGIN"
 #define BNG_HOOK_END    "END"
 #define BNG_HOOK_INPUT  "INPUT"
+#define BNG_HOOK_BEGINFILE "BEGINFILE"
+#define BNG_HOOK_ENDFILE   "ENDFILE"
 
 /* bng_rc can be NULL or /path/to/.bngrc */
 gint bng_init (bng_console_t msg, bng_console_t log, bng_log_level_t log_level);
@@ -36,6 +38,18 @@ gint bng_fini (void);
 gint bng_eval (const gchar *code);
 gint bng_load (const gchar *path);
 gint bng_run (const gchar *script_name);
+gint bng_engine (void);
+
+/* Number of records INPUT hands over per call. 0 (default) selects the
+   classic protocol where INPUT returns True for every record. */
+void bng_engine_set_batch (gint size);
+gint bng_engine_get_batch (void);
+
+/* Number of worker processes bng_engine forks after BEGIN. Workers
+   share the input and their globals are merged before END. 0 or 1
+   (default) runs everything in this process. */
+void bng_engine_set_jobs (gint jobs);
+gint bng_engine_get_jobs (void);
 
 #ifdef __cplusplus
 }
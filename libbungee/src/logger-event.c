@@ -0,0 +1,626 @@
+/*
+logger-event.c: Binary log events
+
+This file is part of Bungee.
+
+Copyright 2012 Red Hat, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+/*
+  In binary mode a log call does not format anything. The format string
+  is registered once and gets an id, the call only copies its arguments:
+  integers and pointers as 8 bytes, doubles as 8 bytes, strings as a
+  length and the bytes. Text is rendered from the same record later, by
+  the flusher for text targets or by bungee --decode-log.
+
+  A binary log file is a sequence of records, each starting with a type
+  byte, in the byte order of the machine that wrote it:
+
+    'H' "BNGLOG\0" u32 0x01020304   start of a run, forget all formats
+    'S' u32 pid                     records up to the next 'S' are from pid
+    'F' u32 id u32 len format       format id of the current pid
+    'E' u32 len bng_log_event_t args
+
+  Every batch a process writes starts with an 'S' record, workers of a
+  --jobs run may append to the same file. A format is written before the
+  first event that uses it, once per file and process.
+*/
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <glib.h>
+
+#include "local-defs.h"
+#include "logger.h"
+#include "logger-event.h"
+
+#define LOG_FILE_MAGIC "BNGLOG"
+#define LOG_FILE_BYTE_ORDER 0x01020304
+
+/* Argument types, as passed through ... */
+enum {
+  ARG_INT,
+  ARG_LONG,
+  ARG_LLONG,
+  ARG_SIZE,
+  ARG_INTMAX,
+  ARG_PTRDIFF,
+  ARG_DOUBLE,
+  ARG_LDOUBLE,
+  ARG_STRING,
+  ARG_POINTER
+};
+
+#define ARG_STRING_NULL G_MAXUINT32
+
+static GMutex registry_lock;
+static GHashTable *registry;  /* format address -> bng_log_format_t */
+static GPtrArray *formats;    /* id -> bng_log_format_t */
+
+/************* FORMAT STRINGS *************/
+
+/* Parse the conversion following a '%'. Returns the conversion character
+   and the types of the arguments it takes, stars first. NULL when the
+   conversion is not supported (positional arguments, %n, %m, wide
+   strings). */
+static const gchar *
+format_spec (const gchar *p, guint8 *types, guint *ntypes)
+{
+  gint length = 0;
+  guint n = 0;
+
+  while (*p && strchr ("-+ #0'I", *p))
+    p++;
+
+  if (*p == '*')
+    {
+      types[n++] = ARG_INT;
+      p++;
+    }
+  else
+    {
+      while (g_ascii_isdigit (*p))
+	p++;
+      if (*p == '$')
+	return NULL;
+    }
+
+  if (*p == '.')
+    {
+      p++;
+      if (*p == '*')
+	{
+	  types[n++] = ARG_INT;
+	  p++;
+	}
+      else
+	while (g_ascii_isdigit (*p))
+	  p++;
+    }
+
+  switch (*p)
+    {
+    case 'h':
+      length = 'h';
+      p += (p[1] == 'h') ? 2 : 1;
+      break;
+    case 'l':
+      length = (p[1] == 'l') ? 'L' : 'l';
+      p += (p[1] == 'l') ? 2 : 1;
+      break;
+    case 'q':
+    case 'L':
+      length = 'L';
+      p++;
+      break;
+    case 'j':
+    case 'z':
+    case 'Z':
+    case 't':
+      length = *p++;
+      break;
+    }
+
+  switch (*p)
+    {
+    case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+      switch (length)
+	{
+	case 'l': types[n++] = ARG_LONG; break;
+	case 'L': types[n++] = ARG_LLONG; break;
+	case 'j': types[n++] = ARG_INTMAX; break;
+	case 'z': case 'Z': types[n++] = ARG_SIZE; break;
+	case 't': types[n++] = ARG_PTRDIFF; break;
+	default: types[n++] = ARG_INT; break;
+	}
+      break;
+    case 'c':
+      types[n++] = ARG_INT;
+      break;
+    case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+      types[n++] = (length == 'L') ? ARG_LDOUBLE : ARG_DOUBLE;
+      break;
+    case 's':
+      if (length == 'l')
+	return NULL;
+      types[n++] = ARG_STRING;
+      break;
+    case 'p':
+      types[n++] = ARG_POINTER;
+      break;
+    default:
+      return NULL;
+    }
+
+  *ntypes = n;
+  return p;
+}
+
+static void
+format_parse (bng_log_format_t *fmt)
+{
+  const gchar *p = fmt->format;
+  guint8 types[3];
+  guint n;
+
+  fmt->nargs = 0;
+  while ((p = strchr (p, '%')) != NULL)
+    {
+      if (p[1] == '%')
+	{
+	  p += 2;
+	  continue;
+	}
+
+      p = format_spec (p + 1, types, &n);
+      if (p == NULL || fmt->nargs + n > BNG_LOG_EVENT_MAX_ARGS)
+	{
+	  fmt->text = TRUE;
+	  return;
+	}
+
+      memcpy (fmt->args + fmt->nargs, types, n);
+      fmt->nargs += n;
+      p++;
+    }
+}
+
+/* The registered format, registering it on first sight. */
+bng_log_format_t *
+bng_log_format_get (const gchar *format)
+{
+  bng_log_format_t *fmt;
+
+  g_mutex_lock (&registry_lock);
+  if (registry == NULL)
+    {
+      registry = g_hash_table_new (g_direct_hash, g_direct_equal);
+      formats = g_ptr_array_new ();
+    }
+
+  fmt = g_hash_table_lookup (registry, format);
+  if (fmt == NULL)
+    {
+      fmt = g_new0 (bng_log_format_t, 1);
+      fmt->id = formats->len;
+      fmt->format = format;
+      format_parse (fmt);
+      g_ptr_array_add (formats, fmt);
+      g_hash_table_insert (registry, (gpointer) format, fmt);
+    }
+  g_mutex_unlock (&registry_lock);
+
+  return fmt;
+}
+
+bng_log_format_t *
+bng_log_format_lookup (guint32 id)
+{
+  bng_log_format_t *fmt = NULL;
+
+  g_mutex_lock (&registry_lock);
+  if (formats && id < formats->len)
+    fmt = g_ptr_array_index (formats, id);
+  g_mutex_unlock (&registry_lock);
+
+  return fmt;
+}
+
+/************* EVENTS *************/
+
+static inline void
+put (gchar *buf, gsize size, gsize *len, gconstpointer data, gsize n)
+{
+  if (*len + n <= size)
+    memcpy (buf + *len, data, n);
+  *len += n;
+}
+
+/* Copy the arguments of fmt in to buf. Returns the bytes needed, nothing
+   is written past size, call again with a larger buffer if it exceeds
+   size. */
+gsize
+bng_log_event_encode (bng_log_format_t *fmt, va_list args, gchar *buf, gsize size)
+{
+  gsize len = 0;
+  gint64 i64;
+  gdouble d;
+  const gchar *s;
+  guint32 slen;
+  guint i;
+
+  for (i = 0; i < fmt->nargs; i++)
+    {
+      switch (fmt->args[i])
+	{
+	case ARG_INT: i64 = va_arg (args, gint); break;
+	case ARG_LONG: i64 = va_arg (args, glong); break;
+	case ARG_LLONG: i64 = va_arg (args, long long); break;
+	case ARG_SIZE: i64 = va_arg (args, gsize); break;
+	case ARG_INTMAX: i64 = va_arg (args, intmax_t); break;
+	case ARG_PTRDIFF: i64 = va_arg (args, ptrdiff_t); break;
+	case ARG_POINTER: i64 = (guintptr) va_arg (args, gpointer); break;
+	case ARG_DOUBLE:
+	  d = va_arg (args, gdouble);
+	  put (buf, size, &len, &d, sizeof (d));
+	  continue;
+	case ARG_LDOUBLE:
+	  d = va_arg (args, long double);
+	  put (buf, size, &len, &d, sizeof (d));
+	  continue;
+	case ARG_STRING:
+	  s = va_arg (args, const gchar *);
+	  slen = s ? strlen (s) : ARG_STRING_NULL;
+	  put (buf, size, &len, &slen, sizeof (slen));
+	  if (s)
+	    put (buf, size, &len, s, slen);
+	  continue;
+	default:
+	  continue;
+	}
+      put (buf, size, &len, &i64, sizeof (i64));
+    }
+
+  return len;
+}
+
+/* The arguments of a "%s" format for len bytes of text, which need not
+   be terminated. Same contract as bng_log_event_encode. */
+gsize
+bng_log_event_encode_text (const gchar *text, gsize len, gchar *buf, gsize size)
+{
+  guint32 slen = len;
+  gsize n = 0;
+
+  put (buf, size, &n, &slen, sizeof (slen));
+  put (buf, size, &n, text, len);
+  return n;
+}
+
+static gboolean
+get (const gchar *args, gsize len, gsize *pos, gpointer data, gsize n)
+{
+  if (*pos + n > len)
+    return FALSE;
+  memcpy (data, args + *pos, n);
+  *pos += n;
+  return TRUE;
+}
+
+#define RENDER(value)							\
+  do {									\
+    if (nstar == 0)							\
+      g_string_append_printf (out, spec, value);			\
+    else if (nstar == 1)						\
+      g_string_append_printf (out, spec, star[0], value);		\
+    else								\
+      g_string_append_printf (out, spec, star[0], star[1], value);	\
+  } while (0)
+
+/* Append the text of format with the encoded arguments. */
+void
+bng_log_event_render (const gchar *format, const gchar *args, gsize len, GString *out)
+{
+  const gchar *p = format, *start, *end;
+  gchar spec[64], *str;
+  guint8 types[3];
+  gint star[2];
+  gint64 i64;
+  gdouble d;
+  guint32 slen;
+  gsize pos = 0;
+  guint n, nstar, i;
+
+  while (*p)
+    {
+      start = p;
+      p = strchr (p, '%');
+      if (p == NULL)
+	{
+	  g_string_append (out, start);
+	  return;
+	}
+      g_string_append_len (out, start, p - start);
+
+      if (p[1] == '%')
+	{
+	  g_string_append_c (out, '%');
+	  p += 2;
+	  continue;
+	}
+
+      end = format_spec (p + 1, types, &n);
+      if (end == NULL || end - p + 1 >= (gssize) sizeof (spec))
+	{
+	  g_string_append (out, p);
+	  return;
+	}
+      memcpy (spec, p, end - p + 1);
+      spec[end - p + 1] = '\0';
+      p = end + 1;
+
+      nstar = n - 1;
+      for (i = 0; i < nstar; i++)
+	{
+	  if (!get (args, len, &pos, &i64, sizeof (i64)))
+	    goto TRUNCATED;
+	  star[i] = i64;
+	}
+
+      switch (types[nstar])
+	{
+	case ARG_DOUBLE:
+	case ARG_LDOUBLE:
+	  if (!get (args, len, &pos, &d, sizeof (d)))
+	    goto TRUNCATED;
+	  if (types[nstar] == ARG_DOUBLE)
+	    RENDER (d);
+	  else
+	    RENDER ((long double) d);
+	  break;
+	case ARG_STRING:
+	  if (!get (args, len, &pos, &slen, sizeof (slen)))
+	    goto TRUNCATED;
+	  if (slen == ARG_STRING_NULL)
+	    {
+	      RENDER ((const gchar *) NULL);
+	      break;
+	    }
+	  if (pos + slen > len)
+	    goto TRUNCATED;
+	  str = g_strndup (args + pos, slen);
+	  pos += slen;
+	  RENDER (str);
+	  g_free (str);
+	  break;
+	default:
+	  if (!get (args, len, &pos, &i64, sizeof (i64)))
+	    goto TRUNCATED;
+	  switch (types[nstar])
+	    {
+	    case ARG_LONG: RENDER ((glong) i64); break;
+	    case ARG_LLONG: RENDER ((long long) i64); break;
+	    case ARG_SIZE: RENDER ((gsize) i64); break;
+	    case ARG_INTMAX: RENDER ((intmax_t) i64); break;
+	    case ARG_PTRDIFF: RENDER ((ptrdiff_t) i64); break;
+	    case ARG_POINTER: RENDER ((gpointer) (guintptr) i64); break;
+	    default: RENDER ((gint) i64); break;
+	    }
+	}
+    }
+
+  return;
+
+ TRUNCATED:
+  g_string_append (out, "<truncated>");
+}
+
+/************* FILE RECORDS *************/
+
+void
+bng_log_file_header (GString *out)
+{
+  guint32 byte_order = LOG_FILE_BYTE_ORDER;
+
+  g_string_append_c (out, 'H');
+  g_string_append_len (out, LOG_FILE_MAGIC, sizeof (LOG_FILE_MAGIC));
+  g_string_append_len (out, (gchar *) &byte_order, sizeof (byte_order));
+}
+
+void
+bng_log_file_sync (GString *out)
+{
+  guint32 pid = getpid ();
+
+  g_string_append_c (out, 'S');
+  g_string_append_len (out, (gchar *) &pid, sizeof (pid));
+}
+
+void
+bng_log_file_format (GString *out, bng_log_format_t *fmt)
+{
+  guint32 len = strlen (fmt->format);
+
+  g_string_append_c (out, 'F');
+  g_string_append_len (out, (gchar *) &fmt->id, sizeof (fmt->id));
+  g_string_append_len (out, (gchar *) &len, sizeof (len));
+  g_string_append_len (out, fmt->format, len);
+}
+
+/* event is a bng_log_event_t followed by the arguments. */
+void
+bng_log_file_event (GString *out, const gchar *event, gsize len)
+{
+  guint32 len32 = len;
+
+  g_string_append_c (out, 'E');
+  g_string_append_len (out, (gchar *) &len32, sizeof (len32));
+  g_string_append_len (out, event, len);
+}
+
+/************* DECODER *************/
+
+/* Formats of one process, by id. Only the formats a process used are
+   in a file, the ids are sparse and come straight from the file, so they
+   are keys rather than indices. */
+static GHashTable *
+decode_formats (GHashTable *pids, guint32 pid)
+{
+  GHashTable *table = g_hash_table_lookup (pids, GUINT_TO_POINTER (pid));
+
+  if (table == NULL)
+    {
+      table = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, g_free);
+      g_hash_table_insert (pids, GUINT_TO_POINTER (pid), table);
+    }
+
+  return table;
+}
+
+/* Render binary log file path as text lines to out. */
+gint
+bng_log_decode (const gchar *path, FILE *out)
+{
+  GError *error = NULL;
+  GMappedFile *file;
+  GHashTable *pids;
+  GHashTable *table = NULL;
+  GString *line;
+  const gchar *data, *format;
+  gsize size, pos = 0;
+  guint32 pid = 0, id, len, byte_order;
+  bng_log_event_t event;
+  gchar stamp[32];
+  struct tm tm;
+  time_t secs;
+  gint status = 0;
+
+  file = g_mapped_file_new (path, FALSE, &error);
+  if (file == NULL)
+    {
+      BNG_DBG (_("Unable to open [%s], %s"), path, error->message);
+      g_error_free (error);
+      errno = ENOENT;
+      return (-1);
+    }
+
+  data = g_mapped_file_get_contents (file);
+  size = g_mapped_file_get_length (file);
+  pids = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+				(GDestroyNotify) g_hash_table_unref);
+  line = g_string_sized_new (256);
+
+#define TAKE(dst, n)					\
+  do {							\
+    if (pos + (n) > size)				\
+      goto TRUNCATED;					\
+    memcpy ((dst), data + pos, (n));			\
+    pos += (n);						\
+  } while (0)
+
+  if (size == 0 || data[0] != 'H')
+    {
+      errno = ENOEXEC;
+      status = -1;
+      goto END;
+    }
+
+  while (pos < size)
+    {
+      switch (data[pos++])
+	{
+	case 'H':
+	  if (pos + sizeof (LOG_FILE_MAGIC) > size
+	      || memcmp (data + pos, LOG_FILE_MAGIC, sizeof (LOG_FILE_MAGIC)) != 0)
+	    goto CORRUPT;
+	  pos += sizeof (LOG_FILE_MAGIC);
+	  TAKE (&byte_order, sizeof (byte_order));
+	  if (byte_order != LOG_FILE_BYTE_ORDER)
+	    {
+	      BNG_ERR (_("[%s] was written on a machine with a different byte order."), path);
+	      errno = EINVAL;
+	      status = -1;
+	      goto END;
+	    }
+	  g_hash_table_remove_all (pids);
+	  table = decode_formats (pids, pid);
+	  break;
+
+	case 'S':
+	  TAKE (&pid, sizeof (pid));
+	  table = decode_formats (pids, pid);
+	  break;
+
+	case 'F':
+	  TAKE (&id, sizeof (id));
+	  TAKE (&len, sizeof (len));
+	  if (pos + len > size)
+	    goto TRUNCATED;
+	  g_hash_table_insert (table, GUINT_TO_POINTER (id), g_strndup (data + pos, len));
+	  pos += len;
+	  break;
+
+	case 'E':
+	  TAKE (&len, sizeof (len));
+	  if (len < sizeof (event) || pos + len > size)
+	    goto TRUNCATED;
+	  memcpy (&event, data + pos, sizeof (event));
+
+	  secs = event.time / G_USEC_PER_SEC;
+	  localtime_r (&secs, &tm);
+	  strftime (stamp, sizeof (stamp), "%Y-%m-%d %H:%M:%S", &tm);
+	  g_string_printf (line, "%s.%06d %u/%u ", stamp, (gint) (event.time % G_USEC_PER_SEC),
+			   pid, event.tid);
+
+	  format = g_hash_table_lookup (table, GUINT_TO_POINTER (event.id));
+	  if (format)
+	    bng_log_event_render (format, data + pos + sizeof (event), len - sizeof (event), line);
+	  else
+	    g_string_append_printf (line, "<unknown format %u>", event.id);
+
+	  g_string_append_c (line, '\n');
+	  fwrite (line->str, 1, line->len, out);
+	  pos += len;
+	  break;
+
+	default:
+	  goto CORRUPT;
+	}
+    }
+  goto END;
+
+ TRUNCATED:
+  /* The writer was still busy or got killed. */
+  BNG_WARN (_("[%s] ends in a partial record."), path);
+  goto END;
+
+ CORRUPT:
+  BNG_ERR (_("[%s] is corrupt at offset %zu."), path, pos - 1);
+  errno = EINVAL;
+  status = -1;
+
+ END:
+#undef TAKE
+  g_string_free (line, TRUE);
+  g_hash_table_unref (pids);
+  g_mapped_file_unref (file);
+  return status;
+}
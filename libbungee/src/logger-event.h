@@ -0,0 +1,69 @@
+/*
+logger-event.h: Binary log events
+
+This file is part of Bungee.
+
+Copyright 2012 Red Hat, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef _LOGGER_EVENT_H
+#define _LOGGER_EVENT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Formats with more arguments are logged as preformatted text. */
+#define BNG_LOG_EVENT_MAX_ARGS 16
+
+/* A format string seen by the logger. Formats are keyed by address, the
+   BNG_* macros only ever pass string literals. */
+typedef struct
+{
+  guint32 id;
+  const gchar *format;
+  gboolean text;     /* Not encodable, log it rendered as "%s" */
+  guint nargs;
+  guint8 args[BNG_LOG_EVENT_MAX_ARGS];
+} bng_log_format_t;
+
+/* What an encoded event starts with. Arguments follow. */
+typedef struct
+{
+  guint32 id;        /* bng_log_format_t id */
+  guint8 kind;       /* 0 console message, 1 log line */
+  guint8 level;      /* bng_log_level_t */
+  guint16 pad;
+  guint32 tid;       /* Thread of the caller */
+  gint64 time;       /* g_get_real_time of the call */
+} bng_log_event_t;
+
+bng_log_format_t *bng_log_format_get (const gchar *format);
+bng_log_format_t *bng_log_format_lookup (guint32 id);
+gsize bng_log_event_encode (bng_log_format_t *fmt, va_list args, gchar *buf, gsize size);
+gsize bng_log_event_encode_text (const gchar *text, gsize len, gchar *buf, gsize size);
+void bng_log_event_render (const gchar *format, const gchar *args, gsize len, GString *out);
+
+void bng_log_file_header (GString *out);
+void bng_log_file_sync (GString *out);
+void bng_log_file_format (GString *out, bng_log_format_t *fmt);
+void bng_log_file_event (GString *out, const gchar *event, gsize len);
+gint bng_log_decode (const gchar *path, FILE *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _LOGGER_EVENT_H */
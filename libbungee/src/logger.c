@@ -18,72 +18,1379 @@ See the License for the specific language governing permissions and
 limitations under the License.
 */
 
+/*
+  bng_msg and bng_log format in to a stack buffer and copy the line in to
+  a ring owned by the calling thread. A flusher thread drains all rings
+  and writes what it found in one go per sink, so rule actions never wait
+  on write syscalls:
+
+     thread A  -> ring A --+
+     thread B  -> ring B --+--> flusher thread --> msg / log sinks
+     (engine)  -> ring C --+
+
+  Each ring has a single producer (its thread) and a single consumer
+  (whoever holds drain_lock, normally the flusher), head and tail are
+  plain atomics. A producer only takes the lock when its ring is full, to
+  wait for the flusher, or to wake a sleeping flusher. Lines of one thread
+  keep their order, lines of different threads are interleaved per
+  drain.
+
+  Until bng_console_init and after bng_console_fini lines are written
+  directly, so errors during startup and shutdown are not lost.
+
+  With a binary target configured, callers do not format at all. They
+  queue an event, the format id and the raw arguments (logger-event.c),
+  and the flusher renders it for the text targets only.
+*/
+
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
 #include <glib.h>
 #include <glib/gprintf.h>
+#include <glib/gstdio.h>
 
 #include "local-defs.h"
 #include "logger.h"
+#include "logger-event.h"
+
+/* Bytes per thread ring, a power of two. */
+#define LOG_RING_SIZE (64 * 1024)
+/* Lines up to this size are formatted without allocating. */
+#define LOG_LINE_SIZE 512
+/* The flusher writes out what accumulated this often... */
+#define LOG_FLUSH_INTERVAL (50 * G_TIME_SPAN_MILLISECOND)
+/* ...or as soon as a ring is filled beyond this. */
+#define LOG_RING_HIGH (LOG_RING_SIZE / 4)
+
+typedef enum {
+  ENTRY_MSG,
+  ENTRY_LOG,
+  ENTRY_EVENT, /* bng_log_event_t and arguments instead of text */
+  ENTRY_SKIP /* Unused space up to the end of the ring */
+} entry_kind_t;
+
+/* Entries are 8 byte aligned, the text follows the header. */
+typedef struct
+{
+  guint32 len;
+  guint8 kind;
+  guint8 level;
+  guint8 pad[2];
+} entry_t;
+
+#define ENTRY_SPACE(len) ((sizeof (entry_t) + (len) + 7) & ~(gsize) 7)
+
+/* head and tail sit on cache lines of their own, the owner and the
+   flusher would otherwise steal the line from each other on every line
+   logged. */
+#define LOG_CACHE_LINE 64
+/* Formats each thread remembers without taking the registry lock. */
+#define LOG_FORMAT_CACHE 64
+
+typedef struct log_ring
+{
+  gchar buf[LOG_RING_SIZE];
+  gint head;    /* Bytes written, by the owner thread only */
+  gint waiting; /* Owner is parked for space */
+  gchar pad0[LOG_CACHE_LINE - 2 * sizeof (gint)];
+  gint tail;    /* Bytes drained, by the drain_lock holder only */
+  gint orphan;  /* Owner thread is gone, free once drained */
+  struct log_ring *next;
+  guint32 tid;  /* Owner thread, for events */
+  const gchar *format_key[LOG_FORMAT_CACHE];
+  bng_log_format_t *format[LOG_FORMAT_CACHE];
+} log_ring_t;
 
 bng_console_t msg_console, log_console;
 bng_log_level_t bng_log_level = BNG_LOG_LEVEL_WARNING;
 
+static void ring_orphan (gpointer data);
+
+static GPrivate thread_ring = G_PRIVATE_INIT (ring_orphan);
+static log_ring_t *rings;     /* All rings, new ones are pushed in front */
+static GMutex lock;           /* rings list and parking */
+static GCond wake;            /* Flusher sleeps on it */
+static GCond space;           /* Producers of full rings sleep on it */
+static gint flusher_waiting;
+static gint flusher_urgent;   /* Under lock */
+static gint started;
+static gint stop;
+static GThread *flusher;
+
+static GMutex drain_lock;     /* Consumer side of all rings and the sinks */
+
+static gint events;           /* Some sink is binary, queue events */
+static bng_log_format_t *text_format; /* "%s", for text given to binary sinks */
+static GString *rendered;     /* Event text for text sinks, under drain_lock */
+static GString *event_buf;    /* Text wrapped as event, under drain_lock */
+
+static guint32
+log_tid (void)
+{
+  return syscall (SYS_gettid);
+}
+
+/************* SINKS *************/
+
+/*
+  Every target of the msg and log consoles is a sink of its own, a line
+  goes to each sink whose bit is set in the console's mask. A file named
+  by both consoles is one sink, so their lines stay in order.
+
+  Terminals get what a drain found right away. Files buffer up to
+  LOG_FILE_BUFFER bytes or LOG_FILE_FLUSH time, whichever comes first,
+  and are rotated to FILE.1 .. FILE.keep once they would grow beyond the
+  console's rotate_size.
+
+  --jobs workers append to the files they inherited, only the parent
+  rotates them. It goes by the size of the file rather than by what it
+  wrote itself, and the workers switch to the new file once they see
+  FILE is no longer the file they write to.
+
+  Binary FILE sinks take events instead of lines. Every file starts with
+  a header and gets each format before its first event, so a rotated
+  file decodes on its own.
+
+  Socket sinks stream lines to a collector process. They never block the
+  flusher: what the socket does not take right away is dropped, in whole
+  lines, and a lost connection is retried every LOG_SOCKET_RETRY. Each
+  --jobs worker connects on its own.
+*/
+
+#define LOG_SINKS_MAX 8
+/* File sinks write once this much is buffered... */
+#define LOG_FILE_BUFFER (64 * 1024)
+/* ...or once the oldest buffered line is this old. */
+#define LOG_FILE_FLUSH G_TIME_SPAN_SECOND
+/* Socket sinks try to (re)connect at most this often. */
+#define LOG_SOCKET_RETRY G_TIME_SPAN_SECOND
+
+typedef struct
+{
+  bng_console_type_t type; /* A single type bit */
+  gint fd;
+  gchar *path;             /* FILE, reopened on rotation. SOCKET address */
+  gsize rotate_size;       /* FILE, 0 never rotates */
+  guint rotate_keep;
+  gsize size;              /* FILE, bytes in the current file */
+  gboolean follow;         /* FILE, rotated by the parent process */
+  GString *buf;
+  gint64 since;            /* When buf got its first line */
+  gboolean binary;         /* FILE, events for bng_log_decode */
+  gboolean fresh;          /* Binary, nothing but the header in the file */
+  guint8 *emitted;         /* Binary, bitmap of format ids in the file */
+  guint emitted_size;
+  gint64 retry;            /* SOCKET, next connect attempt */
+  gboolean partial;        /* SOCKET, buf starts with the rest of a sent line */
+  guint64 dropped;         /* SOCKET, lines the collector did not get */
+} sink_t;
+
+static sink_t sinks[LOG_SINKS_MAX];
+static guint nsinks;
+static guint msg_sinks, log_sinks; /* Masks of sink indexes */
+
+static gint sink_write_all (sink_t *sink, const gchar *data, gsize len);
+
+static gint
+sink_open_file (sink_t *sink)
+{
+  struct stat st;
+
+  sink->fd = g_open (sink->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (sink->fd < 0)
+    return (-1);
+
+  sink->size = (fstat (sink->fd, &st) == 0) ? st.st_size : 0;
+
+  if (sink->binary)
+    {
+      GString *header = g_string_new (NULL);
+
+      /* The decoder forgets all formats at a header. */
+      sink->fresh = (sink->size == 0);
+      if (sink->emitted)
+	memset (sink->emitted, 0, sink->emitted_size);
+      bng_log_file_header (header);
+      sink_write_all (sink, header->str, header->len);
+      g_string_free (header, TRUE);
+    }
+
+  return (0);
+}
+
+/* Connect to a collector, without waiting for it. Returns -1 on a bad
+   address only, a collector that is not there yet is retried later. */
+static gint
+sink_connect (sink_t *sink)
+{
+  struct addrinfo hints, *ai = NULL;
+  struct sockaddr_un sun;
+  const gchar *colon;
+  gchar *host;
+  gint status = 0;
+
+  sink->fd = -1;
+  sink->partial = FALSE;
+  sink->retry = g_get_monotonic_time () + LOG_SOCKET_RETRY;
+
+  if (g_str_has_prefix (sink->path, "unix:"))
+    {
+      memset (&sun, 0, sizeof (sun));
+      sun.sun_family = AF_UNIX;
+      if (strlen (sink->path + 5) >= sizeof (sun.sun_path))
+	{
+	  errno = ENAMETOOLONG;
+	  return (-1);
+	}
+      strcpy (sun.sun_path, sink->path + 5);
+
+      sink->fd = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+      if (sink->fd >= 0 && connect (sink->fd, (struct sockaddr *) &sun, sizeof (sun)) != 0)
+	{
+	  close (sink->fd);
+	  sink->fd = -1;
+	}
+      return (0);
+    }
+
+  colon = g_str_has_prefix (sink->path, "tcp:") ? strrchr (sink->path + 4, ':') : NULL;
+  if (colon == NULL)
+    {
+      errno = EINVAL;
+      return (-1);
+    }
+
+  memset (&hints, 0, sizeof (hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  host = g_strndup (sink->path + 4, colon - (sink->path + 4));
+  if (getaddrinfo (host, colon + 1, &hints, &ai) != 0 || ai == NULL)
+    {
+      errno = EINVAL;
+      status = -1;
+    }
+  else
+    {
+      sink->fd = socket (ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			 ai->ai_protocol);
+      /* Until the connection completes sends fail with EAGAIN and drop. */
+      if (sink->fd >= 0 && connect (sink->fd, ai->ai_addr, ai->ai_addrlen) != 0
+	  && errno != EINPROGRESS)
+	{
+	  close (sink->fd);
+	  sink->fd = -1;
+	}
+    }
+
+  if (ai)
+    freeaddrinfo (ai);
+  g_free (host);
+  return status;
+}
+
+/* Add a sink, or find the one that already writes there. Returns the
+   index, -1 on error. */
+static gint
+sink_add (bng_console_type_t type, bng_console_t *console)
+{
+  const gchar *path = NULL;
+  sink_t *sink;
+  gint fd = -1;
+  guint i;
+
+  switch (type)
+    {
+    case BNG_CONSOLE_TYPE_STDOUT:
+      fd = STDOUT_FILENO;
+      break;
+    case BNG_CONSOLE_TYPE_STDERR:
+      fd = STDERR_FILENO;
+      break;
+    case BNG_CONSOLE_TYPE_FILE:
+      if (console->path == NULL && console->device.fp)
+	{
+	  /* A stream of the caller, no rotation without a name. */
+	  fflush (console->device.fp);
+	  fd = fileno (console->device.fp);
+	}
+      path = console->path;
+      break;
+    case BNG_CONSOLE_TYPE_SOCKET:
+      if (console->address == NULL)
+	{
+	  errno = EINVAL;
+	  return (-1);
+	}
+      path = console->address;
+      break;
+    default:
+      break;
+    }
+
+  for (i = 0; i < nsinks; i++)
+    {
+      sink = &sinks[i];
+      if (sink->type != type)
+	continue;
+      if (sink->path && g_strcmp0 (sink->path, path) == 0)
+	{
+	  if (type == BNG_CONSOLE_TYPE_FILE && sink->binary != console->binary)
+	    {
+	      /* Text lines in a binary file would not decode. */
+	      errno = EINVAL;
+	      return (-1);
+	    }
+	  if (sink->rotate_size == 0)
+	    {
+	      sink->rotate_size = console->rotate_size;
+	      sink->rotate_keep = console->rotate_keep;
+	    }
+	  return i;
+	}
+      if (type == BNG_CONSOLE_TYPE_SYSLOG || (!sink->path && fd >= 0 && sink->fd == fd))
+	return i;
+    }
+
+  if (nsinks == LOG_SINKS_MAX)
+    {
+      errno = ENOSPC;
+      return (-1);
+    }
+
+  sink = &sinks[nsinks];
+  memset (sink, 0, sizeof (*sink));
+  sink->type = type;
+  sink->fd = fd;
+
+  if (type == BNG_CONSOLE_TYPE_SOCKET)
+    {
+      sink->path = g_strdup (path);
+      if (sink_connect (sink) != 0)
+	{
+	  g_free (sink->path);
+	  return (-1);
+	}
+    }
+  else if (type == BNG_CONSOLE_TYPE_FILE && path)
+    {
+      sink->path = g_strdup (path);
+      sink->rotate_size = console->rotate_size;
+      sink->rotate_keep = console->rotate_keep;
+      sink->binary = console->binary;
+      if (sink->binary)
+	g_atomic_int_set (&events, 1);
+      if (sink_open_file (sink) != 0)
+	{
+	  g_free (sink->path);
+	  return (-1);
+	}
+    }
+  else if (type == BNG_CONSOLE_TYPE_FILE && fd < 0)
+    {
+      errno = EINVAL;
+      return (-1);
+    }
+
+  if (type == BNG_CONSOLE_TYPE_SYSLOG)
+    openlog (PACKAGE, LOG_PID, LOG_USER);
+  else
+    sink->buf = g_string_sized_new (LOG_RING_SIZE);
+
+  return nsinks++;
+}
+
+/* Mask of the sinks for every target of console. */
+static gint
+sink_add_console (bng_console_t *console, guint *mask)
+{
+  static const bng_console_type_t types[] = {
+    BNG_CONSOLE_TYPE_STDOUT, BNG_CONSOLE_TYPE_STDERR,
+    BNG_CONSOLE_TYPE_FILE, BNG_CONSOLE_TYPE_SYSLOG, BNG_CONSOLE_TYPE_SOCKET
+  };
+  guint i;
+  gint index;
+
+  *mask = 0;
+  for (i = 0; i < G_N_ELEMENTS (types); i++)
+    {
+      if (!(console->type & types[i]))
+	continue;
+      index = sink_add (types[i], console);
+      if (index < 0)
+	return (-1);
+      *mask |= 1 << index;
+    }
+
+  return (0);
+}
+
+/* Before bng_console_init everything goes to stderr. */
+static void
+sink_defaults (void)
+{
+  bng_console_t console;
+
+  memset (&console, 0, sizeof (console));
+  console.type = BNG_CONSOLE_TYPE_STDERR;
+  sink_add_console (&console, &msg_sinks);
+  log_sinks = msg_sinks;
+}
+
+/* Rename FILE to FILE.1, FILE.1 to FILE.2 and so on, dropping the oldest,
+   and start over with an empty FILE. */
+static void
+sink_rotate (sink_t *sink)
+{
+  gchar *from, *to;
+  guint i;
+
+  close (sink->fd);
+
+  if (sink->rotate_keep == 0)
+    g_unlink (sink->path);
+
+  for (i = sink->rotate_keep; i > 0; i--)
+    {
+      from = (i > 1) ? g_strdup_printf ("%s.%u", sink->path, i - 1) : g_strdup (sink->path);
+      to = g_strdup_printf ("%s.%u", sink->path, i);
+      g_rename (from, to); /* Missing older files are fine. */
+      g_free (from);
+      g_free (to);
+    }
+
+  if (sink_open_file (sink) != 0)
+    fprintf (stderr, "ERROR: unable to reopen log file [%s] after rotation, %s\n",
+	     sink->path, strerror (errno));
+}
+
+/* Catch up with the other processes writing to a file: the parent takes
+   their lines in to account, a worker reopens FILE once the parent
+   rotated it. Binary sinks call it between batches only, the formats of
+   a batch go to the file its events go to. */
+static void
+sink_sync (sink_t *sink)
+{
+  struct stat path_st, fd_st;
+  gint fd;
+
+  if (sink->fd < 0 || fstat (sink->fd, &fd_st) != 0)
+    return;
+
+  if (!sink->follow)
+    {
+      if (sink->rotate_size && (gsize) fd_st.st_size > sink->size)
+	{
+	  sink->size = fd_st.st_size;
+	  sink->fresh = FALSE;
+	}
+      return;
+    }
+
+  /* Not there yet, the parent is about to create it. */
+  if (g_stat (sink->path, &path_st) != 0
+      || (path_st.st_ino == fd_st.st_ino && path_st.st_dev == fd_st.st_dev))
+    return;
+
+  fd = g_open (sink->path, O_WRONLY | O_APPEND | O_CLOEXEC, 0);
+  if (fd < 0)
+    return;
+  close (sink->fd);
+  sink->fd = fd;
+
+  /* The parent wrote the header of the new file. */
+  if (sink->emitted)
+    memset (sink->emitted, 0, sink->emitted_size);
+}
+
+static gint
+sink_write_all (sink_t *sink, const gchar *data, gsize len)
+{
+  gssize n;
+
+  while (len > 0)
+    {
+      n = write (sink->fd, data, len);
+      if (n < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  /* Nobody to tell through the logger, it is the logger. */
+	  if (sink->fd != STDERR_FILENO)
+	    fprintf (stderr, "ERROR: log write to [%s] failed, %s\n",
+		     sink->path ? sink->path : "console", strerror (errno));
+	  return (-1);
+	}
+      data += n;
+      len -= n;
+      sink->size += n;
+    }
+
+  return (0);
+}
+
+static guint
+count_lines (const gchar *data, gsize len)
+{
+  const gchar *end = data + len;
+  guint lines = 0;
+
+  while ((data = memchr (data, '\n', end - data)) != NULL)
+    {
+      data++;
+      lines++;
+    }
+
+  return lines;
+}
+
+/* Send what the socket takes without blocking. The rest of a line the
+   collector got part of is kept for the next round, lines behind it are
+   dropped. */
+static void
+sink_send (sink_t *sink)
+{
+  const gchar *data = sink->buf->str, *nl;
+  gsize len = sink->buf->len, keep = 0;
+  gssize n = 0;
+
+  if (sink->fd < 0 && g_get_monotonic_time () >= sink->retry)
+    sink_connect (sink);
+
+  if (sink->fd >= 0)
+    {
+      do
+	n = send (sink->fd, data, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+      while (n < 0 && errno == EINTR);
+
+      if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+	{
+	  /* Collector went away, a new connection starts with a new line. */
+	  close (sink->fd);
+	  sink->fd = -1;
+	  sink->partial = FALSE;
+	  sink->retry = g_get_monotonic_time () + LOG_SOCKET_RETRY;
+	}
+      if (n < 0)
+	n = 0;
+    }
+  else
+    sink->partial = FALSE;
+
+  if (sink->fd >= 0 && n < (gssize) len
+      && ((n > 0 && data[n - 1] != '\n') || (n == 0 && sink->partial)))
+    {
+      nl = memchr (data + n, '\n', len - n);
+      keep = nl - (data + n) + 1;
+    }
+
+  sink->dropped += count_lines (data + n + keep, len - n - keep);
+  sink->partial = (keep > 0);
+  g_string_erase (sink->buf, 0, n);
+  g_string_truncate (sink->buf, keep);
+}
+
+/* Write the buffer out, rotating between whole lines as needed. */
+static void
+sink_write (sink_t *sink)
+{
+  const gchar *data = sink->buf->str, *nl;
+  gsize left = sink->buf->len, room, chunk;
+
+  if (sink->type == BNG_CONSOLE_TYPE_SOCKET)
+    {
+      sink_send (sink);
+      return;
+    }
+
+  if (sink->binary)
+    {
+      /* Binary sinks rotate as events are queued, see sink_put_event. */
+      if (sink->fd >= 0)
+	sink_write_all (sink, data, left);
+      g_string_truncate (sink->buf, 0);
+      return;
+    }
+
+  if (sink->path)
+    sink_sync (sink);
+
+  while (left > 0 && sink->fd >= 0)
+    {
+      chunk = left;
+      if (sink->rotate_size && sink->size + left > sink->rotate_size)
+	{
+	  /* The lines that still fit in to the current file. */
+	  room = (sink->size < sink->rotate_size) ? sink->rotate_size - sink->size : 0;
+	  nl = memrchr (data, '\n', MIN (room, left));
+	  chunk = nl ? nl - data + 1 : 0;
+	  if (chunk == 0)
+	    {
+	      if (sink->size > 0)
+		{
+		  sink_rotate (sink);
+		  continue;
+		}
+	      /* A single line longer than a whole file. */
+	      nl = memchr (data, '\n', left);
+	      chunk = nl ? nl - data + 1 : left;
+	    }
+	}
+
+      if (sink_write_all (sink, data, chunk) != 0)
+	break;
+      data += chunk;
+      left -= chunk;
+    }
+
+  g_string_truncate (sink->buf, 0);
+}
+
+static void
+sink_put_text (sink_t *sink, entry_kind_t kind, bng_log_level_t level,
+	       const gchar *text, gsize len)
+{
+  static const gint priority[] = {
+    [BNG_LOG_LEVEL_FATAL] = LOG_CRIT,
+    [BNG_LOG_LEVEL_ERROR] = LOG_ERR,
+    [BNG_LOG_LEVEL_WARNING] = LOG_WARNING,
+    [BNG_LOG_LEVEL_INFO] = LOG_INFO,
+    [BNG_LOG_LEVEL_DEBUG] = LOG_DEBUG
+  };
+
+  if (sink->type == BNG_CONSOLE_TYPE_SYSLOG)
+    {
+      syslog (kind == ENTRY_MSG ? LOG_INFO : priority[level], "%.*s", (gint) len, text);
+      return;
+    }
+
+  if (sink->buf->len == 0)
+    sink->since = g_get_monotonic_time ();
+  g_string_append_len (sink->buf, text, len);
+  g_string_append_c (sink->buf, '\n');
+}
+
+/* Queue an event record, preceded by its format the first time this file
+   sees it. Rotation happens here rather than in sink_write, a new file
+   needs the formats again. */
+static void
+sink_put_event (sink_t *sink, bng_log_format_t *fmt, const gchar *event, gsize len)
+{
+  guint byte = fmt->id / 8;
+
+  if (sink->buf->len == 0)
+    sink_sync (sink);
+
+  if (sink->rotate_size && !sink->fresh
+      && sink->size + sink->buf->len + len > sink->rotate_size)
+    {
+      sink_write (sink);
+      sink_rotate (sink);
+    }
+
+  /* Workers of a --jobs run share the file, say whose batch this is. */
+  if (sink->buf->len == 0)
+    {
+      sink->since = g_get_monotonic_time ();
+      bng_log_file_sync (sink->buf);
+    }
+
+  if (byte >= sink->emitted_size)
+    {
+      guint size = MAX (byte + 1, sink->emitted_size * 2);
+      sink->emitted = g_realloc (sink->emitted, size);
+      memset (sink->emitted + sink->emitted_size, 0, size - sink->emitted_size);
+      sink->emitted_size = size;
+    }
+  if (!(sink->emitted[byte] & (1 << fmt->id % 8)))
+    {
+      bng_log_file_format (sink->buf, fmt);
+      sink->emitted[byte] |= 1 << fmt->id % 8;
+    }
+
+  bng_log_file_event (sink->buf, event, len);
+  sink->fresh = FALSE;
+}
+
+/* Queue a line for the sinks of its console. Requires drain_lock. */
+static void
+console_put (entry_kind_t kind, bng_log_level_t level, const gchar *text, gsize len)
+{
+  bng_log_event_t *event;
+  guint mask, i;
+  sink_t *sink;
+
+  if (nsinks == 0)
+    sink_defaults ();
+
+  mask = (kind == ENTRY_MSG) ? msg_sinks : log_sinks;
+  for (i = 0; mask; i++, mask >>= 1)
+    {
+      if (!(mask & 1))
+	continue;
+
+      sink = &sinks[i];
+      if (!sink->binary)
+	{
+	  sink_put_text (sink, kind, level, text, len);
+	  continue;
+	}
+
+      /* Lines written directly, before the flusher runs. */
+      if (text_format == NULL)
+	text_format = bng_log_format_get ("%s");
+      if (event_buf == NULL)
+	event_buf = g_string_new (NULL);
+      g_string_set_size (event_buf, sizeof (*event)
+			 + bng_log_event_encode_text (text, len, NULL, 0));
+      event = (bng_log_event_t *) event_buf->str;
+      memset (event, 0, sizeof (*event));
+      event->id = text_format->id;
+      event->kind = kind;
+      event->level = level;
+      event->tid = log_tid ();
+      event->time = g_get_real_time ();
+      bng_log_event_encode_text (text, len, event_buf->str + sizeof (*event),
+				 event_buf->len - sizeof (*event));
+      sink_put_event (sink, text_format, event_buf->str, event_buf->len);
+    }
+}
+
+/* Queue an event for the sinks of its console, text sinks get it
+   rendered. Requires drain_lock. */
+static void
+console_put_event (const gchar *data, gsize len)
+{
+  const bng_log_event_t *event = (const bng_log_event_t *) data;
+  bng_log_format_t *fmt = bng_log_format_lookup (event->id);
+  gboolean text = FALSE;
+  guint mask, i;
+  sink_t *sink;
+
+  if (fmt == NULL)
+    return;
+  if (nsinks == 0)
+    sink_defaults ();
+
+  mask = (event->kind == ENTRY_MSG) ? msg_sinks : log_sinks;
+  for (i = 0; mask; i++, mask >>= 1)
+    {
+      if (!(mask & 1))
+	continue;
+
+      sink = &sinks[i];
+      if (sink->binary)
+	{
+	  sink_put_event (sink, fmt, data, len);
+	  continue;
+	}
+
+      if (!text)
+	{
+	  if (rendered == NULL)
+	    rendered = g_string_new (NULL);
+	  g_string_truncate (rendered, 0);
+	  bng_log_event_render (fmt->format, data + sizeof (*event), len - sizeof (*event),
+				rendered);
+	  text = TRUE;
+	}
+      sink_put_text (sink, event->kind, event->level, rendered->str, rendered->len);
+    }
+}
+
+/* The parent of a --jobs run may have nothing to write while its workers
+   fill a file, it rotates all the same. */
+static void
+sink_idle (sink_t *sink)
+{
+  sink_sync (sink);
+  if (sink->size > sink->rotate_size)
+    sink_rotate (sink);
+}
+
+/* Write out what is due, or everything when forced. Requires drain_lock. */
+static void
+console_write (gboolean force)
+{
+  gint64 now = 0;
+  sink_t *sink;
+  guint i;
+
+  for (i = 0; i < nsinks; i++)
+    {
+      sink = &sinks[i];
+      if (sink->buf == NULL || sink->buf->len == 0)
+	{
+	  if (sink->rotate_size && sink->fd >= 0)
+	    sink_idle (sink);
+	  continue;
+	}
+
+      if (!force && sink->type == BNG_CONSOLE_TYPE_FILE
+	  && sink->buf->len < LOG_FILE_BUFFER)
+	{
+	  if (now == 0)
+	    now = g_get_monotonic_time ();
+	  if (now - sink->since < LOG_FILE_FLUSH)
+	    continue;
+	}
+
+      sink_write (sink);
+    }
+}
+
+static void
+sink_close_all (void)
+{
+  guint i;
+
+  for (i = 0; i < nsinks; i++)
+    {
+      if (sinks[i].type == BNG_CONSOLE_TYPE_SYSLOG)
+	closelog ();
+      if (sinks[i].dropped)
+	fprintf (stderr, "WARNING: %" G_GUINT64_FORMAT " lines to [%s] were dropped, "
+		 "the collector was not there or too slow\n", sinks[i].dropped, sinks[i].path);
+      if (sinks[i].path && sinks[i].fd >= 0)
+	close (sinks[i].fd);
+      g_free (sinks[i].path);
+      if (sinks[i].buf)
+	g_string_free (sinks[i].buf, TRUE);
+      g_free (sinks[i].emitted);
+    }
+
+  nsinks = 0;
+  msg_sinks = log_sinks = 0;
+  g_atomic_int_set (&events, 0);
+}
+
+/* Bypass the rings: before init, after fini and for huge lines. Takes
+   an event instead of text for ENTRY_EVENT. */
+static void
+console_direct (entry_kind_t kind, bng_log_level_t level, const gchar *text, gsize len)
+{
+  g_mutex_lock (&drain_lock);
+  if (kind == ENTRY_EVENT)
+    console_put_event (text, len);
+  else
+    console_put (kind, level, text, len);
+  console_write (TRUE);
+  g_mutex_unlock (&drain_lock);
+}
+
+/************* CONSUMER *************/
+
+static gboolean
+ring_empty (log_ring_t *ring)
+{
+  return g_atomic_int_get (&ring->head) == ring->tail;
+}
+
+/* Move everything in ring to the batches. Requires drain_lock. */
+static guint
+ring_drain (log_ring_t *ring)
+{
+  guint tail = ring->tail;
+  guint head = g_atomic_int_get (&ring->head);
+  guint lines = 0;
+  entry_t *entry;
+
+  while (tail != head)
+    {
+      entry = (entry_t *) (ring->buf + tail % LOG_RING_SIZE);
+      if (entry->kind == ENTRY_EVENT)
+	{
+	  console_put_event ((gchar *) (entry + 1), entry->len);
+	  lines++;
+	}
+      else if (entry->kind != ENTRY_SKIP)
+	{
+	  console_put (entry->kind, entry->level, (gchar *) (entry + 1), entry->len);
+	  lines++;
+	}
+      tail += ENTRY_SPACE (entry->len);
+    }
+
+  /* The bytes are copied out, the owner may reuse them. */
+  g_atomic_int_set (&ring->tail, tail);
+  if (g_atomic_int_get (&ring->waiting))
+    {
+      g_mutex_lock (&lock);
+      g_cond_broadcast (&space);
+      g_mutex_unlock (&lock);
+    }
+
+  return lines;
+}
+
+/* Drain all rings and write the result. Requires drain_lock. */
+static guint
+console_drain (void)
+{
+  log_ring_t *ring, **link;
+  guint lines = 0;
+
+  /* Rings are only ever added in front and only removed here, the list
+     behind the head read under the lock is stable. */
+  g_mutex_lock (&lock);
+  ring = rings;
+  g_mutex_unlock (&lock);
+
+  for (; ring; ring = ring->next)
+    lines += ring_drain (ring);
+
+  console_write (FALSE);
+
+  /* Free the rings of threads that exited. */
+  g_mutex_lock (&lock);
+  for (link = &rings; *link; )
+    {
+      ring = *link;
+      if (g_atomic_int_get (&ring->orphan) && ring_empty (ring))
+	{
+	  *link = ring->next;
+	  g_free (ring);
+	}
+      else
+	link = &ring->next;
+    }
+  g_mutex_unlock (&lock);
+
+  return lines;
+}
+
+static gpointer
+console_flusher (gpointer data)
+{
+  gint64 deadline;
+
+  while (!g_atomic_int_get (&stop))
+    {
+      g_mutex_lock (&drain_lock);
+      console_drain ();
+      g_mutex_unlock (&drain_lock);
+
+      /* Lines pile up until the next tick unless a ring runs full. */
+      g_mutex_lock (&lock);
+      g_atomic_int_set (&flusher_waiting, 1);
+      deadline = g_get_monotonic_time () + LOG_FLUSH_INTERVAL;
+      while (!flusher_urgent && !g_atomic_int_get (&stop))
+	if (!g_cond_wait_until (&wake, &lock, deadline))
+	  break;
+      flusher_urgent = 0;
+      g_atomic_int_set (&flusher_waiting, 0);
+      g_mutex_unlock (&lock);
+    }
+
+  return NULL;
+}
+
+/* Have the flusher drain now instead of at the next tick. */
+static void
+console_wake (void)
+{
+  if (!g_atomic_int_get (&flusher_waiting))
+    return;
+
+  g_mutex_lock (&lock);
+  flusher_urgent = 1;
+  g_cond_signal (&wake);
+  g_mutex_unlock (&lock);
+}
+
+/************* PRODUCER *************/
+
+/* GPrivate destructor, runs when a thread that logged exits. */
+static void
+ring_orphan (gpointer data)
+{
+  log_ring_t *ring = data;
+
+  g_atomic_int_set (&ring->orphan, 1);
+}
+
+static log_ring_t *
+ring_get (void)
+{
+  log_ring_t *ring = g_private_get (&thread_ring);
+
+  if (G_LIKELY (ring != NULL))
+    return ring;
+
+  ring = g_new0 (log_ring_t, 1);
+  ring->tid = log_tid ();
+  g_mutex_lock (&lock);
+  ring->next = rings;
+  rings = ring;
+  g_mutex_unlock (&lock);
+  g_private_set (&thread_ring, ring);
+
+  return ring;
+}
+
+/* Registered format, from the thread's cache when it was seen before. */
+static bng_log_format_t *
+ring_format (log_ring_t *ring, const gchar *format)
+{
+  guint slot = ((guintptr) format >> 3) % LOG_FORMAT_CACHE;
+
+  if (G_UNLIKELY (ring->format_key[slot] != format))
+    {
+      ring->format[slot] = bng_log_format_get (format);
+      ring->format_key[slot] = format;
+    }
+
+  return ring->format[slot];
+}
+
+static gboolean
+ring_has_space (log_ring_t *ring, guint need)
+{
+  return LOG_RING_SIZE - ((guint) ring->head - (guint) g_atomic_int_get (&ring->tail)) >= need
+    || !g_atomic_int_get (&started);
+}
+
+/* Wait for the flusher to make room. Lines are never dropped, a thread
+   logging faster than the sinks take it is slowed down to their pace. */
+static void
+ring_park (log_ring_t *ring, guint need)
+{
+  g_mutex_lock (&lock);
+  g_atomic_int_set (&ring->waiting, 1);
+  flusher_urgent = 1;
+  g_cond_signal (&wake);
+  while (!ring_has_space (ring, need))
+    g_cond_wait (&space, &lock);
+  g_atomic_int_set (&ring->waiting, 0);
+  g_mutex_unlock (&lock);
+}
+
+static void
+ring_put (log_ring_t *ring, entry_kind_t kind, bng_log_level_t level,
+	  const gchar *text, gsize len)
+{
+  guint head = ring->head;
+  guint need = ENTRY_SPACE (len);
+  guint room = LOG_RING_SIZE - head % LOG_RING_SIZE;
+  guint skip = room < need ? room : 0;
+  entry_t *entry;
+
+  if (!ring_has_space (ring, skip + need))
+    ring_park (ring, skip + need);
+
+  /* Stopped while parked. */
+  if (!g_atomic_int_get (&started))
+    {
+      console_direct (kind, level, text, len);
+      return;
+    }
+
+  if (skip)
+    {
+      entry = (entry_t *) (ring->buf + head % LOG_RING_SIZE);
+      entry->len = skip - sizeof (entry_t);
+      entry->kind = ENTRY_SKIP;
+      head += skip;
+    }
+
+  entry = (entry_t *) (ring->buf + head % LOG_RING_SIZE);
+  entry->len = len;
+  entry->kind = kind;
+  entry->level = level;
+  memcpy (entry + 1, text, len);
+
+  head += need;
+  g_atomic_int_set (&ring->head, head);
+  if (head - (guint) g_atomic_int_get (&ring->tail) > LOG_RING_HIGH)
+    console_wake ();
+}
+
+/* Encode the call as an event, formatting is left to the flusher. */
+static void
+console_post_event (entry_kind_t kind, bng_log_level_t level, const gchar *format, va_list args)
+{
+  guint64 line[LOG_LINE_SIZE / sizeof (guint64)];
+  gchar *buf = (gchar *) line;
+  bng_log_event_t *event;
+  bng_log_format_t *fmt;
+  log_ring_t *ring = ring_get ();
+  gchar *text = NULL;
+  gsize size = sizeof (line) - sizeof (*event), len;
+  va_list args_copy;
+
+  fmt = ring_format (ring, format);
+  if (fmt->text)
+    {
+      /* Arguments the encoder does not know, queue the text. */
+      text = g_strdup_vprintf (format, args);
+      fmt = ring_format (ring, "%s");
+      len = bng_log_event_encode_text (text, strlen (text), buf + sizeof (*event), size);
+    }
+  else
+    {
+      va_copy (args_copy, args);
+      len = bng_log_event_encode (fmt, args_copy, buf + sizeof (*event), size);
+      va_end (args_copy);
+    }
+
+  if (len > size)
+    {
+      buf = g_malloc (sizeof (*event) + len);
+      if (text)
+	bng_log_event_encode_text (text, strlen (text), buf + sizeof (*event), len);
+      else
+	bng_log_event_encode (fmt, args, buf + sizeof (*event), len);
+    }
+  g_free (text);
+
+  event = (bng_log_event_t *) buf;
+  event->id = fmt->id;
+  event->kind = kind;
+  event->level = level;
+  event->pad = 0;
+  event->tid = ring->tid;
+  event->time = g_get_real_time ();
+  len += sizeof (*event);
+
+  if (ENTRY_SPACE (len) > LOG_RING_SIZE / 2)
+    {
+      bng_console_flush ();
+      console_direct (ENTRY_EVENT, level, buf, len);
+    }
+  else
+    ring_put (ring, ENTRY_EVENT, level, buf, len);
+
+  if (buf != (gchar *) line)
+    g_free (buf);
+}
+
+static void
+console_post (entry_kind_t kind, bng_log_level_t level, const gchar *format, va_list args)
+{
+  gchar line[LOG_LINE_SIZE];
+  gchar *text = line;
+  va_list args_copy;
+  gint len;
+
+  if (g_atomic_int_get (&events) && g_atomic_int_get (&started))
+    {
+      console_post_event (kind, level, format, args);
+      return;
+    }
+
+  va_copy (args_copy, args);
+  len = g_vsnprintf (line, sizeof (line), format, args_copy);
+  va_end (args_copy);
+
+  if (len < 0)
+    return;
+  if (len >= (gint) sizeof (line))
+    text = g_strdup_vprintf (format, args);
+
+  if (!g_atomic_int_get (&started))
+    console_direct (kind, level, text, len);
+  else if (ENTRY_SPACE (len) > LOG_RING_SIZE / 2)
+    {
+      /* Too big for the ring, keep the order with what is queued. */
+      bng_console_flush ();
+      console_direct (kind, level, text, len);
+    }
+  else
+    ring_put (ring_get (), kind, level, text, len);
+
+  if (text != line)
+    g_free (text);
+}
+
+/* A script ending with sys.exit() leaves through Py_Exit and exit(),
+   never reaching bng_fini. Write out what is still queued then. */
+static void
+console_atexit (void)
+{
+  bng_console_fini ();
+}
+
+/************* INTERFACE *************/
+
 gint
 bng_console_init (bng_console_t msg, bng_console_t log, bng_log_level_t log_level)
 {
+  static gboolean exit_hook;
+  GError *error = NULL;
+  gint status;
+
+  if (!exit_hook)
+    {
+      atexit (console_atexit);
+      exit_hook = TRUE;
+    }
+
   msg_console = msg;
   log_console = log;
   bng_log_level = log_level;
+
+  g_mutex_lock (&drain_lock);
+  console_write (TRUE);
+  sink_close_all ();
+  status = sink_add_console (&msg, &msg_sinks);
+  if (status == 0)
+    status = sink_add_console (&log, &log_sinks);
+  if (status != 0)
+    {
+      gint err = errno;
+      sink_close_all ();
+      g_mutex_unlock (&drain_lock);
+      errno = err;
+      return (-1);
+    }
+  g_mutex_unlock (&drain_lock);
+
+  g_atomic_int_set (&stop, 0);
+  flusher = g_thread_try_new ("bungee-log", console_flusher, NULL, &error);
+  if (flusher == NULL)
+    {
+      /* Still usable, every line is written directly. */
+      fprintf (stderr, "WARNING: unable to start log flusher, %s\n", error->message);
+      g_error_free (error);
+      return (0);
+    }
+
+  g_atomic_int_set (&started, 1);
   return (0);
 }
 
+/* Write out everything queued so far. */
+void
+bng_console_flush (void)
+{
+  if (!g_atomic_int_get (&started))
+    return;
+
+  g_mutex_lock (&drain_lock);
+  console_drain ();
+  console_write (TRUE);
+  g_mutex_unlock (&drain_lock);
+}
+
+/* Stop the flusher, write out the rest and fall back to direct writes. */
 gint
-bng_msg (gchar *format, ...)
+bng_console_fini (void)
 {
-  gchar *msg_buff = NULL;
-  va_list args;
+  if (!g_atomic_int_get (&started))
+    return (0);
 
-  va_start (args, format);
-  msg_buff = g_strdup_vprintf (format, args);
+  g_atomic_int_set (&stop, 1);
+  g_mutex_lock (&lock);
+  flusher_urgent = 1;
+  g_cond_signal (&wake);
+  g_mutex_unlock (&lock);
+  g_thread_join (flusher);
+  flusher = NULL;
+
+  /* Producers parked on a full ring write directly from now on. */
+  g_atomic_int_set (&started, 0);
+  g_mutex_lock (&drain_lock);
+  console_drain ();
+  console_write (TRUE);
+  sink_close_all ();
+  g_mutex_unlock (&drain_lock);
+
+  return (0);
+}
+
+/* Call in the child right after fork. The flusher did not survive, the
+   parent writes whatever was queued at the time. */
+void
+bng_console_fork_child (void)
+{
+  log_ring_t *ring, *own = g_private_get (&thread_ring);
+  guint i;
+
+  /* Other threads held them maybe, none of them exist here. */
+  g_mutex_init (&lock);
+  g_mutex_init (&drain_lock);
+  g_cond_init (&wake);
+  g_cond_init (&space);
+  flusher_waiting = 0;
+  flusher_urgent = 0;
+  flusher = NULL;
 
-  switch (msg_console.type)
+  for (ring = rings; ring; ring = ring->next)
     {
-    case BNG_CONSOLE_TYPE_FILE:
-    case BNG_CONSOLE_TYPE_SYSLOG:
-    case BNG_CONSOLE_TYPE_ZMQ:
-    default:
-      fputs (msg_buff, stderr);
-      fputc ('\n', stderr);
+      ring->tail = ring->head;
+      ring->waiting = 0;
+      if (ring != own)
+	ring->orphan = 1;
     }
+  if (own)
+    own->tid = log_tid ();
 
-  va_end (args);
-  g_free (msg_buff);
+  /* The parent writes what is buffered and rotates the files, several
+     processes renaming the same file would lose lines. */
+  for (i = 0; i < nsinks; i++)
+    {
+      if (sinks[i].buf)
+	g_string_truncate (sinks[i].buf, 0);
+      if (sinks[i].type == BNG_CONSOLE_TYPE_FILE && sinks[i].path && sinks[i].rotate_size)
+	sinks[i].follow = TRUE;
+      sinks[i].rotate_size = 0;
+      /* Formats are per process in the file. */
+      if (sinks[i].emitted)
+	memset (sinks[i].emitted, 0, sinks[i].emitted_size);
+      /* A stream shared with the parent would mix up lines. */
+      if (sinks[i].type == BNG_CONSOLE_TYPE_SOCKET)
+	{
+	  if (sinks[i].fd >= 0)
+	    close (sinks[i].fd);
+	  sinks[i].fd = -1;
+	  sinks[i].retry = 0;
+	  sinks[i].partial = FALSE;
+	  sinks[i].dropped = 0;
+	}
+    }
 
-  return (0);
+  if (!g_atomic_int_get (&started))
+    return;
+
+  flusher = g_thread_try_new ("bungee-log", console_flusher, NULL, NULL);
+  if (flusher == NULL)
+    g_atomic_int_set (&started, 0);
 }
 
 gint
-bng_log (gchar *format, ...)
+bng_msg (gchar *format, ...)
 {
-  gchar *log_buff = NULL;
   va_list args;
 
   va_start (args, format);
-  log_buff = g_strdup_vprintf (format, args);
+  console_post (ENTRY_MSG, BNG_LOG_LEVEL_INFO, format, args);
+  va_end (args);
 
-  switch (log_console.type)
-    {
-    case BNG_CONSOLE_TYPE_FILE:
-    case BNG_CONSOLE_TYPE_SYSLOG:
-    case BNG_CONSOLE_TYPE_ZMQ:
-    default:
-      fputs (log_buff, stderr);
-      fputc ('\n', stderr);
-    }
+  return (0);
+}
 
+/* The BNG_* macros check the level before they get here. */
+gint
+bng_log (bng_log_level_t level, gchar *format, ...)
+{
+  va_list args;
+
+  if (!BNG_LOG_ENABLED (level))
+    return (0);
+
+  va_start (args, format);
+  console_post (ENTRY_LOG, level, format, args);
   va_end (args);
-  g_free (log_buff);
 
   return (0);
 }
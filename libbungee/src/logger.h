@@ -38,29 +38,66 @@ typedef enum {
   BNG_CONSOLE_TYPE_STDERR  = 1 << 1,
   BNG_CONSOLE_TYPE_FILE    = 1 << 2,
   BNG_CONSOLE_TYPE_SYSLOG  = 1 << 3,
-  BNG_CONSOLE_TYPE_ZMQ     = 1 << 4
+  BNG_CONSOLE_TYPE_SOCKET  = 1 << 4
 } bng_console_type_t;
 
 typedef struct
 {
-  bng_console_type_t type;
+  bng_console_type_t type; /* Every target set here gets each line */
   union
   {
     FILE* fp;
     /* syslog */
   } device;
+  /* BNG_CONSOLE_TYPE_FILE: the file is opened, appended to and rotated
+     by name. Without a path device.fp is written as is. */
+  const gchar *path;
+  gsize rotate_size;       /* Rotate once the file would exceed it, 0 never */
+  guint rotate_keep;       /* Rotated files kept as path.1 .. path.N */
+  gboolean binary;         /* FILE with a path: binary events, read back
+			      with bungee --decode-log */
+  /* BNG_CONSOLE_TYPE_SOCKET: "unix:PATH" or "tcp:HOST:PORT" of a
+     collector. Lines it does not keep up with are dropped. */
+  const gchar *address;
 } bng_console_t;
 
+/* Most verbose level compiled in, configure --with-log-level lowers it.
+   Calls above it are removed by the compiler, arguments and all. */
+#ifndef BNG_LOG_COMPILED_LEVEL
+#define BNG_LOG_COMPILED_LEVEL BNG_LOG_LEVEL_DEBUG
+#endif
+
+extern bng_log_level_t bng_log_level;
+
+/* Checked before the arguments are evaluated or anything is formatted. */
+#define BNG_LOG_ENABLED(level) \
+  ((level) <= BNG_LOG_COMPILED_LEVEL && (level) <= bng_log_level)
+
+#define BNG_LOG(level, prefix, format, ...)				\
+  do {									\
+    if (BNG_LOG_ENABLED (level))					\
+      bng_log (level, prefix" [%s:%d]: "format, __FILE__, __LINE__, ##__VA_ARGS__); \
+  } while (0)
+
 #define BNG_MSG(format, ...) bng_msg (format, ##__VA_ARGS__)
 
-#define BNG_FATAL(format, ...) bng_log ("FATAL [%s:%d]: "format, __FILE__, __LINE__, ##__VA_ARGS__)
-#define BNG_ERR(format, ...) bng_log ("ERROR [%s:%d]: "format, __FILE__, __LINE__, ##__VA_ARGS__)
-#define BNG_WARN(format, ...) bng_log ("WARNING [%s:%d]: "format, __FILE__, __LINE__, ##__VA_ARGS__)
-#define BNG_DBG(format, ...) bng_log ("DEBUG [%s:%d]: "format, __FILE__, __LINE__, ##__VA_ARGS__)
+#define BNG_FATAL(format, ...) BNG_LOG (BNG_LOG_LEVEL_FATAL, "FATAL", format, ##__VA_ARGS__)
+#define BNG_ERR(format, ...) BNG_LOG (BNG_LOG_LEVEL_ERROR, "ERROR", format, ##__VA_ARGS__)
+#define BNG_WARN(format, ...) BNG_LOG (BNG_LOG_LEVEL_WARNING, "WARNING", format, ##__VA_ARGS__)
+#define BNG_INFO(format, ...) BNG_LOG (BNG_LOG_LEVEL_INFO, "INFO", format, ##__VA_ARGS__)
+/* Debug lines sit on per record error paths, keep them off the hot path. */
+#define BNG_DBG(format, ...)						\
+  do {									\
+    if (G_UNLIKELY (BNG_LOG_ENABLED (BNG_LOG_LEVEL_DEBUG)))		\
+      bng_log (BNG_LOG_LEVEL_DEBUG, "DEBUG [%s:%d]: "format, __FILE__, __LINE__, ##__VA_ARGS__); \
+  } while (0)
 
 gint bng_console_init (bng_console_t msg, bng_console_t log, bng_log_level_t log_level);
+void bng_console_flush (void);
+gint bng_console_fini (void);
+void bng_console_fork_child (void);
 gint bng_msg (gchar *format, ...);
-gint bng_log (gchar *format, ...);
+gint bng_log (bng_log_level_t level, gchar *format, ...) G_GNUC_PRINTF (2, 3);
 
 #ifdef __cplusplus
 }
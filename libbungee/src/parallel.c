@@ -0,0 +1,548 @@
+/*
+parallel.c: multi-process execution of the engine
+
+This file is part of Bungee.
+
+Copyright 2012 Red Hat, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+/*
+  A single interpreter keeps the engine on one core. In parallel mode
+  bng_engine forks N workers once BEGIN has run, each a full copy of the
+  interpreter with the script, the rules and the BEGIN state:
+
+                     +-------------+   batches   +----------+
+    INPUT / source ->| coordinator |------------>| worker 0 |--+
+                     |             |------------>| worker 1 |--+ globals
+                     +-------------+    ...      +----------+  |
+                            ^                                  |
+                            +------ merge, then END <----------+
+
+  Records travel to the workers as marshalled lists, round robin. Sources
+  that can be split are not fed at all: every worker reads its own byte
+  range of a memory mapped file, or takes the next of many files (see
+  input-files.c). When its input ends a worker pickles its
+  globals back to the coordinator, which merges them with the reducers
+  declared through Bungee.reduce() before END.
+
+  Globals are pickled one by one. One that cannot be pickled, like the
+  file of $fd = open(...), is left out: silently when it is still what
+  BEGIN left behind, the coordinator has it too, with a warning naming it
+  otherwise.
+
+  Frames on both pipes are a native guint32 length followed by the payload.
+*/
+
+/* Python.h should be the first header to include, even before system headers */
+#include <Python.h>
+#include <marshal.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <glib.h>
+
+#include "local-defs.h"
+#include "logger.h"
+#include "python-bungee-globals.h"
+#include "parallel.h"
+
+typedef struct
+{
+  pid_t pid;
+  gint in_fd;   /* Coordinator -> worker, records */
+  gint out_fd;  /* Worker -> coordinator, globals */
+} worker_t;
+
+static worker_t *workers;  /* Coordinator only */
+static guint nworkers;
+static guint next_worker;  /* Round robin position */
+static PyObject *fork_state; /* Globals every worker started from */
+
+static gint worker_in_fd = -1;  /* Worker only */
+static gint worker_out_fd = -1;
+
+/************* FRAMING *************/
+
+static gint
+write_all (gint fd, const gchar *buf, gsize len)
+{
+  while (len > 0)
+    {
+      ssize_t n = write (fd, buf, len);
+      if (n < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  return -1;
+	}
+      buf += n;
+      len -= n;
+    }
+  return 0;
+}
+
+/* Returns 1 on success, 0 on end of file before the first byte and -1 on
+   error or a truncated read. */
+static gint
+read_all (gint fd, gchar *buf, gsize len)
+{
+  gsize done = 0;
+
+  while (done < len)
+    {
+      ssize_t n = read (fd, buf + done, len - done);
+      if (n < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  return -1;
+	}
+      if (n == 0)
+	{
+	  if (done == 0)
+	    return 0;
+	  errno = EPIPE;
+	  return -1;
+	}
+      done += n;
+    }
+  return 1;
+}
+
+static gint
+frame_write (gint fd, PyObject *py_bytes)
+{
+  guint32 len = PyBytes_GET_SIZE (py_bytes);
+
+  if (write_all (fd, (const gchar *) &len, sizeof (len)) != 0
+      || write_all (fd, PyBytes_AS_STRING (py_bytes), len) != 0)
+    {
+      PyErr_SetFromErrno (PyExc_OSError);
+      return -1;
+    }
+  return 0;
+}
+
+/* Next frame as a new bytes object. NULL without an exception at the end
+   of the stream. */
+static PyObject *
+frame_read (gint fd)
+{
+  guint32 len;
+  gint status;
+  PyObject *py_bytes;
+
+  status = read_all (fd, (gchar *) &len, sizeof (len));
+  if (status == 0)
+    return NULL;
+  if (status < 0)
+    return PyErr_SetFromErrno (PyExc_OSError);
+
+  py_bytes = PyBytes_FromStringAndSize (NULL, len);
+  if (py_bytes == NULL)
+    return NULL;
+
+  if (read_all (fd, PyBytes_AS_STRING (py_bytes), len) != 1)
+    {
+      Py_DECREF (py_bytes);
+      return PyErr_SetFromErrno (PyExc_OSError);
+    }
+
+  return py_bytes;
+}
+
+/************* PICKLE *************/
+
+static PyObject *
+pickle_call (const gchar *func, PyObject *arg)
+{
+  PyObject *mod_pickle, *py_result;
+
+  mod_pickle = PyImport_ImportModule ("pickle");
+  if (mod_pickle == NULL)
+    return NULL;
+
+  py_result = PyObject_CallMethod (mod_pickle, func, "O", arg);
+  Py_DECREF (mod_pickle);
+  return py_result;
+}
+
+/************* COORDINATOR *************/
+
+/* State of a worker, see worker_state. Variables it could not pickle are
+   added to skipped. */
+static PyObject *
+state_loads (PyObject *py_bytes, GHashTable *skipped)
+{
+  PyObject *py_sent, *py_state, *name, *value;
+  Py_ssize_t pos = 0;
+
+  py_sent = pickle_call ("loads", py_bytes);
+  if (py_sent == NULL)
+    return NULL;
+  if (!PyDict_Check (py_sent))
+    {
+      PyErr_Format (PyExc_TypeError, "worker state must be dict, not %.200s",
+		    Py_TYPE (py_sent)->tp_name);
+      Py_DECREF (py_sent);
+      return NULL;
+    }
+
+  py_state = PyDict_New ();
+  while (py_state && PyDict_Next (py_sent, &pos, &name, &value))
+    {
+      if (value == Py_None)
+	{
+	  const gchar *str = PyUnicode_AsUTF8 (name);
+	  if (str && !g_hash_table_contains (skipped, str))
+	    g_hash_table_add (skipped, g_strdup (str));
+	  continue;
+	}
+
+      value = pickle_call ("loads", value);
+      if (value == NULL || PyDict_SetItem (py_state, name, value) != 0)
+	Py_CLEAR (py_state);
+      Py_XDECREF (value);
+    }
+
+  Py_DECREF (py_sent);
+  return py_state;
+}
+
+static void
+workers_close (void)
+{
+  guint i;
+
+  for (i = 0; i < nworkers; i++)
+    {
+      if (workers[i].in_fd >= 0)
+	close (workers[i].in_fd);
+      if (workers[i].out_fd >= 0)
+	close (workers[i].out_fd);
+    }
+}
+
+static gint
+workers_wait (void)
+{
+  gint status = 0;
+  guint i;
+
+  for (i = 0; i < nworkers; i++)
+    {
+      gint wstatus;
+
+      while (waitpid (workers[i].pid, &wstatus, 0) < 0)
+	{
+	  if (errno != EINTR)
+	    {
+	      wstatus = -1;
+	      break;
+	    }
+	}
+
+      if (!WIFEXITED (wstatus) || WEXITSTATUS (wstatus) != 0)
+	{
+	  BNG_ERR (_("Worker %u (pid %d) failed"), i, (gint) workers[i].pid);
+	  status = 1;
+	}
+    }
+
+  g_free (workers);
+  workers = NULL;
+  nworkers = 0;
+  Py_CLEAR (fork_state);
+  return status;
+}
+
+gint
+bng_parallel_fork (guint jobs)
+{
+  guint i, j;
+
+  workers = g_new0 (worker_t, jobs);
+  nworkers = 0;
+  next_worker = 0;
+
+  /* Whatever Python buffered must not be written once per process. */
+  PyObject *py_res = PyObject_CallMethod (PySys_GetObject ("stdout"), "flush", NULL);
+  Py_XDECREF (py_res);
+  PyErr_Clear ();
+  bng_console_flush ();
+  fflush (NULL);
+
+  /* Reducers count the common starting point only once, workers tell
+     what they changed from it. */
+  fork_state = bungee_globals_state ();
+  if (fork_state == NULL)
+    {
+      PyErr_Print ();
+      bng_parallel_abort ();
+      return -2;
+    }
+
+  for (i = 0; i < jobs; i++)
+    {
+      gint in_pipe[2], out_pipe[2];
+      pid_t pid;
+
+      if (pipe (in_pipe) != 0)
+	goto ERROR;
+      if (pipe (out_pipe) != 0)
+	{
+	  close (in_pipe[0]);
+	  close (in_pipe[1]);
+	  goto ERROR;
+	}
+
+      PyOS_BeforeFork ();
+      pid = fork ();
+      if (pid < 0)
+	{
+	  PyOS_AfterFork_Parent ();
+	  close (in_pipe[0]);
+	  close (in_pipe[1]);
+	  close (out_pipe[0]);
+	  close (out_pipe[1]);
+	  goto ERROR;
+	}
+
+      if (pid == 0)
+	{
+	  PyOS_AfterFork_Child ();
+	  bng_console_fork_child ();
+
+	  /* Pipes of the workers forked before us belong to the coordinator. */
+	  for (j = 0; j < nworkers; j++)
+	    {
+	      close (workers[j].in_fd);
+	      close (workers[j].out_fd);
+	    }
+	  g_free (workers);
+	  workers = NULL;
+	  nworkers = 0;
+
+	  close (in_pipe[1]);
+	  close (out_pipe[0]);
+	  worker_in_fd = in_pipe[0];
+	  worker_out_fd = out_pipe[1];
+	  return i;
+	}
+
+      PyOS_AfterFork_Parent ();
+      close (in_pipe[0]);
+      close (out_pipe[1]);
+      workers[i].pid = pid;
+      workers[i].in_fd = in_pipe[1];
+      workers[i].out_fd = out_pipe[0];
+      nworkers++;
+    }
+
+  BNG_DBG (_("Forked %u workers"), jobs);
+  return -1;
+
+ ERROR:
+  BNG_ERR (_("Unable to start worker %u, %s"), i, strerror (errno));
+  bng_parallel_abort ();
+  return -2;
+}
+
+gint
+bng_parallel_send (PyObject *py_batch)
+{
+  PyObject *py_bytes;
+  gint status;
+
+  py_bytes = PyMarshal_WriteObjectToString (py_batch, Py_MARSHAL_VERSION);
+  if (py_bytes == NULL)
+    return -1;
+
+  status = frame_write (workers[next_worker].in_fd, py_bytes);
+  Py_DECREF (py_bytes);
+
+  next_worker = (next_worker + 1) % nworkers;
+  return status;
+}
+
+gint
+bng_parallel_join (void)
+{
+  GHashTable *skipped = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  GHashTableIter iter;
+  gpointer name;
+  gint status = 0;
+  guint i;
+
+  /* End of input for every worker. */
+  for (i = 0; i < nworkers; i++)
+    {
+      close (workers[i].in_fd);
+      workers[i].in_fd = -1;
+    }
+
+  for (i = 0; i < nworkers; i++)
+    {
+      PyObject *py_bytes, *py_state;
+
+      py_bytes = frame_read (workers[i].out_fd);
+      close (workers[i].out_fd);
+      workers[i].out_fd = -1;
+
+      if (py_bytes == NULL)
+	{
+	  if (PyErr_Occurred ())
+	    PyErr_Print ();
+	  status = 1; /* Worker died without reporting. */
+	  continue;
+	}
+
+      py_state = state_loads (py_bytes, skipped);
+      Py_DECREF (py_bytes);
+
+      if (py_state == NULL || bungee_globals_merge (py_state, fork_state) != 0)
+	{
+	  BNG_ERR (_("Unable to merge the globals of worker %u"), i);
+	  PyErr_Print ();
+	  status = 1;
+	}
+      Py_XDECREF (py_state);
+    }
+
+  /* Once per variable, however many workers left it out. */
+  g_hash_table_iter_init (&iter, skipped);
+  while (g_hash_table_iter_next (&iter, &name, NULL))
+    BNG_WARN (_("$%s cannot be pickled, the changes of the workers to it are lost"),
+	      (gchar *) name);
+  g_hash_table_destroy (skipped);
+
+  if (workers_wait () != 0)
+    status = 1;
+
+  return status;
+}
+
+void
+bng_parallel_abort (void)
+{
+  guint i;
+
+  workers_close ();
+  for (i = 0; i < nworkers; i++)
+    kill (workers[i].pid, SIGTERM);
+  workers_wait ();
+}
+
+/************* WORKER *************/
+
+PyObject *
+bng_parallel_recv (void)
+{
+  PyObject *py_bytes, *py_batch;
+
+  py_bytes = frame_read (worker_in_fd);
+  if (py_bytes == NULL)
+    return NULL;
+
+  py_batch = PyMarshal_ReadObjectFromString (PyBytes_AS_STRING (py_bytes),
+					     PyBytes_GET_SIZE (py_bytes));
+  Py_DECREF (py_bytes);
+  return py_batch;
+}
+
+/* The globals of this worker for the coordinator: each one pickled on
+   its own, None for one changed since the fork that cannot be. One that
+   does not pickle and is still the object BEGIN left behind is left out,
+   the coordinator holds the same. Unchanged objects that do pickle are
+   sent anyway, they may have been changed in place. */
+static PyObject *
+worker_state (void)
+{
+  PyObject *py_state, *py_sent, *name, *value, *base, *py_bytes;
+  Py_ssize_t pos = 0;
+
+  py_state = bungee_globals_state ();
+  if (py_state == NULL)
+    return NULL;
+
+  py_sent = PyDict_New ();
+  while (py_sent && PyDict_Next (py_state, &pos, &name, &value))
+    {
+      base = fork_state ? PyDict_GetItem (fork_state, name) : NULL;
+
+      py_bytes = pickle_call ("dumps", value);
+      if (py_bytes == NULL)
+	{
+	  if (!PyErr_ExceptionMatches (PyExc_Exception))
+	    {
+	      Py_CLEAR (py_sent);
+	      break;
+	    }
+	  PyErr_Clear ();
+	  if (value == base && !bungee_globals_reduced (name))
+	    continue;
+	  py_bytes = Py_None;
+	  Py_INCREF (py_bytes);
+	}
+
+      if (PyDict_SetItem (py_sent, name, py_bytes) != 0)
+	Py_CLEAR (py_sent);
+      Py_DECREF (py_bytes);
+    }
+
+  Py_DECREF (py_state);
+  if (py_sent == NULL)
+    return NULL;
+
+  py_bytes = pickle_call ("dumps", py_sent);
+  Py_DECREF (py_sent);
+  return py_bytes;
+}
+
+void
+bng_parallel_exit (gint status)
+{
+  PyObject *py_bytes = NULL, *py_res;
+
+  close (worker_in_fd);
+
+  /* A failed worker reports nothing, the coordinator notices. */
+  if (status == 0)
+    {
+      py_bytes = worker_state ();
+      if (py_bytes == NULL || frame_write (worker_out_fd, py_bytes) != 0)
+	{
+	  PyErr_Print ();
+	  status = 1;
+	}
+      Py_XDECREF (py_bytes);
+    }
+  close (worker_out_fd);
+
+  /* _exit skips interpreter shutdown, flush what the script printed. */
+  py_res = PyObject_CallMethod (PySys_GetObject ("stdout"), "flush", NULL);
+  Py_XDECREF (py_res);
+  py_res = PyObject_CallMethod (PySys_GetObject ("stderr"), "flush", NULL);
+  Py_XDECREF (py_res);
+  PyErr_Clear ();
+  bng_console_fini ();
+  fflush (NULL);
+
+  _exit (status);
+}
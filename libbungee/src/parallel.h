@@ -0,0 +1,54 @@
+/*
+parallel.h: multi-process execution of the engine
+
+This file is part of Bungee.
+
+Copyright 2012 Red Hat, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef _PARALLEL_H
+#define _PARALLEL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Fork jobs worker processes. Returns the worker index (0 .. jobs - 1) in
+   a worker, -1 in the coordinator and -2 on error. */
+gint bng_parallel_fork (guint jobs);
+
+/* Coordinator: hand a batch of records (list) to the next worker, round
+   robin. Blocks while the worker is busy. */
+gint bng_parallel_send (PyObject *py_batch);
+
+/* Worker: next batch of records from the coordinator, a new reference.
+   NULL at the end of input, or on error with an exception set. */
+PyObject *bng_parallel_recv (void);
+
+/* Worker: ship the globals to the coordinator and exit the process. */
+void bng_parallel_exit (gint status) G_GNUC_NORETURN;
+
+/* Coordinator: end the input, merge every worker's globals in worker
+   order and reap the workers. Returns non zero if any worker failed. */
+gint bng_parallel_join (void);
+
+/* Coordinator: kill and reap the workers after an error. */
+void bng_parallel_abort (void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _PARALLEL_H */
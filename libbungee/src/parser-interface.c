@@ -19,6 +19,7 @@
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <glib.h>
@@ -27,23 +28,78 @@
 #include "local-defs.h"
 #include "logger.h"
 #include "parser.h"
+#include "compile-cache.h"
 
-/* Compile Bungee [file].bng script to [file].bngo output. */
+/* Compile an in-memory .bng source to generated Python. */
+gint
+bng_compile_string (const gchar *source, gsize len, const gchar *script_name,
+		    gchar **code, gsize *code_len, FILE *err_fp)
+{
+  FILE *script_fp, *out_fp;
+  char *buf = NULL;
+  size_t buf_len = 0;
+  gint status;
+
+  if (source == NULL || len == 0)
+    {
+      BNG_DBG (_("Empty script [%s]"), script_name);
+      errno = EINVAL;
+      return 1;
+    }
+
+  script_fp = fmemopen ((void *) source, len, "r");
+  if (script_fp == NULL)
+    {
+      BNG_DBG (_("Unable to read [%s], %s"), script_name, strerror (errno));
+      return 1;
+    }
+
+  out_fp = open_memstream (&buf, &buf_len);
+  if (out_fp == NULL)
+    {
+      BNG_DBG (_("Unable to create compiler output buffer, %s"), strerror (errno));
+      fclose (script_fp);
+      return 1;
+    }
+
+  status = bng_compile (script_fp, script_name, out_fp, err_fp);
+  fclose (script_fp);
+  fclose (out_fp); /* Flushes buf and buf_len. */
+
+  if (status != 0)
+    {
+      free (buf);
+      return status;
+    }
+
+  *code = buf;
+  *code_len = buf_len;
+  return 0;
+}
+
+/* Compile Bungee [file].bng script to [file].bngo output. The generated
+   code is also stored in the compile cache for bng_load to pick up. */
 gint
 bng_compile_file (const gchar *path, FILE *err_fp)
 {
+  GError *error = NULL;
+  gchar *source = NULL, *key;
+  gsize source_len = 0;
+  gchar *code = NULL;
+  gsize code_len = 0;
   gint status = 0;
+
   if (!path || !path[0])
     {
       BNG_DBG (_("File name required.\n"));
       return 1;
     }
 
-  /* Open script source. */
-  FILE* script_fp = fopen (path, "r");
-  if (script_fp == NULL)
+  /* Read script source. */
+  if (!g_file_get_contents (path, &source, &source_len, &error))
     {
-      BNG_DBG (_("Unable to read [%s], %s"), path, strerror (errno));
+      BNG_DBG (_("Unable to read [%s], %s"), path, error->message);
+      g_error_free (error);
       return 1;
     }
 
@@ -54,25 +110,26 @@ bng_compile_file (const gchar *path, FILE *err_fp)
   else
     out_name = g_strdup_printf ("%s.bngo", path);
 
-  if (out_name == NULL)
-    {
-      BNG_DBG (_("Unable to construct output file name from [%s], %s"), path, strerror (errno));
-      return 1;
-    }
+  status = bng_compile_string (source, source_len, path, &code, &code_len, err_fp);
+  if (status != 0)
+    goto END;
 
-  FILE *out_fp = fopen (out_name, "w");
-  if (out_fp == NULL)
+  if (!g_file_set_contents (out_name, code, code_len, &error))
     {
-      BNG_DBG (_("Unable to open [%s] in write mode, %s"), out_name, strerror (errno));
-      g_free (out_name);
-      return 1;
+      BNG_DBG (_("Unable to write [%s], %s"), out_name, error->message);
+      g_error_free (error);
+      status = 1;
+      goto END;
     }
 
-  status = bng_compile (script_fp, path, out_fp, err_fp);
+  key = bng_cache_key (source, source_len);
+  bng_cache_store (key, BNG_CACHE_SUFFIX_SOURCE, code, code_len);
+  g_free (key);
 
+ END:
+  free (code);
   g_free (out_name);
-  fclose (script_fp);
-  fclose (out_fp);
+  g_free (source);
 
   return status;
 }
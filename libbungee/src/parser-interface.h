@@ -35,6 +35,12 @@ extern "C" {
    NULL err_fp disables bison error messages. */
 int bng_compile (FILE *script_fp, const char *script_name, FILE *output_fp, FILE *err_fp);
 
+/* Compile len bytes of Bungee source to generated Python. On success
+   *code holds a NUL terminated buffer of *code_len bytes, release it
+   with free. */
+gint bng_compile_string (const gchar *source, gsize len, const gchar *script_name,
+			 gchar **code, gsize *code_len, FILE *err_fp);
+
 /* Compile Bungee [file].bng script to [file].bngo output.
    NULL err_fp disables bison error messages. Debug logs will work how ever. */
 gint bng_compile_file (const gchar *script_name, FILE *err_fp);
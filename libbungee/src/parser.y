@@ -18,6 +18,9 @@
   limitations under the License.
 */
 
+/* The Python generated here is cached by compile-cache.c, bump
+   BNG_CACHE_FORMAT in compile-cache.h whenever it changes. */
+
 /*** Bison declarations ***/
 /* Start symbol */
 %start program
@@ -32,7 +35,7 @@
 
 /** Terminal symbols **/
 /* Terminal symbols with no value */
-%token TBEGIN TINPUT TEND TRULE TGROUP TEOF
+%token TBEGIN TINPUT TEND TBEGINFILE TENDFILE TRULE TGROUP TEOF
 /* Terminal symbols with string value */
 %token <string> TGROUP_NAME TRULE_NAME TRULE_CONDT
 
@@ -55,12 +58,16 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <ctype.h>
 #include <errno.h>
 }
 
 %code provides {
 /* Compile .bng source to .bngo format */
 int bng_compile (FILE *script_fp, const char *script_name, FILE *out_fp, FILE *err_fp);
+
+/* Print the Python expansion of a $ symbol (sym points at '$'). */
+void bng_print_var (local_vars_t *locals, FILE *out, const char *sym, size_t len);
 }
 
 %code requires {
@@ -77,7 +84,16 @@ int bng_compile (FILE *script_fp, const char *script_name, FILE *out_fp, FILE *e
       unsigned char begin;
       unsigned char input;
       unsigned char end;
+      unsigned char beginfile;
+      unsigned char endfile;
     } found;
+    struct {
+      char **names; /* $ names in the order of first use, index is the slot in the script's view. */
+      size_t count;
+      size_t size;
+    } vars;
+    unsigned char fields; /* $1 .. $N or $NF is used */
+    unsigned char json;   /* $.name is used */
   } local_vars_t;
 
 /* Terminal location type */
@@ -99,12 +115,13 @@ typedef struct YYLTYPE {
 #include "scanner.h"
 
 extern int yyerror (yyscan_t yyscanner, const char *format, ...) __attribute__ ((format (gnu_printf, 2, 3)));
+static void _print_rule (local_vars_t *locals, FILE *out, const char *group, const char *rule, const char *condt);
 }
 
 /* Grammar Rules */
 %%
 program: | program section
-section: begincb | inputcb | rule | endcb
+section: begincb | inputcb | beginfilecb | endfilecb | rule | endcb
 
 begincb:
 TBEGIN
@@ -118,6 +135,18 @@ TINPUT
   fprintf (yyget_out (yyscanner), "def INPUT():");
 }
 
+beginfilecb:
+TBEGINFILE
+{
+  fprintf (yyget_out (yyscanner), "def BEGINFILE():");
+}
+
+endfilecb:
+TENDFILE
+{
+  fprintf (yyget_out (yyscanner), "def ENDFILE():");
+}
+
 rule: TRULE TRULE_NAME TRULE_CONDT
 {
   if ($2 == NULL)
@@ -126,12 +155,7 @@ rule: TRULE TRULE_NAME TRULE_CONDT
       YYABORT;
     }
 
-  if ($3 == NULL)
-    fprintf (yyget_out (yyscanner), "Rules.append('_global', '%s', lambda: True, '_ation_%s')\n", $2, $2);
-  else
-    fprintf (yyget_out (yyscanner), "Rules.append('_global', '%s', lambda: %s, '_action_%s')\n", $2, $3, $2);
-
-  fprintf (yyget_out (yyscanner), "def _action_%s():", $2);
+  _print_rule (yyget_extra (yyscanner), yyget_out (yyscanner), "_global", $2, $3);
 
   XFREE ($2);
   XFREE ($3);
@@ -156,12 +180,7 @@ rule: TRULE TRULE_NAME TRULE_CONDT
       YYABORT;
     }
 
-  if ($5 == NULL)
-    fprintf (yyget_out (yyscanner), "Rules.append('%s', '%s', '''lambda: True''', '_action_%s')\n", $2, $4, $4);
-  else
-    fprintf (yyget_out (yyscanner), "Rules.append('%s', '%s', '''lambda: %s''', '_action_%s')\n", $2, $4, $5, $4);
-
-  fprintf (yyget_out (yyscanner), "def _action_%s():", $4);
+  _print_rule (yyget_extra (yyscanner), yyget_out (yyscanner), $2, $4, $5);
 
   XFREE ($2);
   XFREE ($4);
@@ -180,31 +199,266 @@ TEND
 
 %%
 
+/* $name accesses are compiled to _bng_V<hash>[slot], where <hash> is
+   computed over all the names of the script once it is parsed. Until then
+   this placeholder of the same length is emitted and patched afterwards. */
+#define VIEW_PREFIX "_bng_V"
+#define VIEW_HASH_PLACEHOLDER "@@@@@@@@@@@@@@@@"
+#define VIEW_HASH_LEN 16
+
+/* $1 .. $N and $NF are compiled to calls of this, see python-module-fields.c. */
+#define FIELD_FUNC "_bng_F"
+
+/* $.name is compiled to calls of this, see python-module-json.c. */
+#define JSON_FUNC "_bng_J"
+
+/* Slot of name in the script's view, assigned on first use. */
+static size_t
+_var_slot (local_vars_t *locals, const char *name, size_t len)
+{
+  size_t i;
+
+  for (i = 0; i < locals->vars.count; i++)
+    if (strncmp (locals->vars.names[i], name, len) == 0 && locals->vars.names[i][len] == '\0')
+      return i;
+
+  if (locals->vars.count == locals->vars.size)
+    {
+      locals->vars.size = locals->vars.size ? locals->vars.size * 2 : 16;
+      locals->vars.names = realloc (locals->vars.names, locals->vars.size * sizeof (char *));
+    }
+  locals->vars.names[locals->vars.count] = strndup (name, len);
+
+  return locals->vars.count++;
+}
+
+void
+bng_print_var (local_vars_t *locals, FILE *out, const char *sym, size_t len)
+{
+  if (len == 2 && sym[1] == '$') /* Dictionary of all Bungee global variables. */
+    fputs ("Bungee._globals", out);
+  else if (len == 2 && sym[1] == '*') /* All field values in a list. */
+    fputs ("Bungee._globals.items()", out);
+  else if (len == 2 && sym[1] == '@') /* All field symbols in a list. */
+    fputs ("Bungee._globals.keys()", out);
+  else if (len == 2 && sym[1] == '#') /* Number of fields. */
+    fputs ("len(Bungee._globals)", out);
+  else if (sym[1] >= '1' && sym[1] <= '9') /* Field of the current record, like AWK. */
+    {
+      locals->fields = 1;
+      fprintf (out, FIELD_FUNC "(%.*s)", (int) len - 1, sym + 1);
+    }
+  else if (len == 3 && strncmp (sym + 1, "NF", 2) == 0) /* Last field. */
+    {
+      locals->fields = 1;
+      fputs (FIELD_FUNC "(-1)", out);
+    }
+  else if (sym[1] == '.') /* Member of the current record as a JSON object. */
+    {
+      locals->json = 1;
+      fprintf (out, JSON_FUNC "('%.*s')", (int) len - 2, sym + 2);
+    }
+  else /* Global variable, $0 is the current record. */
+    fprintf (out, VIEW_PREFIX VIEW_HASH_PLACEHOLDER "[%zu]", _var_slot (locals, sym + 1, len - 1));
+}
+
+/* FNV-1a over the names, in slot order. */
+static unsigned long long
+_vars_hash (local_vars_t *locals)
+{
+  unsigned long long hash = 14695981039346656037ULL;
+  size_t i;
+  const char *c;
+
+  for (i = 0; i < locals->vars.count; i++)
+    for (c = locals->vars.names[i]; ; c++)
+      {
+	hash = (hash ^ (unsigned char) *c) * 1099511628211ULL;
+	if (*c == '\0')
+	  break;
+      }
+
+  return hash;
+}
+
+/* Emit the view binding the script's names to their global slots, then
+   the script body with the view name patched in. */
+static int
+_print_program (local_vars_t *locals, FILE *out, char *body, size_t body_len)
+{
+  char view_hash[VIEW_HASH_LEN + 1];
+  char *pos = body;
+  size_t i;
+
+  if (locals->vars.count)
+    {
+      snprintf (view_hash, sizeof (view_hash), "%016llx", _vars_hash (locals));
+
+      fprintf (out, VIEW_PREFIX "%s = Bungee._globals.view((", view_hash);
+      for (i = 0; i < locals->vars.count; i++)
+	fprintf (out, "'%s', ", locals->vars.names[i]);
+      fputs ("))\n", out);
+
+      /* open_memstream keeps the body NUL terminated. */
+      while ((pos = strstr (pos, VIEW_PREFIX VIEW_HASH_PLACEHOLDER)) != NULL)
+	{
+	  pos += sizeof (VIEW_PREFIX) - 1;
+	  memcpy (pos, view_hash, VIEW_HASH_LEN);
+	}
+    }
+
+  if (locals->fields)
+    fputs (FIELD_FUNC " = Bungee.fields.get\n", out);
+  if (locals->json)
+    fputs (JSON_FUNC " = Bungee.json.get\n", out);
+
+  if (fwrite (body, 1, body_len, out) != body_len)
+    return 1;
+
+  return 0;
+}
+
+/* Length of the $ symbol at condt (pointing at '$'), 0 if it is not one. */
+static size_t
+_var_len (const char *condt)
+{
+  size_t len = 1;
+
+  if (strchr ("$*@#0", condt[1]) && condt[1] != '\0')
+    return 2;
+
+  if (condt[1] >= '1' && condt[1] <= '9')
+    {
+      while (isdigit ((unsigned char) condt[len]))
+	len++;
+      return len;
+    }
+
+  if (condt[1] == '.')
+    {
+      if (!(isalpha ((unsigned char) condt[2]) || condt[2] == '_'))
+	return 0;
+      len = 2;
+    }
+  else if (!(isalpha ((unsigned char) condt[1]) || condt[1] == '_'))
+    return 0;
+
+  while (isalnum ((unsigned char) condt[len]) || condt[len] == '_')
+    len++;
+
+  return len;
+}
+
+/* Rule conditions are scanned raw, expand $ symbols here the same way the
+   scanner does in the rest of the script. Quoted text is left alone. */
+static void
+_print_condt (local_vars_t *locals, FILE *out, const char *condt)
+{
+  char quote = '\0';
+
+  while (*condt)
+    {
+      if (quote)
+	{
+	  if (*condt == '\\' && condt[1])
+	    fputc (*condt++, out);
+	  else if (*condt == quote)
+	    quote = '\0';
+	}
+      else if (*condt == '\'' || *condt == '\"')
+	{
+	  quote = *condt;
+	}
+      else if (*condt == '$')
+	{
+	  size_t len = _var_len (condt);
+	  if (len)
+	    {
+	      bng_print_var (locals, out, condt, len);
+	      condt += len;
+	      continue;
+	    }
+	}
+      fputc (*condt++, out);
+    }
+}
+
+/* Empty or literal True condition. Such rules are passed without a
+   condition, so the engine does not call in to Python to test them. */
+static int
+_condt_is_true (const char *condt)
+{
+  size_t len;
+
+  if (condt == NULL)
+    return 1;
+
+  while (isspace ((unsigned char) *condt))
+    condt++;
+  len = strlen (condt);
+  while (len && isspace ((unsigned char) condt[len - 1]))
+    len--;
+
+  return (len == 0) || (len == 4 && strncmp (condt, "True", 4) == 0);
+}
+
+/* Emit Rules.append(...) for a rule, followed by the header of its action
+   function. The rule body from the script becomes the action body. */
+static void
+_print_rule (local_vars_t *locals, FILE *out, const char *group, const char *rule, const char *condt)
+{
+  fprintf (out, "Rules.append('%s', '%s', ", group, rule);
+
+  if (_condt_is_true (condt))
+    fputs ("None", out);
+  else
+    {
+      fputs ("lambda: ", out);
+      _print_condt (locals, out, condt);
+    }
+
+  fprintf (out, ", '_action_%s_%s')\n", group, rule);
+  fprintf (out, "def _action_%s_%s():", group, rule);
+}
+
 int
 bng_compile (FILE *script_fp, const char *script_name, FILE *out_fp, FILE *err_fp)
 {
   int status;
   yyscan_t yyscanner; /* Re-entrant praser stores its state here. */
   local_vars_t locals;
+  char *body = NULL; /* Compiled script body, the view is prepended to it. */
+  size_t body_len = 0, i;
+  FILE *body_fp;
 
   locals.quote.slquote_type = locals.quote.mlquote_type='\0';
   locals.quote.sl_start = locals.quote.ml_start = 0;
   locals.found.begin = locals.found.input = locals.found.end = 0;
+  locals.found.beginfile = locals.found.endfile = 0;
+  locals.vars.names = NULL;
+  locals.vars.count = locals.vars.size = 0;
+  locals.fields = 0;
+  locals.json = 0;
   locals.err_fp = stderr;
   locals.script_name = script_name; /* Used by yyerror to relate error messages to script. */
 
-  if (yylex_init_extra (&locals, &yyscanner) != 0)
+  body_fp = open_memstream (&body, &body_len);
+  if (body_fp == NULL)
     return 1;
 
+  if (yylex_init_extra (&locals, &yyscanner) != 0)
+    {
+      fclose (body_fp);
+      free (body);
+      return 1;
+    }
+
   if (script_fp == NULL)
     yyset_in (stdin, yyscanner);
   else
     yyset_in (script_fp, yyscanner);
 
-  if (out_fp == NULL)
-    yyset_out (stdout, yyscanner);
-  else
-    yyset_out (out_fp, yyscanner);
+  yyset_out (body_fp, yyscanner);
 
   if (yyparse (yyscanner) == 0)
     status = 0;
@@ -212,6 +466,15 @@ bng_compile (FILE *script_fp, const char *script_name, FILE *out_fp, FILE *err_f
     status = 1;
 
   yylex_destroy (yyscanner);
+  fclose (body_fp);
+
+  if (status == 0)
+    status = _print_program (&locals, out_fp ? out_fp : stdout, body, body_len);
+
+  for (i = 0; i < locals.vars.count; i++)
+    free (locals.vars.names[i]);
+  free (locals.vars.names);
+  free (body);
 
   return status;
 }
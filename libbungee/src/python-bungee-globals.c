@@ -17,7 +17,6 @@ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
 See the License for the specific language governing permissions and
 limitations under the License.
 */
-
 /* Python.h should be the first header to include, even before system headers */
 #include <Python.h>
 #include <glib.h>
@@ -25,16 +24,563 @@ limitations under the License.
 #include "local-defs.h"
 #include "logger.h"
 
-/* hold a reference GLOBALS dictionary. All $variables will be stored in this dictionary. */
-static PyObject *_globals;
+/*
+  $variables live in fixed slots of a single Globals object, exposed to
+  scripts as Bungee._globals ($$). A name is assigned a slot the first time
+  any script refers to it and keeps it for the life of the process.
+
+  The compiler numbers the $ names of each script and emits
+
+    _bng_V<hash> = Bungee._globals.view(('0', 'name', ...))
+
+  followed by _bng_V<hash>[i] for every $name. A view maps the per-script
+  numbers to global slots, so a variable access is an integer subscript in
+  C instead of a module attribute lookup plus a dictionary lookup. The
+  hash is taken over the name list, scripts sharing a view name share the
+  same layout.
+
+  Globals also behaves like a read/write mapping from names to values, so
+  $$, $*, $@ and $# keep working.
+
+  +==========+      +=========+
+  | View     |      | Globals |
+  +==========+      +=========+
+  | map[0]   |----->| slot 0  | "0" (current record)
+  | map[1]   |--+   | slot 1  | "count"
+  +----------+  +-->| slot 2  | "name"
+                    |   ...   |
+*/
+#define GLOBALS_RECORD_SLOT 0 /* $0 always lives in slot 0 */
+
+typedef struct
+{
+  PyObject_HEAD
+  PyObject **slots;     /* Values by slot, NULL when unset. */
+  Py_ssize_t nslots;    /* Slots assigned so far. */
+  Py_ssize_t capacity;  /* Slots allocated. */
+  Py_ssize_t nset;      /* Slots holding a value. */
+  PyObject *index;      /* dict: name -> slot */
+  PyObject *names;      /* list: slot -> name */
+  PyObject *views;      /* dict: names tuple -> view */
+  PyObject *reducers;   /* dict: name -> reducer, see bungee_globals_set_reducer */
+} globals_t;
+
+typedef struct
+{
+  PyObject_HEAD
+  globals_t *globals;
+  Py_ssize_t *map;      /* Script local number -> slot */
+  Py_ssize_t len;
+} globals_view_t;
+
+static PyTypeObject GlobalsType;
+static PyTypeObject GlobalsViewType;
+
+/* hold a reference GLOBALS object. All $variables will be stored in this object. */
+static globals_t *_globals;
+
+/************* SLOT ROUTINES *************/
+
+/* Slot of name, assigned on first use. Returns -1 with an exception set
+   on error. */
+static Py_ssize_t
+globals_slot (globals_t *self, PyObject *name)
+{
+  PyObject *py_slot;
+
+  if (!PyUnicode_Check (name))
+    {
+      PyErr_Format (PyExc_TypeError, "variable name must be str, not %.200s",
+		    Py_TYPE (name)->tp_name);
+      return -1;
+    }
+
+  py_slot = PyDict_GetItemWithError (self->index, name);
+  if (py_slot)
+    return PyLong_AsSsize_t (py_slot);
+  if (PyErr_Occurred ())
+    return -1;
+
+  if (self->nslots == self->capacity)
+    {
+      Py_ssize_t capacity = self->capacity ? self->capacity * 2 : 64;
+      PyObject **slots = PyMem_Realloc (self->slots, capacity * sizeof (PyObject *));
+      if (slots == NULL)
+	{
+	  PyErr_NoMemory ();
+	  return -1;
+	}
+      memset (slots + self->capacity, 0, (capacity - self->capacity) * sizeof (PyObject *));
+      self->slots = slots;
+      self->capacity = capacity;
+    }
+
+  Py_INCREF (name);
+  PyUnicode_InternInPlace (&name);
+  py_slot = PyLong_FromSsize_t (self->nslots);
+  if (py_slot == NULL
+      || PyDict_SetItem (self->index, name, py_slot) != 0
+      || PyList_Append (self->names, name) != 0)
+    {
+      Py_XDECREF (py_slot);
+      Py_DECREF (name);
+      return -1;
+    }
+  Py_DECREF (py_slot);
+  Py_DECREF (name);
+
+  return self->nslots++;
+}
+
+static inline PyObject *
+globals_slot_get (globals_t *self, Py_ssize_t slot)
+{
+  PyObject *value = self->slots[slot];
+  if (value == NULL)
+    PyErr_SetObject (PyExc_KeyError, PyList_GET_ITEM (self->names, slot));
+  else
+    Py_INCREF (value);
+  return value;
+}
+
+/* Store value in slot, NULL value unsets it. */
+static inline gint
+globals_slot_set (globals_t *self, Py_ssize_t slot, PyObject *value)
+{
+  PyObject *old = self->slots[slot];
+
+  if (value == NULL && old == NULL)
+    {
+      PyErr_SetObject (PyExc_KeyError, PyList_GET_ITEM (self->names, slot));
+      return -1;
+    }
+
+  Py_XINCREF (value);
+  self->slots[slot] = value;
+  self->nset += (value != NULL) - (old != NULL);
+  Py_XDECREF (old);
+  return 0;
+}
+
+/************* GLOBALS TYPE *************/
+
+static Py_ssize_t
+globals_length (PyObject *self)
+{
+  return ((globals_t *) self)->nset;
+}
+
+static PyObject *
+globals_subscript (PyObject *self, PyObject *name)
+{
+  globals_t *_self = (globals_t *) self;
+  PyObject *py_slot = PyDict_GetItemWithError (_self->index, name);
+
+  if (py_slot == NULL)
+    {
+      if (!PyErr_Occurred ())
+	PyErr_SetObject (PyExc_KeyError, name);
+      return NULL;
+    }
+
+  return globals_slot_get (_self, PyLong_AsSsize_t (py_slot));
+}
+
+static gint
+globals_ass_subscript (PyObject *self, PyObject *name, PyObject *value)
+{
+  globals_t *_self = (globals_t *) self;
+  Py_ssize_t slot = globals_slot (_self, name);
+
+  if (slot < 0)
+    return -1;
+
+  return globals_slot_set (_self, slot, value);
+}
+
+static gint
+globals_contains (PyObject *self, PyObject *name)
+{
+  globals_t *_self = (globals_t *) self;
+  PyObject *py_slot = PyDict_GetItemWithError (_self->index, name);
+
+  if (py_slot == NULL)
+    return PyErr_Occurred () ? -1 : 0;
+
+  return _self->slots[PyLong_AsSsize_t (py_slot)] != NULL;
+}
+
+/* List of names (what == 0), values (what == 1) or (name, value) pairs
+   (what == 2) of all the variables holding a value. */
+static PyObject *
+globals_list (globals_t *self, gint what)
+{
+  Py_ssize_t slot;
+  PyObject *list = PyList_New (0);
+
+  if (list == NULL)
+    return NULL;
+
+  for (slot = 0; slot < self->nslots; slot++)
+    {
+      PyObject *item, *value = self->slots[slot];
+      if (value == NULL)
+	continue;
+
+      if (what == 0)
+	{
+	  item = PyList_GET_ITEM (self->names, slot);
+	  Py_INCREF (item);
+	}
+      else if (what == 1)
+	{
+	  item = value;
+	  Py_INCREF (item);
+	}
+      else
+	item = PyTuple_Pack (2, PyList_GET_ITEM (self->names, slot), value);
+
+      if (item == NULL || PyList_Append (list, item) != 0)
+	{
+	  Py_XDECREF (item);
+	  Py_DECREF (list);
+	  return NULL;
+	}
+      Py_DECREF (item);
+    }
+
+  return list;
+}
+
+static PyObject *
+globals_keys (PyObject *self, PyObject *unused)
+{
+  return globals_list ((globals_t *) self, 0);
+}
+
+static PyObject *
+globals_values (PyObject *self, PyObject *unused)
+{
+  return globals_list ((globals_t *) self, 1);
+}
+
+static PyObject *
+globals_items (PyObject *self, PyObject *unused)
+{
+  return globals_list ((globals_t *) self, 2);
+}
+
+static PyObject *
+globals_get (PyObject *self, PyObject *args)
+{
+  PyObject *name, *value, *dflt = Py_None;
+
+  if (!PyArg_ParseTuple (args, "O|O:get", &name, &dflt))
+    return NULL;
+
+  value = globals_subscript (self, name);
+  if (value == NULL && PyErr_ExceptionMatches (PyExc_KeyError))
+    {
+      PyErr_Clear ();
+      Py_INCREF (dflt);
+      return dflt;
+    }
+  return value;
+}
+
+/* Returns a view mapping the i'th name of names to its slot. Views are
+   cached per names tuple. */
+static PyObject *
+globals_view (PyObject *self, PyObject *names)
+{
+  globals_t *_self = (globals_t *) self;
+  globals_view_t *view;
+  Py_ssize_t i;
+
+  if (!PyTuple_CheckExact (names))
+    {
+      PyErr_SetString (PyExc_TypeError, "view() expects a tuple of names");
+      return NULL;
+    }
+
+  view = (globals_view_t *) PyDict_GetItemWithError (_self->views, names);
+  if (view)
+    {
+      Py_INCREF (view);
+      return (PyObject *) view;
+    }
+  if (PyErr_Occurred ())
+    return NULL;
+
+  view = PyObject_GC_New (globals_view_t, &GlobalsViewType);
+  if (view == NULL)
+    return NULL;
+
+  view->len = PyTuple_GET_SIZE (names);
+  view->map = PyMem_New (Py_ssize_t, view->len ? view->len : 1);
+  Py_INCREF (_self);
+  view->globals = _self;
+  PyObject_GC_Track (view);
+
+  if (view->map == NULL)
+    {
+      Py_DECREF (view);
+      return PyErr_NoMemory ();
+    }
+
+  for (i = 0; i < view->len; i++)
+    {
+      view->map[i] = globals_slot (_self, PyTuple_GET_ITEM (names, i));
+      if (view->map[i] < 0)
+	{
+	  Py_DECREF (view);
+	  return NULL;
+	}
+    }
+
+  if (PyDict_SetItem (_self->views, names, (PyObject *) view) != 0)
+    {
+      Py_DECREF (view);
+      return NULL;
+    }
+
+  return (PyObject *) view;
+}
+
+static PyObject *
+globals_iter (PyObject *self)
+{
+  PyObject *iter, *keys = globals_list ((globals_t *) self, 0);
+
+  if (keys == NULL)
+    return NULL;
+
+  iter = PyObject_GetIter (keys);
+  Py_DECREF (keys);
+  return iter;
+}
+
+static PyObject *
+globals_repr (PyObject *self)
+{
+  PyObject *repr, *dict, *items = globals_list ((globals_t *) self, 2);
+
+  if (items == NULL)
+    return NULL;
+
+  dict = PyDict_New ();
+  if (dict == NULL || PyDict_MergeFromSeq2 (dict, items, 1) != 0)
+    {
+      Py_XDECREF (dict);
+      Py_DECREF (items);
+      return NULL;
+    }
+  Py_DECREF (items);
+
+  repr = PyObject_Repr (dict);
+  Py_DECREF (dict);
+  return repr;
+}
+
+static gint
+globals_traverse (PyObject *self, visitproc visit, void *arg)
+{
+  globals_t *_self = (globals_t *) self;
+  Py_ssize_t slot;
+
+  for (slot = 0; slot < _self->nslots; slot++)
+    Py_VISIT (_self->slots[slot]);
+  Py_VISIT (_self->index);
+  Py_VISIT (_self->names);
+  Py_VISIT (_self->views);
+  Py_VISIT (_self->reducers);
+  return 0;
+}
+
+static gint
+globals_clear (PyObject *self)
+{
+  globals_t *_self = (globals_t *) self;
+  Py_ssize_t slot;
+
+  for (slot = 0; slot < _self->nslots; slot++)
+    Py_CLEAR (_self->slots[slot]);
+  _self->nset = 0;
+  Py_CLEAR (_self->views);
+  Py_CLEAR (_self->reducers);
+  return 0;
+}
+
+static void
+globals_dealloc (PyObject *self)
+{
+  globals_t *_self = (globals_t *) self;
+
+  PyObject_GC_UnTrack (self);
+  globals_clear (self);
+  Py_CLEAR (_self->index);
+  Py_CLEAR (_self->names);
+  PyMem_Free (_self->slots);
+  PyObject_GC_Del (self);
+}
+
+static PyMappingMethods globals_as_mapping = {
+  globals_length,
+  globals_subscript,
+  globals_ass_subscript
+};
+
+static PySequenceMethods globals_as_sequence = {
+  .sq_contains = globals_contains
+};
+
+static PyMethodDef globals_methods[] = {
+  {"keys", globals_keys, METH_NOARGS, N_("Names of all the variables.")},
+  {"values", globals_values, METH_NOARGS, N_("Values of all the variables.")},
+  {"items", globals_items, METH_NOARGS, N_("(name, value) pairs of all the variables.")},
+  {"get", globals_get, METH_VARARGS, N_("Value of a variable or default.")},
+  {"view", globals_view, METH_O, N_("Slot view over a tuple of names. Used by compiled scripts.")},
+  {NULL, NULL, 0, NULL}
+};
+
+static PyTypeObject GlobalsType = {
+  PyVarObject_HEAD_INIT (NULL, 0)
+  .tp_name = "Bungee.Globals",
+  .tp_basicsize = sizeof (globals_t),
+  .tp_dealloc = globals_dealloc,
+  .tp_repr = globals_repr,
+  .tp_as_sequence = &globals_as_sequence,
+  .tp_as_mapping = &globals_as_mapping,
+  .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
+  .tp_doc = N_("Bungee $variables"),
+  .tp_traverse = globals_traverse,
+  .tp_clear = globals_clear,
+  .tp_iter = globals_iter,
+  .tp_methods = globals_methods,
+};
+
+/************* GLOBALS VIEW TYPE *************/
+
+static Py_ssize_t
+view_length (PyObject *self)
+{
+  return ((globals_view_t *) self)->len;
+}
+
+/* Map a script local number to its slot. */
+static inline Py_ssize_t
+view_slot (globals_view_t *self, PyObject *key)
+{
+  Py_ssize_t i = PyLong_AsSsize_t (key);
+
+  if (i < 0 || i >= self->len)
+    {
+      if (!PyErr_Occurred ())
+	PyErr_SetString (PyExc_IndexError, "view index out of range");
+      return -1;
+    }
+
+  return self->map[i];
+}
+
+static PyObject *
+view_subscript (PyObject *self, PyObject *key)
+{
+  globals_view_t *_self = (globals_view_t *) self;
+  Py_ssize_t slot = view_slot (_self, key);
+
+  if (slot < 0)
+    return NULL;
+
+  return globals_slot_get (_self->globals, slot);
+}
+
+static gint
+view_ass_subscript (PyObject *self, PyObject *key, PyObject *value)
+{
+  globals_view_t *_self = (globals_view_t *) self;
+  Py_ssize_t slot = view_slot (_self, key);
+
+  if (slot < 0)
+    return -1;
+
+  return globals_slot_set (_self->globals, slot, value);
+}
+
+static gint
+view_traverse (PyObject *self, visitproc visit, void *arg)
+{
+  Py_VISIT (((globals_view_t *) self)->globals);
+  return 0;
+}
+
+static gint
+view_clear (PyObject *self)
+{
+  Py_CLEAR (((globals_view_t *) self)->globals);
+  return 0;
+}
+
+static void
+view_dealloc (PyObject *self)
+{
+  PyObject_GC_UnTrack (self);
+  view_clear (self);
+  PyMem_Free (((globals_view_t *) self)->map);
+  PyObject_GC_Del (self);
+}
+
+static PyMappingMethods view_as_mapping = {
+  view_length,
+  view_subscript,
+  view_ass_subscript
+};
+
+static PyTypeObject GlobalsViewType = {
+  PyVarObject_HEAD_INIT (NULL, 0)
+  .tp_name = "Bungee.GlobalsView",
+  .tp_basicsize = sizeof (globals_view_t),
+  .tp_dealloc = view_dealloc,
+  .tp_as_mapping = &view_as_mapping,
+  .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
+  .tp_doc = N_("Slot view over Bungee $variables"),
+  .tp_traverse = view_traverse,
+  .tp_clear = view_clear,
+};
+
+/************* INTERFACE *************/
 
 gint
 bungee_globals_init ()
 {
-  _globals = PyDict_New ();
-  if ((_globals == NULL) || !(PyDict_CheckExact (_globals)))
+  if (PyType_Ready (&GlobalsType) < 0 || PyType_Ready (&GlobalsViewType) < 0)
+    return (-1);
+
+  _globals = PyObject_GC_New (globals_t, &GlobalsType);
+  if (_globals == NULL)
     return (-1);
 
+  _globals->slots = NULL;
+  _globals->nslots = _globals->capacity = _globals->nset = 0;
+  _globals->index = PyDict_New ();
+  _globals->names = PyList_New (0);
+  _globals->views = PyDict_New ();
+  _globals->reducers = PyDict_New ();
+  PyObject_GC_Track (_globals);
+
+  if (!_globals->index || !_globals->names || !_globals->views || !_globals->reducers)
+    return (-1);
+
+  /* Reserve the first slot for the current record. */
+  PyObject *_record_name = PyUnicode_InternFromString ("0");
+  if (_record_name == NULL
+      || globals_slot (_globals, _record_name) != GLOBALS_RECORD_SLOT)
+    {
+      Py_XDECREF (_record_name);
+      return (-1);
+    }
+  Py_DECREF (_record_name);
+
   PyObject *mod_bungee; /* __main__ module */
 
   /* Barrowed reference to main module*/
@@ -45,15 +591,364 @@ bungee_globals_init ()
       return (1);
     }
 
-  /* Make our "_globals" dictionary available through BUNGEE module. */
-  PyObject_SetAttrString (mod_bungee, "_globals", _globals);
+  /* Make our "_globals" object available through BUNGEE module. */
+  PyObject_SetAttrString (mod_bungee, "_globals", (PyObject *) _globals);
 
   return (0);
 }
 
+/* Make record the current record, visible to scripts as $0. */
+gint
+bungee_globals_set_record (PyObject *record)
+{
+  return globals_slot_set (_globals, GLOBALS_RECORD_SLOT, record);
+}
+
+/* Current record ($0), borrowed reference or NULL when unset. */
+PyObject *
+bungee_globals_get_record (void)
+{
+  return _globals->slots[GLOBALS_RECORD_SLOT];
+}
+
+/* Every variable holding a value except $0, as a new dict. Used to ship a
+   worker's results to the coordinator. */
+PyObject *
+bungee_globals_state (void)
+{
+  Py_ssize_t slot;
+  PyObject *state = PyDict_New ();
+
+  if (state == NULL)
+    return NULL;
+
+  for (slot = 0; slot < _globals->nslots; slot++)
+    {
+      PyObject *value = _globals->slots[slot];
+      if (value == NULL || slot == GLOBALS_RECORD_SLOT)
+	continue;
+
+      if (PyDict_SetItem (state, PyList_GET_ITEM (_globals->names, slot), value) != 0)
+	{
+	  Py_DECREF (state);
+	  return NULL;
+	}
+    }
+
+  return state;
+}
+
+/************* REDUCERS *************/
+
+/*
+  Partial results of several processes are combined variable by variable.
+  A variable without a reducer takes the value of the last state merged.
+
+  Every process starts from the same base state (what BEGIN left behind),
+  so the base is counted once: sum, count and concat only fold in what a
+  state added on top of it. min, max and union are not affected by
+  repeating the base. Custom reducers get (merged, value) and must cope
+  with it themselves.
+*/
+typedef enum
+{
+  REDUCE_SUM,
+  REDUCE_MIN,
+  REDUCE_MAX,
+  REDUCE_COUNT,
+  REDUCE_UNION,
+  REDUCE_CONCAT
+} reduce_t;
+
+static const gchar *reduce_names[] = {
+  "sum", "min", "max", "count", "union", "concat", NULL
+};
+
+/* acc + (value - base) */
+static PyObject *
+reduce_sum (PyObject *acc, PyObject *value, PyObject *base)
+{
+  PyObject *delta, *result;
+
+  if (base == NULL)
+    return PyNumber_Add (acc, value);
+
+  delta = PyNumber_Subtract (value, base);
+  if (delta == NULL)
+    return NULL;
+
+  result = PyNumber_Add (acc, delta);
+  Py_DECREF (delta);
+  return result;
+}
+
+/* Counts per key, for dicts and collections.Counter. Plain numbers are
+   summed. */
+static PyObject *
+reduce_count (PyObject *acc, PyObject *value, PyObject *base)
+{
+  PyObject *result, *key, *n;
+  Py_ssize_t pos = 0;
+
+  if (!PyDict_Check (value))
+    return reduce_sum (acc, value, base);
+
+  if (!PyDict_Check (acc))
+    {
+      PyErr_Format (PyExc_TypeError, "count reducer cannot merge %.200s into %.200s",
+		    Py_TYPE (value)->tp_name, Py_TYPE (acc)->tp_name);
+      return NULL;
+    }
+
+  /* copy() keeps the type, a Counter stays a Counter. */
+  result = PyObject_CallMethod (acc, "copy", NULL);
+  if (result == NULL)
+    return NULL;
+
+  if (base && !PyDict_Check (base))
+    base = NULL;
+
+  while (PyDict_Next (value, &pos, &key, &n))
+    {
+      PyObject *old, *base_n = NULL, *sum;
+
+      old = PyDict_GetItemWithError (result, key);
+      if (old == NULL && PyErr_Occurred ())
+	goto ERROR;
+
+      if (base)
+	{
+	  base_n = PyDict_GetItemWithError (base, key);
+	  if (base_n == NULL && PyErr_Occurred ())
+	    goto ERROR;
+	}
+
+      if (old)
+	sum = base_n ? reduce_sum (old, n, base_n) : PyNumber_Add (old, n);
+      else if (base_n)
+	sum = PyNumber_Subtract (n, base_n);
+      else
+	{
+	  sum = n;
+	  Py_INCREF (sum);
+	}
+
+      if (sum == NULL || PyObject_SetItem (result, key, sum) != 0)
+	{
+	  Py_XDECREF (sum);
+	  goto ERROR;
+	}
+      Py_DECREF (sum);
+    }
+
+  return result;
+
+ ERROR:
+  Py_DECREF (result);
+  return NULL;
+}
+
+/* acc + value[len(base):] */
+static PyObject *
+reduce_concat (PyObject *acc, PyObject *value, PyObject *base)
+{
+  PyObject *tail, *result;
+  Py_ssize_t base_len = 0;
+
+  if (base)
+    {
+      base_len = PyObject_Length (base);
+      if (base_len < 0)
+	return NULL;
+    }
+
+  if (base_len == 0)
+    return PySequence_Concat (acc, value);
+
+  tail = PySequence_GetSlice (value, base_len, PY_SSIZE_T_MAX);
+  if (tail == NULL)
+    return NULL;
+
+  result = PySequence_Concat (acc, tail);
+  Py_DECREF (tail);
+  return result;
+}
+
+/* Combine acc, the merged value so far, with value of the next state.
+   base is the value both started from or NULL. Returns a new reference. */
+static PyObject *
+reduce_apply (PyObject *reducer, PyObject *acc, PyObject *value, PyObject *base)
+{
+  gint cmp;
+
+  if (!PyLong_Check (reducer))
+    return PyObject_CallFunctionObjArgs (reducer, acc, value, NULL);
+
+  switch ((reduce_t) PyLong_AsLong (reducer))
+    {
+    case REDUCE_SUM:
+      return reduce_sum (acc, value, base);
+    case REDUCE_COUNT:
+      return reduce_count (acc, value, base);
+    case REDUCE_CONCAT:
+      return reduce_concat (acc, value, base);
+    case REDUCE_UNION:
+      return PyNumber_Or (acc, value);
+    case REDUCE_MIN:
+    case REDUCE_MAX:
+      cmp = PyObject_RichCompareBool (value, acc,
+				      PyLong_AsLong (reducer) == REDUCE_MIN ? Py_LT : Py_GT);
+      if (cmp < 0)
+	return NULL;
+      value = cmp ? value : acc;
+      Py_INCREF (value);
+      return value;
+    }
+
+  PyErr_SetString (PyExc_SystemError, "unknown reducer");
+  return NULL;
+}
+
+/* Declare how name is merged: one of the reduce_names or a callable
+   taking (merged, value). None removes the reducer. */
+gint
+bungee_globals_set_reducer (PyObject *name, PyObject *how)
+{
+  PyObject *reducer = NULL;
+
+  if (!PyUnicode_Check (name))
+    {
+      PyErr_Format (PyExc_TypeError, "variable name must be str, not %.200s",
+		    Py_TYPE (name)->tp_name);
+      return -1;
+    }
+
+  if (how == Py_None)
+    {
+      if (PyDict_DelItem (_globals->reducers, name) != 0)
+	{
+	  if (!PyErr_ExceptionMatches (PyExc_KeyError))
+	    return -1;
+	  PyErr_Clear ();
+	}
+      return 0;
+    }
+
+  if (PyUnicode_Check (how))
+    {
+      const gchar *how_str = PyUnicode_AsUTF8 (how);
+      gint i;
+
+      if (how_str == NULL)
+	return -1;
+
+      for (i = 0; reduce_names[i]; i++)
+	{
+	  if (g_strcmp0 (how_str, reduce_names[i]) == 0)
+	    {
+	      reducer = PyLong_FromLong (i);
+	      break;
+	    }
+	}
+
+      if (reduce_names[i] == NULL)
+	{
+	  PyErr_Format (PyExc_ValueError,
+			"unknown reducer '%s', expected sum, min, max, count, union, concat or a callable",
+			how_str);
+	  return -1;
+	}
+      if (reducer == NULL)
+	return -1;
+    }
+  else if (PyCallable_Check (how))
+    {
+      reducer = how;
+      Py_INCREF (reducer);
+    }
+  else
+    {
+      PyErr_Format (PyExc_TypeError, "reducer must be str or callable, not %.200s",
+		    Py_TYPE (how)->tp_name);
+      return -1;
+    }
+
+  gint status = PyDict_SetItem (_globals->reducers, name, reducer);
+  Py_DECREF (reducer);
+  return status;
+}
+
+/* Whether a reducer is declared for the variable name. */
+gboolean
+bungee_globals_reduced (PyObject *name)
+{
+  return PyDict_GetItem (_globals->reducers, name) != NULL;
+}
+
+/* Fold a state produced by bungee_globals_state in another process into
+   the globals, using the reducers declared for each variable. base is
+   the state every process started from, or NULL. */
+gint
+bungee_globals_merge (PyObject *state, PyObject *base)
+{
+  PyObject *name, *value;
+  Py_ssize_t pos = 0;
+
+  if (!PyDict_Check (state))
+    {
+      PyErr_Format (PyExc_TypeError, "globals state must be dict, not %.200s",
+		    Py_TYPE (state)->tp_name);
+      return -1;
+    }
+
+  while (PyDict_Next (state, &pos, &name, &value))
+    {
+      PyObject *reducer, *acc, *base_value = NULL;
+      Py_ssize_t slot = globals_slot (_globals, name);
+      gint status;
+
+      if (slot < 0)
+	return -1;
+
+      reducer = PyDict_GetItemWithError (_globals->reducers, name);
+      if (reducer == NULL && PyErr_Occurred ())
+	return -1;
+
+      acc = _globals->slots[slot];
+      if (reducer == NULL || acc == NULL)
+	{
+	  if (globals_slot_set (_globals, slot, value) != 0)
+	    return -1;
+	  continue;
+	}
+
+      if (base)
+	{
+	  base_value = PyDict_GetItemWithError (base, name);
+	  if (base_value == NULL && PyErr_Occurred ())
+	    return -1;
+	}
+
+      value = reduce_apply (reducer, acc, value, base_value);
+      if (value == NULL)
+	{
+	  /* Name the variable, the reducer error alone is cryptic. */
+	  BNG_ERR (_("Unable to merge $%s"), PyUnicode_AsUTF8 (name));
+	  return -1;
+	}
+
+      status = globals_slot_set (_globals, slot, value);
+      Py_DECREF (value);
+      if (status != 0)
+	return -1;
+    }
+
+  return 0;
+}
+
 gint
 bungee_globals_fini ()
 {
-  Py_DECREF (_globals);
+  Py_CLEAR (_globals);
   return (0);
 }
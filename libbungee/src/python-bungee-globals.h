@@ -27,6 +27,14 @@ extern "C" {
 
 gint bungee_globals_init (void);
 gint bungee_globals_fini (void);
+gint bungee_globals_set_record (PyObject *record);
+PyObject *bungee_globals_get_record (void);
+
+/* Snapshot and merge of the globals, for parallel runs. */
+PyObject *bungee_globals_state (void);
+gint bungee_globals_merge (PyObject *state, PyObject *base);
+gint bungee_globals_set_reducer (PyObject *name, PyObject *how);
+gboolean bungee_globals_reduced (PyObject *name);
 
 #ifdef __cplusplus
 }
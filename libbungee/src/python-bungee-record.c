@@ -0,0 +1,550 @@
+/*
+python-bungee-record.c: Records backed by the input buffer
+
+This file is part of Bungee.
+
+Copyright 2012 Red Hat, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+/* Python.h should be the first header to include, even before system headers */
+#include <Python.h>
+#include <string.h>
+#include <glib.h>
+
+#include "local-defs.h"
+#include "logger.h"
+
+/*
+  Native input sources hand $0 to the rules as a Bungee.Record: the bytes
+  of the line, left where the source read them, instead of a str decoded
+  from a copy. ==, in, startswith and endswith against str run on the
+  UTF-8 bytes, re with bytes patterns and Bungee.fuzzy read them through
+  the buffer protocol. Anything else a str can do is done by the str the
+  record decodes to on first use, with undecodable bytes kept as
+  surrogate escapes like before. Scripts that need a real str, for
+  isinstance() or json.loads(), call str($0).
+
+  A source keeps a record valid until the call after the next one, the
+  engine releases a record right after the rules saw the one following
+  it. A record something still refers to at that point (a list, a $var,
+  a re match) is copied before the source reuses its bytes. Records the
+  rules only looked at never are.
+*/
+
+typedef struct
+{
+  PyObject_HEAD
+  const gchar *data;   /* Bytes of the record, not NUL terminated */
+  Py_ssize_t len;
+  gchar *copy;         /* Own copy of data once detached from the input */
+  PyObject *text;      /* Decoded str, made on first use */
+  Py_ssize_t exports;  /* Buffers handed out and not yet released */
+} record_t;
+
+static PyTypeObject RecordType;
+
+#define record_check(o) (Py_TYPE (o) == &RecordType)
+
+/* The str of a record, borrowed reference. */
+static PyObject *
+record_text (record_t *self)
+{
+  if (self->text == NULL)
+    self->text = PyUnicode_DecodeUTF8 (self->data, self->len, "surrogateescape");
+  return self->text;
+}
+
+/* UTF-8 bytes of a record or a str. Returns FALSE when other has none,
+   str holding surrogates included, without an exception set. */
+static gboolean
+record_bytes_of (PyObject *other, const gchar **data, Py_ssize_t *len)
+{
+  if (record_check (other))
+    {
+      *data = ((record_t *) other)->data;
+      *len = ((record_t *) other)->len;
+      return TRUE;
+    }
+
+  if (!PyUnicode_Check (other))
+    return FALSE;
+
+  *data = PyUnicode_AsUTF8AndSize (other, len);
+  if (*data == NULL)
+    {
+      PyErr_Clear ();
+      return FALSE;
+    }
+  return TRUE;
+}
+
+/* other as a str, records decode, anything else is returned as is. New
+   reference. */
+static PyObject *
+record_as_text (PyObject *other)
+{
+  if (record_check (other))
+    other = record_text ((record_t *) other);
+  Py_XINCREF (other);
+  return other;
+}
+
+/* Valid UTF-8 never matches starting or ending inside a character, so
+   byte matches are character matches, surrogate escapes included. */
+static gboolean
+record_has_at (record_t *self, const gchar *data, Py_ssize_t len, gboolean at_end)
+{
+  if (len > self->len)
+    return FALSE;
+  return memcmp (self->data + (at_end ? self->len - len : 0), data, len) == 0;
+}
+
+static gint
+record_detach (record_t *self)
+{
+  self->copy = PyMem_Malloc (self->len ? self->len : 1);
+  if (self->copy == NULL)
+    {
+      PyErr_NoMemory ();
+      return -1;
+    }
+
+  memcpy (self->copy, self->data, self->len);
+  self->data = self->copy;
+  return 0;
+}
+
+/************* RECORD METHODS *************/
+
+static void
+record_dealloc (PyObject *self)
+{
+  record_t *_self = (record_t *) self;
+
+  Py_XDECREF (_self->text);
+  PyMem_Free (_self->copy);
+  PyObject_Del (self);
+}
+
+static PyObject *
+record_str (PyObject *self)
+{
+  PyObject *text = record_text ((record_t *) self);
+
+  Py_XINCREF (text);
+  return text;
+}
+
+static PyObject *
+record_repr (PyObject *self)
+{
+  PyObject *text = record_text ((record_t *) self);
+
+  return text ? PyObject_Repr (text) : NULL;
+}
+
+/* Equal to the str it decodes to, so records and str mix as dict keys. */
+static Py_hash_t
+record_hash (PyObject *self)
+{
+  PyObject *text = record_text ((record_t *) self);
+
+  return text ? PyObject_Hash (text) : -1;
+}
+
+static PyObject *
+record_richcompare (PyObject *self, PyObject *other, gint op)
+{
+  record_t *_self = (record_t *) self;
+  PyObject *text, *result;
+  const gchar *data;
+  Py_ssize_t len;
+
+  if (op == Py_EQ || op == Py_NE)
+    {
+      if (record_bytes_of (other, &data, &len))
+	{
+	  gboolean equal = len == _self->len && memcmp (_self->data, data, len) == 0;
+	  return PyBool_FromLong (equal == (op == Py_EQ));
+	}
+      if (!PyUnicode_Check (other))
+	Py_RETURN_NOTIMPLEMENTED;
+    }
+
+  /* Orderings, and str with surrogates. */
+  text = record_text (_self);
+  if (text == NULL || (other = record_as_text (other)) == NULL)
+    return NULL;
+  result = PyObject_RichCompare (text, other, op);
+  Py_DECREF (other);
+  return result;
+}
+
+static gint
+record_contains (PyObject *self, PyObject *item)
+{
+  record_t *_self = (record_t *) self;
+  PyObject *text;
+  const gchar *data;
+  Py_ssize_t len;
+
+  if (record_bytes_of (item, &data, &len))
+    return len == 0 || memmem (_self->data, _self->len, data, len) != NULL;
+
+  /* Same result, or TypeError, as for the str. */
+  text = record_text (_self);
+  return text ? PySequence_Contains (text, item) : -1;
+}
+
+static Py_ssize_t
+record_length (PyObject *self)
+{
+  PyObject *text = record_text ((record_t *) self);
+
+  return text ? PyObject_Length (text) : -1;
+}
+
+static PyObject *
+record_subscript (PyObject *self, PyObject *key)
+{
+  PyObject *text = record_text ((record_t *) self);
+
+  return text ? PyObject_GetItem (text, key) : NULL;
+}
+
+static PyObject *
+record_iter (PyObject *self)
+{
+  PyObject *text = record_text ((record_t *) self);
+
+  return text ? PyObject_GetIter (text) : NULL;
+}
+
+/* $0 + "..." and "..." + $0 */
+static PyObject *
+record_add (PyObject *a, PyObject *b)
+{
+  PyObject *result = Py_NotImplemented;
+
+  a = record_as_text (a);
+  b = record_as_text (b);
+  if (a && b && PyUnicode_Check (a) && PyUnicode_Check (b))
+    result = PyUnicode_Concat (a, b);
+  else if (a && b)
+    Py_INCREF (result);
+  else
+    result = NULL;
+
+  Py_XDECREF (a);
+  Py_XDECREF (b);
+  return result;
+}
+
+static PyObject *
+record_int (PyObject *self)
+{
+  PyObject *text = record_text ((record_t *) self);
+
+  return text ? PyLong_FromUnicodeObject (text, 10) : NULL;
+}
+
+static PyObject *
+record_float (PyObject *self)
+{
+  PyObject *text = record_text ((record_t *) self);
+
+  return text ? PyFloat_FromString (text) : NULL;
+}
+
+/* Attributes a record does not have are looked up on its str, so
+   $0.split(), $0.lower() and the rest keep working. */
+static PyObject *
+record_getattro (PyObject *self, PyObject *name)
+{
+  PyObject *attr = PyObject_GenericGetAttr (self, name), *text;
+
+  if (attr || !PyErr_ExceptionMatches (PyExc_AttributeError))
+    return attr;
+
+  PyErr_Clear ();
+  text = record_text ((record_t *) self);
+  return text ? PyObject_GetAttr (text, name) : NULL;
+}
+
+static gint
+record_getbuffer (PyObject *self, Py_buffer *view, gint flags)
+{
+  record_t *_self = (record_t *) self;
+
+  if (PyBuffer_FillInfo (view, self, (void *) _self->data, _self->len, 1, flags) != 0)
+    return -1;
+  _self->exports++;
+  return 0;
+}
+
+static void
+record_releasebuffer (PyObject *self, Py_buffer *view)
+{
+  ((record_t *) self)->exports--;
+}
+
+/* startswith() and endswith(). A prefix, or a tuple of them, without
+   start and end is matched on the bytes. */
+static PyObject *
+record_affix (PyObject *self, PyObject *args, const gchar *method, gboolean at_end)
+{
+  record_t *_self = (record_t *) self;
+  PyObject *affix, *text, *func, *result;
+  const gchar *data;
+  Py_ssize_t len, i;
+
+  if (PyTuple_GET_SIZE (args) == 1)
+    {
+      affix = PyTuple_GET_ITEM (args, 0);
+      if (record_bytes_of (affix, &data, &len))
+	return PyBool_FromLong (record_has_at (_self, data, len, at_end));
+
+      if (PyTuple_Check (affix))
+	{
+	  for (i = 0; i < PyTuple_GET_SIZE (affix); i++)
+	    {
+	      if (!record_bytes_of (PyTuple_GET_ITEM (affix, i), &data, &len))
+		break;
+	      if (record_has_at (_self, data, len, at_end))
+		Py_RETURN_TRUE;
+	    }
+	  if (i == PyTuple_GET_SIZE (affix))
+	    Py_RETURN_FALSE;
+	}
+    }
+
+  text = record_text (_self);
+  if (text == NULL || (func = PyObject_GetAttrString (text, method)) == NULL)
+    return NULL;
+  result = PyObject_Call (func, args, NULL);
+  Py_DECREF (func);
+  return result;
+}
+
+static PyObject *
+record_startswith (PyObject *self, PyObject *args)
+{
+  return record_affix (self, args, "startswith", FALSE);
+}
+
+static PyObject *
+record_endswith (PyObject *self, PyObject *args)
+{
+  return record_affix (self, args, "endswith", TRUE);
+}
+
+static PyObject *
+record_format (PyObject *self, PyObject *spec)
+{
+  PyObject *text = record_text ((record_t *) self);
+
+  return text ? PyObject_Format (text, spec) : NULL;
+}
+
+/* Records travel, pickled or copied, as the str they decode to. */
+static PyObject *
+record_reduce (PyObject *self, PyObject *args)
+{
+  PyObject *text = record_text ((record_t *) self);
+
+  return text ? Py_BuildValue ("(O(O))", &PyUnicode_Type, text) : NULL;
+}
+
+static PyNumberMethods record_as_number = {
+  .nb_add = record_add,
+  .nb_int = record_int,
+  .nb_float = record_float,
+};
+
+static PySequenceMethods record_as_sequence = {
+  .sq_contains = record_contains
+};
+
+static PyMappingMethods record_as_mapping = {
+  record_length,
+  record_subscript,
+  NULL
+};
+
+static PyBufferProcs record_as_buffer = {
+  record_getbuffer,
+  record_releasebuffer
+};
+
+static PyMethodDef record_methods[] = {
+  {"startswith", record_startswith, METH_VARARGS, N_("Like str.startswith().")},
+  {"endswith", record_endswith, METH_VARARGS, N_("Like str.endswith().")},
+  {"__format__", record_format, METH_O, N_("Like str.__format__().")},
+  {"__reduce__", record_reduce, METH_NOARGS, N_("Pickle as str.")},
+  {NULL, NULL, 0, NULL}
+};
+
+static PyTypeObject RecordType = {
+  PyVarObject_HEAD_INIT (NULL, 0)
+  .tp_name = "Bungee.Record",
+  .tp_basicsize = sizeof (record_t),
+  .tp_dealloc = record_dealloc,
+  .tp_repr = record_repr,
+  .tp_as_number = &record_as_number,
+  .tp_as_sequence = &record_as_sequence,
+  .tp_as_mapping = &record_as_mapping,
+  .tp_hash = record_hash,
+  .tp_str = record_str,
+  .tp_getattro = record_getattro,
+  .tp_as_buffer = &record_as_buffer,
+  .tp_flags = Py_TPFLAGS_DEFAULT,
+  .tp_doc = N_("Record read by a native input source"),
+  .tp_richcompare = record_richcompare,
+  .tp_iter = record_iter,
+  .tp_methods = record_methods,
+};
+
+/************* INTERFACE *************/
+
+/* A record over len bytes at data, which the caller keeps valid until
+   bungee_record_release. */
+PyObject *
+bungee_record_new (const gchar *data, gsize len)
+{
+  record_t *self = PyObject_New (record_t, &RecordType);
+
+  if (self == NULL)
+    return NULL;
+
+  self->data = data;
+  self->len = len;
+  self->copy = NULL;
+  self->text = NULL;
+  self->exports = 0;
+  return (PyObject *) self;
+}
+
+gboolean
+bungee_record_check (PyObject *obj)
+{
+  return record_check (obj);
+}
+
+/* Bytes of a record. They move once when the record is released while
+   still in use, fetch them again rather than keeping the pointer. */
+const gchar *
+bungee_record_data (PyObject *record, gsize *len)
+{
+  *len = ((record_t *) record)->len;
+  return ((record_t *) record)->data;
+}
+
+/* UTF-8 bytes of $0 as the C scanners of its contents read it: record
+   is NULL, a Record, a str or bytes. A str holding surrogate escapes is
+   encoded back to its bytes in *owner, to be kept while they are in use,
+   *owner is NULL otherwise. Other types raise TypeError, with what the
+   caller was after in the message. */
+const gchar *
+bungee_record_utf8 (PyObject *record, gsize *len, PyObject **owner, const gchar *what)
+{
+  const gchar *data;
+  Py_ssize_t size;
+
+  *owner = NULL;
+
+  if (record == NULL)
+    {
+      *len = 0;
+      return "";
+    }
+
+  if (record_check (record))
+    return bungee_record_data (record, len);
+
+  if (PyUnicode_Check (record))
+    {
+      data = PyUnicode_AsUTF8AndSize (record, &size);
+      if (data == NULL)
+	{
+	  /* Undecodable input bytes, kept as surrogate escapes. */
+	  PyErr_Clear ();
+	  *owner = PyUnicode_AsEncodedString (record, "utf-8", "surrogateescape");
+	  if (*owner == NULL)
+	    return NULL;
+	  data = PyBytes_AS_STRING (*owner);
+	  size = PyBytes_GET_SIZE (*owner);
+	}
+      *len = size;
+      return data;
+    }
+
+  if (PyBytes_Check (record))
+    {
+      *len = PyBytes_GET_SIZE (record);
+      return PyBytes_AS_STRING (record);
+    }
+
+  PyErr_Format (PyExc_TypeError, "%s of a %.100s record", what, Py_TYPE (record)->tp_name);
+  return NULL;
+}
+
+/* str of a record, borrowed reference. */
+PyObject *
+bungee_record_text (PyObject *record)
+{
+  return record_text ((record_t *) record);
+}
+
+/* Drop the reference of bungee_record_new. The input is about to reuse
+   the bytes under the record: if anything else still refers to it, it
+   takes a copy of them first. */
+gint
+bungee_record_release (PyObject *record)
+{
+  record_t *self = (record_t *) record;
+  gint status = 0;
+
+  if (Py_REFCNT (record) > 1 && self->copy == NULL)
+    {
+      /* A memoryview would keep pointing at the input. */
+      if (self->exports > 0)
+	{
+	  PyErr_SetString (PyExc_BufferError, "memoryview of $0 kept past its record");
+	  status = -1;
+	}
+      else
+	status = record_detach (self);
+    }
+
+  Py_DECREF (record);
+  return status;
+}
+
+/* Make the Bungee.Record type available to scripts, for isinstance(). */
+gint
+bungee_record_init (PyObject *mod_bungee)
+{
+  if (PyType_Ready (&RecordType) < 0)
+    return (-1);
+
+  Py_INCREF (&RecordType);
+  if (PyModule_AddObject (mod_bungee, "Record", (PyObject *) &RecordType) != 0)
+    {
+      Py_DECREF (&RecordType);
+      return (-1);
+    }
+
+  return (0);
+}
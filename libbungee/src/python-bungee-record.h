@@ -0,0 +1,41 @@
+/*
+python-bungee-record.h: Records backed by the input buffer
+
+This file is part of Bungee.
+
+Copyright 2012 Red Hat, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef _PYTHON_BUNGEE_RECORD_H
+#define _PYTHON_BUNGEE_RECORD_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+gint bungee_record_init (PyObject *mod_bungee);
+PyObject *bungee_record_new (const gchar *data, gsize len);
+gint bungee_record_release (PyObject *record);
+gboolean bungee_record_check (PyObject *obj);
+const gchar *bungee_record_data (PyObject *record, gsize *len);
+const gchar *bungee_record_utf8 (PyObject *record, gsize *len, PyObject **owner,
+				const gchar *what);
+PyObject *bungee_record_text (PyObject *record);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _PYTHON_BUNGEE_RECORD_H */
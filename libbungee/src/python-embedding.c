@@ -27,25 +27,30 @@ limitations under the License.
 #include "python-module-bungee.h"
 #include "python-module-rules.h"
 #include "python-embedding.h"
+#include "libbungee.h"
 
 /*
-  Invokes a python procedure and returns its value. Caller assumes the
-  responsibility of freeing the return value with Py_XDECREF or Py_DECREF.
+  Hook registry. Callables looked up from __main__ are cached here with a
+  strong reference, so that the engine does not repeat the module and
+  dictionary lookups for every record. Hooks which are not declared (or not
+  callable) are cached as Py_None. The registry is flushed whenever new code
+  is executed in to __main__ (see bng_py_hooks_invalidate).
  */
-PyObject *
-bng_py_hook_call (const gchar *hook_name, char *format, ...)
+static GHashTable *hook_table;
+static PyObject *hook_main_dict; /* __main__ dictionary the hooks were resolved from */
+
+/* Destroy function for hooks stored in hook_table */
+static void
+hook_destroy (gpointer py_hook)
 {
-  if (hook_name == NULL)
-    {
-      errno = EINVAL;
-      BNG_DBG (_(PACKAGE" main module is not initialized"));
-      return (NULL);
-    }
+  Py_XDECREF ((PyObject *) py_hook);
+}
 
-  PyObject *py_hook, *py_result;
-  va_list args;
+/* Borrowed reference to __main__ module's dictionary. */
+static PyObject *
+hook_get_main_dict (void)
+{
   PyObject *_mod_main; /* __main__ module */
-  PyObject *_main_dict;
 
   /* Barrowed reference to main module*/
   _mod_main = PyImport_AddModule ("__main__");
@@ -56,34 +61,141 @@ bng_py_hook_call (const gchar *hook_name, char *format, ...)
     }
 
   /* Borrowed reference to main dict */
-  _main_dict = PyModule_GetDict (_mod_main);
+  return PyModule_GetDict (_mod_main);
+}
+
+/* Looks up hook_name in __main__. Returns a new reference to the callable
+   or to Py_None if it is not declared. */
+static PyObject *
+hook_lookup (const gchar *hook_name)
+{
+  PyObject *py_hook;
+
+  if (hook_main_dict == NULL)
+    Py_RETURN_NONE;
 
   /* Borrowed reference to "hook_name" from the global dictionary */
-  py_hook = PyDict_GetItemString (_main_dict, hook_name);
+  py_hook = PyDict_GetItemString (hook_main_dict, hook_name);
 
   if (py_hook == NULL)
     {
       BNG_DBG (_("[%s] hook function is not declared"), hook_name);
-      return (NULL);
+      Py_RETURN_NONE;
     }
 
   if (PyCallable_Check (py_hook) == 0)
     {
       BNG_WARN (_("[%s] hook function is not callable"), hook_name);
+      Py_RETURN_NONE;
+    }
+
+  Py_INCREF (py_hook);
+  return (py_hook);
+}
+
+/* Drop all the cached hooks. Must be called every time __main__ is
+   rebound or new definitions are executed in to it. */
+void
+bng_py_hooks_invalidate (void)
+{
+  if (hook_table)
+    g_hash_table_remove_all (hook_table);
+
+  Py_CLEAR (hook_main_dict);
+}
+
+/* Resolve BEGIN, INPUT, END and the per file hooks in to the registry. Cheap no-op if
+   they are already resolved from the current __main__. */
+gint
+bng_py_hooks_resolve (void)
+{
+  PyObject *_main_dict = hook_get_main_dict ();
+  if (_main_dict == NULL)
+    return (-1);
+
+  /* __main__ was rebound behind our back. */
+  if (_main_dict != hook_main_dict)
+    {
+      bng_py_hooks_invalidate ();
+      Py_INCREF (_main_dict);
+      hook_main_dict = _main_dict;
+    }
+
+  bng_py_hook_get (BNG_HOOK_BEGIN);
+  bng_py_hook_get (BNG_HOOK_INPUT);
+  bng_py_hook_get (BNG_HOOK_END);
+  bng_py_hook_get (BNG_HOOK_BEGINFILE);
+  bng_py_hook_get (BNG_HOOK_ENDFILE);
+
+  return (0);
+}
+
+/*
+  Returns a borrowed reference to the callable registered under hook_name in
+  __main__, or NULL if it is not declared. Only the first call after
+  bng_py_hooks_invalidate looks in to __main__. Callers in hot loops should
+  hold on to the returned callable instead of calling this per record.
+ */
+PyObject *
+bng_py_hook_get (const gchar *hook_name)
+{
+  PyObject *py_hook;
+
+  if (hook_table == NULL || hook_name == NULL)
+    return (NULL);
+
+  py_hook = g_hash_table_lookup (hook_table, hook_name);
+  if (py_hook == NULL)
+    {
+      if (hook_main_dict == NULL && bng_py_hooks_resolve () != 0)
+	return (NULL);
+
+      py_hook = hook_lookup (hook_name);
+      g_hash_table_insert (hook_table, g_strdup (hook_name), py_hook);
+    }
+
+  return (py_hook == Py_None) ? NULL : py_hook;
+}
+
+/*
+  Invokes a python procedure and returns its value. Caller assumes the
+  responsibility of freeing the return value with Py_XDECREF or Py_DECREF.
+ */
+PyObject *
+bng_py_hook_call (const gchar *hook_name, char *format, ...)
+{
+  if (hook_name == NULL)
+    {
+      errno = EINVAL;
+      BNG_DBG (_(PACKAGE" main module is not initialized"));
       return (NULL);
     }
 
+  PyObject *py_hook, *py_args, *py_result;
+  va_list args;
+
+  py_hook = bng_py_hook_get (hook_name);
+  if (py_hook == NULL)
+    return (NULL);
+
   if (format && *format)
     {
       va_start (args, format);
-      py_result = PyObject_CallFunction (py_hook, format, args, NULL);
+      py_args = Py_VaBuildValue (format, args);
       va_end (args);
+      if (py_args == NULL)
+	return (NULL);
+
+      if (PyTuple_Check (py_args))
+	py_result = PyObject_CallObject (py_hook, py_args);
+      else
+	py_result = PyObject_CallOneArg (py_hook, py_args);
+      Py_DECREF (py_args);
       return (py_result);
     }
   else
     {
-      py_result = PyObject_CallFunction (py_hook, NULL);
-      return (py_result);
+      return bng_py_call_noargs (py_hook);
     }
 }
 
@@ -104,6 +216,8 @@ bng_py_init (void)
 
   Py_Initialize ();
 
+  hook_table = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, hook_destroy);
+
   if (mod_bungee_init () != 0)
     {
       BNG_ERR (_("Unable to initialize Bungee module."));
@@ -122,6 +236,13 @@ bng_py_init (void)
 gint
 bng_py_fini (void)
 {
+  bng_py_hooks_invalidate ();
+  if (hook_table)
+    {
+      g_hash_table_destroy (hook_table);
+      hook_table = NULL;
+    }
+
   if (mod_bungee_fini () != 0)
     {
       BNG_WARN (_("Unable to uninitialize Bungee module"));
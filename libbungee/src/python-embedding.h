@@ -25,7 +25,19 @@ limitations under the License.
 extern "C" {
 #endif
 
+/* Call a Python callable without arguments through the vectorcall fast
+   path when the interpreter supports it. */
+#if PY_VERSION_HEX >= 0x03090000
+#define bng_py_call_noargs(callable) PyObject_CallNoArgs (callable)
+#else
+#define bng_py_call_noargs(callable) PyObject_CallObject (callable, NULL)
+#define PyObject_CallOneArg(callable, arg) PyObject_CallFunctionObjArgs (callable, arg, NULL)
+#endif
+
+PyObject *bng_py_hook_get (const gchar *hook_name);
 PyObject *bng_py_hook_call (const gchar *hook_name, char *format, ...);
+gint bng_py_hooks_resolve (void);
+void bng_py_hooks_invalidate (void);
 gint bng_py_init (void);
 gint bng_py_fini (void);
 
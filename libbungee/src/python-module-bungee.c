@@ -25,15 +25,30 @@ limitations under the License.
 #include "local-defs.h"
 #include "logger.h"
 #include "python-bungee-globals.h"
+#include "python-bungee-record.h"
+#include "python-module-input.h"
+#include "python-module-fuzzy.h"
+#include "python-module-fields.h"
+#include "python-module-json.h"
+#include "libbungee.h"
 
 static PyObject *mod_bungee; /* hold a reference Bungee module imported by mod_bungee_init */
 
 /************* Bungee Primitives ***************/
 static PyObject* emb_bng_version (PyObject *self, PyObject *args);
+static PyObject* emb_bng_batch (PyObject *self, PyObject *args);
+static PyObject* emb_bng_reduce (PyObject *self, PyObject *args);
+static PyObject* emb_bng_msg (PyObject *self, PyObject *args);
 
 static PyMethodDef BungeeMethods[] = {
   {"version", emb_bng_version, METH_VARARGS,
    N_("Get Bungee version string.")},
+  {"batch", emb_bng_batch, METH_VARARGS,
+   N_("Get or set the number of records INPUT hands over per call.")},
+  {"reduce", emb_bng_reduce, METH_VARARGS,
+   N_("Declare how a $variable is merged across parallel workers.")},
+  {"msg", emb_bng_msg, METH_VARARGS,
+   N_("Send a line to the --output targets.")},
   {NULL, NULL, 0, NULL}
 };
 
@@ -50,6 +65,101 @@ emb_bng_version (PyObject *self, PyObject *args)
   return PyUnicode_FromString (VERSION);
 }
 
+/*
+  # Bungee.batch([size])
+
+  Takes an optional batch size. A non-zero size opts in to batched INPUT:
+  INPUT may then return a list, an iterator or be a generator of records.
+  Zero restores the one record per call protocol. Returns the batch size
+  in effect.
+ */
+static PyObject*
+emb_bng_batch (PyObject *self, PyObject *args)
+{
+  gint size = -1;
+
+  if(!PyArg_ParseTuple(args, "|i:batch", &size))
+    {
+      BNG_DBG (_("Error parsing Bungee.batch() tuple"));
+      return NULL;
+    }
+
+  if (PyTuple_GET_SIZE (args) > 0)
+    {
+      if (size < 0)
+	{
+	  PyErr_SetString (PyExc_ValueError, "batch size must not be negative");
+	  return NULL;
+	}
+      bng_engine_set_batch (size);
+    }
+
+  return PyLong_FromLong (bng_engine_get_batch ());
+}
+
+/*
+  # Bungee.reduce(name, how)
+
+  Declares how the $variable name is merged when the partial results of
+  parallel workers are combined before END. how is one of "sum", "min",
+  "max", "count" (numbers, or counts per key in a dict or Counter),
+  "union" (sets), "concat" (lists) or a callable taking (merged, value)
+  and returning the merged value. None removes the reducer. Variables
+  without a reducer keep the value of the last worker.
+ */
+static PyObject*
+emb_bng_reduce (PyObject *self, PyObject *args)
+{
+  PyObject *name, *how;
+
+  if(!PyArg_ParseTuple(args, "UO:reduce", &name, &how))
+    {
+      BNG_DBG (_("Error parsing Bungee.reduce() tuple"));
+      return NULL;
+    }
+
+  if (bungee_globals_set_reducer (name, how) != 0)
+    return NULL;
+
+  Py_RETURN_NONE;
+}
+
+/*
+  # Bungee.msg(value)
+
+  Sends str(value) as one line to the --output targets. Unlike print()
+  it goes through the logger, so lines of parallel workers stay whole
+  and reach a unix: or tcp: collector.
+ */
+static PyObject*
+emb_bng_msg (PyObject *self, PyObject *args)
+{
+  PyObject *value, *str;
+  const gchar *text;
+
+  if(!PyArg_ParseTuple(args, "O:msg", &value))
+    {
+      BNG_DBG (_("Error parsing Bungee.msg() tuple"));
+      return NULL;
+    }
+
+  str = PyObject_Str (value);
+  if (str == NULL)
+    return NULL;
+
+  text = PyUnicode_AsUTF8 (str);
+  if (text == NULL)
+    {
+      Py_DECREF (str);
+      return NULL;
+    }
+
+  BNG_MSG ("%s", text);
+  Py_DECREF (str);
+
+  Py_RETURN_NONE;
+}
+
 /****************************************/
 /* >>>> Insert new primitives here <<<< */
 /****************************************/
@@ -120,12 +230,46 @@ mod_bungee_init ()
       return (-1);
     }
 
+  if (bungee_record_init (mod_bungee) != 0)
+    {
+      BNG_DBG (_("Unable to initialize Bungee.Record type."));
+      return (-1);
+    }
+
+  if (mod_input_init (mod_bungee) != 0)
+    {
+      BNG_DBG (_("Unable to initialize Bungee.input module."));
+      return (-1);
+    }
+
+  if (mod_fuzzy_init (mod_bungee) != 0)
+    {
+      BNG_DBG (_("Unable to initialize Bungee.fuzzy module."));
+      return (-1);
+    }
+
+  if (mod_fields_init (mod_bungee) != 0)
+    {
+      BNG_DBG (_("Unable to initialize Bungee.fields module."));
+      return (-1);
+    }
+
+  if (mod_json_init (mod_bungee) != 0)
+    {
+      BNG_DBG (_("Unable to initialize Bungee.json module."));
+      return (-1);
+    }
+
   return (0);
 }
 
 gint
 mod_bungee_fini ()
 {
+  mod_input_fini ();
+  mod_fuzzy_fini ();
+  mod_fields_fini ();
+  mod_json_fini ();
   Py_DECREF (mod_bungee);
 
   if (bungee_globals_fini () != 0)
@@ -0,0 +1,345 @@
+/*
+python-module-fields.c: Bungee.fields module
+
+This file is part of Bungee.
+
+Copyright 2012 Red Hat, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+/*
+  $1, $2 ... and $NF in scripts compile to Bungee.fields.get(n). Nothing
+  happens per record until a rule asks for a field: the first get() after
+  $0 changed splits it, and every field becomes a Python object only when
+  asked for, once per record.
+*/
+
+/* Python.h should be the first header to include, even before system headers */
+#include <Python.h>
+#include <glib.h>
+
+#include "local-defs.h"
+#include "logger.h"
+#include "python-bungee-globals.h"
+#include "python-bungee-record.h"
+#include "fields.h"
+
+static PyObject *mod_fields; /* hold a reference Bungee.fields module created by mod_fields_init */
+
+static bng_fields_sep_t *fields_sep; /* NULL splits on blanks */
+static PyObject *fields_fs;          /* What sep() was given, NULL for " " */
+
+/* The split of the current record. */
+static PyObject *fields_record;  /* $0 the fields are of */
+static PyObject *fields_bytes;   /* UTF-8 of $0 when str could not hand it out */
+static const gchar *fields_data;
+static gboolean fields_split;    /* fields_spans is up to date */
+static gboolean fields_text;     /* str fields, bytes otherwise */
+static gboolean fields_ascii;    /* Byte offsets are character offsets */
+static GArray *fields_spans;
+static PyObject **fields_cache;  /* Field objects made so far, by index */
+static guint fields_cache_size;
+
+/************* FIELDS PRIMITIVES ***************/
+static PyObject* emb_fields_get (PyObject *self, PyObject *arg);
+static PyObject* emb_fields_count (PyObject *self, PyObject *args);
+static PyObject* emb_fields_sep (PyObject *self, PyObject *args);
+
+static PyMethodDef FieldsMethods[] = {
+  {"get", emb_fields_get, METH_O,
+   N_("Field n of the current record. Used by compiled scripts for $n.")},
+  {"count", emb_fields_count, METH_NOARGS,
+   N_("Number of fields in the current record.")},
+  {"sep", emb_fields_sep, METH_VARARGS,
+   N_("Get or set the field separator.")},
+  {NULL, NULL, 0, NULL}
+};
+
+static void
+fields_reset (void)
+{
+  guint i;
+
+  for (i = 0; i < fields_cache_size; i++)
+    Py_CLEAR (fields_cache[i]);
+  Py_CLEAR (fields_bytes);
+  fields_split = FALSE;
+}
+
+/* Split $0 unless that is done already. */
+static gint
+fields_sync (void)
+{
+  PyObject *record = bungee_globals_get_record ();
+  gsize len;
+  gboolean utf8;
+
+  if (record != fields_record)
+    {
+      fields_reset ();
+      Py_XINCREF (record);
+      Py_XDECREF (fields_record);
+      fields_record = record;
+    }
+
+  /* Records are split in place, their bytes move when they are copied
+     off the input. The offsets stay the same. */
+  if (record && bungee_record_check (record))
+    fields_data = bungee_record_data (record, &len);
+
+  if (fields_split)
+    return (0);
+
+  fields_data = bungee_record_utf8 (record, &len, &fields_bytes, "fields");
+  if (fields_data == NULL)
+    return (-1);
+
+  /* Only bytes give bytes fields. Records are not known to be ASCII. */
+  fields_text = record == NULL || !PyBytes_Check (record);
+  fields_ascii = !fields_text || record == NULL
+    || (PyUnicode_Check (record) && PyUnicode_IS_ASCII (record));
+
+  /* Text with surrogate escapes is not valid UTF-8, treat it as bytes.
+     Only regexes and widths care, records are checked for them alone. */
+  utf8 = fields_text && !fields_ascii && fields_bytes == NULL;
+  if (utf8 && bungee_record_check (record))
+    utf8 = fields_sep && (fields_sep->mode == BNG_FIELDS_REGEX
+			  || fields_sep->mode == BNG_FIELDS_WIDTHS)
+      && g_utf8_validate (fields_data, len, NULL);
+  bng_fields_split (fields_sep, fields_data, len, utf8, fields_spans);
+
+  if (fields_spans->len > fields_cache_size)
+    {
+      fields_cache = g_renew (PyObject *, fields_cache, fields_spans->len);
+      memset (fields_cache + fields_cache_size, 0,
+	      (fields_spans->len - fields_cache_size) * sizeof (PyObject *));
+      fields_cache_size = fields_spans->len;
+    }
+
+  fields_split = TRUE;
+  return (0);
+}
+
+static PyObject *
+fields_new (bng_field_t *field)
+{
+  if (!fields_text)
+    return PyBytes_FromStringAndSize (fields_data + field->start, field->len);
+  if (fields_ascii)
+    return PyUnicode_Substring (fields_record, field->start, field->start + field->len);
+  return PyUnicode_DecodeUTF8 (fields_data + field->start, field->len, "surrogateescape");
+}
+
+/*
+  # Bungee.fields.get(n)
+
+  Returns field n of $0, counting from 1. Negative n count from the last
+  field, so -1 is $NF. 0 is $0 itself. Fields past the end are empty, like
+  in AWK.
+ */
+static PyObject*
+emb_fields_get (PyObject *self, PyObject *arg)
+{
+  Py_ssize_t n = PyLong_AsSsize_t (arg);
+
+  if (n == -1 && PyErr_Occurred ())
+    return NULL;
+
+  if (n == 0)
+    {
+      PyObject *record = bungee_globals_get_record ();
+      if (record == NULL)
+	return PyUnicode_FromString ("");
+      Py_INCREF (record);
+      return record;
+    }
+
+  if (fields_sync () != 0)
+    return NULL;
+
+  if (n < 0)
+    n += fields_spans->len + 1;
+  if (n < 1 || (gsize) n > fields_spans->len)
+    return fields_text ? PyUnicode_FromString ("") : PyBytes_FromString ("");
+
+  if (fields_cache[n - 1] == NULL)
+    {
+      fields_cache[n - 1] = fields_new (&g_array_index (fields_spans, bng_field_t, n - 1));
+      if (fields_cache[n - 1] == NULL)
+	return NULL;
+    }
+
+  Py_INCREF (fields_cache[n - 1]);
+  return fields_cache[n - 1];
+}
+
+/*
+  # Bungee.fields.count()
+
+  Returns the number of fields of $0, AWK's NF.
+ */
+static PyObject*
+emb_fields_count (PyObject *self, PyObject *args)
+{
+  if (fields_sync () != 0)
+    return NULL;
+
+  return PyLong_FromSize_t (fields_spans->len);
+}
+
+/*
+  # Bungee.fields.sep([fs])
+
+  Takes an optional separator. Like AWK's FS, " " (the default) splits on
+  runs of blanks, any other single character on each occurrence of it,
+  longer strings are regular expressions. A sequence of integers instead
+  selects fixed width fields, in characters. Returns the separator in
+  effect.
+ */
+static PyObject*
+emb_fields_sep (PyObject *self, PyObject *args)
+{
+  PyObject *fs = NULL, *item;
+  bng_fields_sep_t *sep;
+  GError *error = NULL;
+  Py_ssize_t i, n;
+  guint *widths;
+
+  if(!PyArg_ParseTuple(args, "|O:sep", &fs))
+    {
+      BNG_DBG (_("Error parsing Bungee.fields.sep() tuple"));
+      return NULL;
+    }
+
+  if (fs == NULL)
+    {
+      if (fields_fs == NULL)
+	return PyUnicode_FromString (" ");
+      Py_INCREF (fields_fs);
+      return fields_fs;
+    }
+
+  if (PyUnicode_Check (fs))
+    {
+      const gchar *text = PyUnicode_AsUTF8 (fs);
+      if (text == NULL)
+	return NULL;
+      sep = bng_fields_sep_new (text, &error);
+      if (sep == NULL)
+	{
+	  PyErr_Format (PyExc_ValueError, "invalid field separator: %s", error->message);
+	  g_error_free (error);
+	  return NULL;
+	}
+    }
+  else if (PySequence_Check (fs) && !PyBytes_Check (fs))
+    {
+      n = PySequence_Size (fs);
+      if (n <= 0)
+	{
+	  PyErr_SetString (PyExc_ValueError, "field widths must not be empty");
+	  return NULL;
+	}
+
+      widths = g_new (guint, n);
+      for (i = 0; i < n; i++)
+	{
+	  glong width = -1;
+
+	  item = PySequence_GetItem (fs, i);
+	  if (item)
+	    {
+	      width = PyLong_AsLong (item);
+	      Py_DECREF (item);
+	    }
+	  if (width <= 0)
+	    {
+	      if (!PyErr_Occurred ())
+		PyErr_SetString (PyExc_ValueError, "field widths must be positive integers");
+	      g_free (widths);
+	      return NULL;
+	    }
+	  widths[i] = width;
+	}
+
+      sep = bng_fields_sep_new_widths (widths, n);
+      g_free (widths);
+    }
+  else
+    {
+      PyErr_SetString (PyExc_TypeError, "field separator must be a str or a sequence of widths");
+      return NULL;
+    }
+
+  bng_fields_sep_free (fields_sep);
+  fields_sep = sep;
+  Py_INCREF (fs);
+  Py_XDECREF (fields_fs);
+  fields_fs = fs;
+  fields_reset ();
+
+  Py_INCREF (fs);
+  return fs;
+}
+
+/****************************************/
+/* >>>> Insert new primitives here <<<< */
+/****************************************/
+
+/************* FIELDS MODULE ***************/
+static PyModuleDef FieldsModule = {
+  PyModuleDef_HEAD_INIT, "Bungee.fields", NULL, -1, FieldsMethods,
+  NULL, NULL, NULL, NULL
+};
+
+/* Create Bungee.fields module and attach it to mod_bungee. */
+gint
+mod_fields_init (PyObject *mod_bungee)
+{
+  fields_spans = g_array_new (FALSE, FALSE, sizeof (bng_field_t));
+
+  mod_fields = PyModule_Create (&FieldsModule);
+  if (mod_fields == NULL)
+    return (-1);
+
+  /* PyModule_AddObject steals a reference, keep ours. */
+  Py_INCREF (mod_fields);
+  if (PyModule_AddObject (mod_bungee, "fields", mod_fields) != 0)
+    {
+      Py_DECREF (mod_fields);
+      return (-1);
+    }
+
+  return (0);
+}
+
+gint
+mod_fields_fini (void)
+{
+  fields_reset ();
+  Py_CLEAR (fields_record);
+  Py_CLEAR (fields_fs);
+  Py_CLEAR (mod_fields);
+
+  g_free (fields_cache);
+  fields_cache = NULL;
+  fields_cache_size = 0;
+  if (fields_spans)
+    g_array_free (fields_spans, TRUE);
+  fields_spans = NULL;
+  bng_fields_sep_free (fields_sep);
+  fields_sep = NULL;
+
+  return (0);
+}
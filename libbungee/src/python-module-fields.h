@@ -0,0 +1,35 @@
+/*
+python-module-fields.h: Bungee.fields module.
+
+This file is part of Bungee.
+
+Copyright 2012 Red Hat, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef _PYTHON_MODULE_FIELDS_H
+#define _PYTHON_MODULE_FIELDS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+gint mod_fields_init (PyObject *mod_bungee);
+gint mod_fields_fini (void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _PYTHON_MODULE_FIELDS_H */
@@ -0,0 +1,269 @@
+/*
+python-module-fuzzy.c: Bungee.fuzzy module.
+
+This file is part of Bungee.
+
+Copyright 2012 Red Hat, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+/* Python.h should be the first header to include, even before system headers */
+#define PY_SSIZE_T_CLEAN /* "s#" lengths are Py_ssize_t */
+#include <Python.h>
+#include <errno.h>
+#include <glib.h>
+
+#include "local-defs.h"
+#include "logger.h"
+#include "trie.h"
+#include "fuzzy.h"
+
+static PyObject *mod_fuzzy; /* hold a reference Bungee.fuzzy module created by mod_fuzzy_init */
+
+/* Loaded dictionaries, dict_id is the index. */
+static GPtrArray *fuzzy_dicts;
+
+/************* FUZZY PRIMITIVES ***************/
+static PyObject* emb_fuzzy_load (PyObject *self, PyObject *args);
+static PyObject* emb_fuzzy_match (PyObject *self, PyObject *args);
+static PyObject* emb_fuzzy_matches (PyObject *self, PyObject *args);
+
+static PyMethodDef FuzzyMethods[] = {
+  {"load", emb_fuzzy_load, METH_VARARGS,
+   N_("Load a word list, one word per line. Returns a dictionary id.")},
+  {"match", emb_fuzzy_match, METH_VARARGS,
+   N_("Closest dictionary word within k edits, or None.")},
+  {"matches", emb_fuzzy_matches, METH_VARARGS,
+   N_("All dictionary words within k edits as (word, distance), closest first.")},
+  {NULL, NULL, 0, NULL}
+};
+
+static bng_trie_t *
+fuzzy_dict (gint dict_id)
+{
+  if (dict_id < 0 || (guint) dict_id >= fuzzy_dicts->len)
+    {
+      PyErr_Format (PyExc_ValueError, "unknown dictionary id %d", dict_id);
+      return NULL;
+    }
+  return g_ptr_array_index (fuzzy_dicts, dict_id);
+}
+
+/* Dictionary words are bytes, keep undecodable ones round-trippable. */
+static PyObject *
+fuzzy_word (bng_trie_t *trie, bng_trie_node_t *node)
+{
+  gchar buf[256], *word = buf;
+  PyObject *py_word;
+
+  if (node->depth >= sizeof (buf))
+    word = g_malloc (node->depth + 1);
+
+  bng_trie_node_word (trie, node, word, node->depth + 1);
+  py_word = PyUnicode_DecodeUTF8 (word, node->depth, "surrogateescape");
+
+  if (word != buf)
+    g_free (word);
+  return py_word;
+}
+
+/*
+  # dict_id = Bungee.fuzzy.load('/usr/share/dict/words')
+
+  Loads a dictionary. Prebuilt .bngd files (bungee --build-dict) are
+  mapped and used in place, anything else is read as a word list, one
+  word per line. Loading the same word list twice builds it twice, keep
+  the id around.
+ */
+static PyObject*
+emb_fuzzy_load (PyObject *self, PyObject *args)
+{
+  const gchar *path;
+  bng_trie_t *trie;
+
+  if(!PyArg_ParseTuple(args, "s:load", &path))
+    {
+      BNG_DBG (_("Error parsing Bungee.fuzzy.load() tuple"));
+      return NULL;
+    }
+
+  trie = bng_trie_open (path);
+  if (trie == NULL && errno == ENOEXEC)
+    {
+      trie = bng_trie_new ();
+      if (bng_load_dict (trie, path) < 0)
+	{
+	  gint _errno = errno;
+	  bng_trie_free (trie);
+	  trie = NULL;
+	  errno = _errno;
+	}
+    }
+
+  if (trie == NULL)
+    return PyErr_SetFromErrnoWithFilename (PyExc_OSError, path);
+
+  g_ptr_array_add (fuzzy_dicts, trie);
+  return PyLong_FromLong (fuzzy_dicts->len - 1);
+}
+
+/*
+  # Bungee.fuzzy.match(dict_id, word[, k])
+
+  Closest word of the dictionary within k (default 1) edits of word, None
+  if there is none. Meant for rule conditions:
+
+    RULE Known Bungee.fuzzy.match(words, $0, 2):
+ */
+static PyObject*
+emb_fuzzy_match (PyObject *self, PyObject *args)
+{
+  gint dict_id, k = 1, dist;
+  const gchar *word;
+  Py_ssize_t len;
+  bng_trie_t *trie;
+  bng_trie_node_t *node = NULL;
+
+  if(!PyArg_ParseTuple(args, "is#|i:match", &dict_id, &word, &len, &k))
+    {
+      BNG_DBG (_("Error parsing Bungee.fuzzy.match() tuple"));
+      return NULL;
+    }
+
+  trie = fuzzy_dict (dict_id);
+  if (trie == NULL)
+    return NULL;
+
+  if (k < 0)
+    {
+      PyErr_SetString (PyExc_ValueError, "edit distance must not be negative");
+      return NULL;
+    }
+
+  dist = bng_fuzzy_match (trie, word, len, k, &node);
+  if (dist == -2)
+    return PyErr_NoMemory ();
+  if (dist < 0)
+    Py_RETURN_NONE;
+
+  return fuzzy_word (trie, node);
+}
+
+/*
+  # Bungee.fuzzy.matches(dict_id, word[, k])
+
+  Every word of the dictionary within k (default 1) edits of word, as a
+  list of (word, distance) closest first.
+ */
+static PyObject*
+emb_fuzzy_matches (PyObject *self, PyObject *args)
+{
+  gint dict_id, k = 1, count;
+  const gchar *word;
+  Py_ssize_t len;
+  bng_trie_t *trie;
+  GArray *found;
+  PyObject *py_list = NULL;
+  guint i;
+
+  if(!PyArg_ParseTuple(args, "is#|i:matches", &dict_id, &word, &len, &k))
+    {
+      BNG_DBG (_("Error parsing Bungee.fuzzy.matches() tuple"));
+      return NULL;
+    }
+
+  trie = fuzzy_dict (dict_id);
+  if (trie == NULL)
+    return NULL;
+
+  if (k < 0)
+    {
+      PyErr_SetString (PyExc_ValueError, "edit distance must not be negative");
+      return NULL;
+    }
+
+  found = g_array_new (FALSE, FALSE, sizeof (bng_trie_match_t));
+  g_array_set_clear_func (found, bng_trie_match_clear);
+
+  count = bng_fuzzy_matches (trie, word, len, k, found);
+  if (count < 0)
+    {
+      PyErr_NoMemory ();
+      goto END;
+    }
+
+  py_list = PyList_New (count);
+  if (py_list == NULL)
+    goto END;
+
+  for (i = 0; i < found->len; i++)
+    {
+      bng_trie_match_t *match = &g_array_index (found, bng_trie_match_t, i);
+      PyObject *py_item = Py_BuildValue ("(Ni)",
+					 PyUnicode_DecodeUTF8 (match->word, strlen (match->word),
+							       "surrogateescape"),
+					 match->dist);
+      if (py_item == NULL)
+	{
+	  Py_CLEAR (py_list);
+	  goto END;
+	}
+      PyList_SET_ITEM (py_list, i, py_item);
+    }
+
+ END:
+  g_array_free (found, TRUE);
+  return py_list;
+}
+
+/****************************************/
+/* >>>> Insert new primitives here <<<< */
+/****************************************/
+
+/************* FUZZY MODULE ***************/
+static PyModuleDef FuzzyModule = {
+  PyModuleDef_HEAD_INIT, "Bungee.fuzzy", NULL, -1, FuzzyMethods,
+  NULL, NULL, NULL, NULL
+};
+
+/* Create Bungee.fuzzy module and attach it to mod_bungee. */
+gint
+mod_fuzzy_init (PyObject *mod_bungee)
+{
+  fuzzy_dicts = g_ptr_array_new_with_free_func ((GDestroyNotify) bng_trie_free);
+
+  mod_fuzzy = PyModule_Create (&FuzzyModule);
+  if (mod_fuzzy == NULL)
+    return (-1);
+
+  /* PyModule_AddObject steals a reference, keep ours. */
+  Py_INCREF (mod_fuzzy);
+  if (PyModule_AddObject (mod_bungee, "fuzzy", mod_fuzzy) != 0)
+    {
+      Py_DECREF (mod_fuzzy);
+      return (-1);
+    }
+
+  return (0);
+}
+
+gint
+mod_fuzzy_fini (void)
+{
+  Py_CLEAR (mod_fuzzy);
+  if (fuzzy_dicts)
+    g_ptr_array_free (fuzzy_dicts, TRUE);
+  fuzzy_dicts = NULL;
+  return (0);
+}
@@ -0,0 +1,222 @@
+/*
+python-module-input.c: Bungee.input module
+
+This file is part of Bungee.
+
+Copyright 2012 Red Hat, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+/* Python.h should be the first header to include, even before system headers */
+#include <Python.h>
+#include <glib.h>
+
+#include "local-defs.h"
+#include "logger.h"
+#include "input.h"
+
+static PyObject *mod_input; /* hold a reference Bungee.input module created by mod_input_init */
+
+/************* INPUT PRIMITIVES ***************/
+static PyObject* emb_input_lines (PyObject *self, PyObject *args);
+static PyObject* emb_input_readahead (PyObject *self, PyObject *args);
+static PyObject* emb_input_jsonl (PyObject *self, PyObject *args);
+static PyObject* emb_input_files (PyObject *self, PyObject *args);
+static PyObject* emb_input_filename (PyObject *self, PyObject *args);
+
+static PyMethodDef InputMethods[] = {
+  {"lines", emb_input_lines, METH_VARARGS,
+   N_("Read records line by line from a file using the native reader.")},
+  {"readahead", emb_input_readahead, METH_VARARGS,
+   N_("Get or set how many chunks of records are read ahead in a reader thread.")},
+  {"jsonl", emb_input_jsonl, METH_VARARGS,
+   N_("Read JSON objects line by line from a file using the native reader.")},
+  {"files", emb_input_files, METH_VARARGS,
+   N_("Read records line by line from every file a pattern matches using the native reader.")},
+  {"filename", emb_input_filename, METH_NOARGS,
+   N_("Name of the file the current record was read from.")},
+  {NULL, NULL, 0, NULL}
+};
+
+/*
+  # Bungee.input.lines('/path/to/file')
+
+  Selects a native line reader as the input source of the engine. No
+  INPUT hook is needed, every line (without the newline) is handed to the
+  rules as $0. "-" reads from standard input. gzip compressed files and
+  streams are recognised and inflated as they are read.
+ */
+static PyObject*
+emb_input_lines (PyObject *self, PyObject *args)
+{
+  const gchar *path;
+  bng_input_t *input;
+
+  if(!PyArg_ParseTuple(args, "s:lines", &path))
+    {
+      BNG_DBG (_("Error parsing Bungee.input.lines() tuple"));
+      return NULL;
+    }
+
+  input = bng_input_lines_open (path);
+  if (input == NULL)
+    return PyErr_SetFromErrnoWithFilename (PyExc_OSError, path);
+
+  bng_input_set_source (input);
+  Py_RETURN_NONE;
+}
+
+/*
+  # Bungee.input.readahead([depth])
+
+  Takes an optional depth. A non-zero depth reads native sources in a
+  thread of their own, up to depth chunks of records ahead of the rules,
+  so I/O latency overlaps with Python execution. The reader blocks when
+  the engine falls depth chunks behind. Zero reads in the engine thread.
+  Returns the read-ahead depth in effect.
+ */
+static PyObject*
+emb_input_readahead (PyObject *self, PyObject *args)
+{
+  gint depth = -1;
+
+  if(!PyArg_ParseTuple(args, "|i:readahead", &depth))
+    {
+      BNG_DBG (_("Error parsing Bungee.input.readahead() tuple"));
+      return NULL;
+    }
+
+  if (PyTuple_GET_SIZE (args) > 0)
+    {
+      if (depth < 0)
+	{
+	  PyErr_SetString (PyExc_ValueError, "read-ahead depth must not be negative");
+	  return NULL;
+	}
+      bng_input_set_readahead (depth);
+    }
+
+  return PyLong_FromUnsignedLong (bng_input_get_readahead ());
+}
+
+/*
+  # Bungee.input.jsonl('/path/to/file')
+
+  Like Bungee.input.lines() for JSON lines, one object per line, blank
+  lines are skipped. $0 stays the text of the line, $.name reads member
+  name of it, see Bungee.json.get(). Only the members rules ask for are
+  parsed.
+ */
+static PyObject*
+emb_input_jsonl (PyObject *self, PyObject *args)
+{
+  const gchar *path;
+  bng_input_t *input;
+
+  if(!PyArg_ParseTuple(args, "s:jsonl", &path))
+    {
+      BNG_DBG (_("Error parsing Bungee.input.jsonl() tuple"));
+      return NULL;
+    }
+
+  input = bng_input_jsonl_open (path);
+  if (input == NULL)
+    return PyErr_SetFromErrnoWithFilename (PyExc_OSError, path);
+
+  bng_input_set_source (input);
+  Py_RETURN_NONE;
+}
+
+/*
+  # Bungee.input.files(pattern)
+
+  Like Bungee.input.lines() over every file the pattern matches, in
+  turn. Patterns expand like in the shell, a directory stands for the
+  files in it. gzip files are inflated. BEGINFILE: and ENDFILE: sections
+  run before the first and after the last record of every file, see
+  Bungee.input.filename(). With --jobs, workers take files (and parts of
+  large ones) largest first until none are left.
+ */
+static PyObject*
+emb_input_files (PyObject *self, PyObject *args)
+{
+  const gchar *pattern;
+  bng_input_t *input;
+
+  if(!PyArg_ParseTuple(args, "s:files", &pattern))
+    {
+      BNG_DBG (_("Error parsing Bungee.input.files() tuple"));
+      return NULL;
+    }
+
+  input = bng_input_files_open (pattern);
+  if (input == NULL)
+    return PyErr_SetFromErrnoWithFilename (PyExc_OSError, pattern);
+
+  bng_input_set_source (input);
+  Py_RETURN_NONE;
+}
+
+/*
+  # Bungee.input.filename()
+
+  Returns the name of the file $0 was read from by a native source, AWK's
+  FILENAME. None before the first record or with an INPUT hook.
+ */
+static PyObject*
+emb_input_filename (PyObject *self, PyObject *args)
+{
+  const gchar *name = bng_input_get_filename ();
+
+  if (name == NULL)
+    Py_RETURN_NONE;
+  return PyUnicode_DecodeFSDefault (name);
+}
+
+/****************************************/
+/* >>>> Insert new primitives here <<<< */
+/****************************************/
+
+/************* INPUT MODULE ***************/
+static PyModuleDef InputModule = {
+  PyModuleDef_HEAD_INIT, "Bungee.input", NULL, -1, InputMethods,
+  NULL, NULL, NULL, NULL
+};
+
+/* Create Bungee.input module and attach it to mod_bungee. */
+gint
+mod_input_init (PyObject *mod_bungee)
+{
+  mod_input = PyModule_Create (&InputModule);
+  if (mod_input == NULL)
+    return (-1);
+
+  /* PyModule_AddObject steals a reference, keep ours. */
+  Py_INCREF (mod_input);
+  if (PyModule_AddObject (mod_bungee, "input", mod_input) != 0)
+    {
+      Py_DECREF (mod_input);
+      return (-1);
+    }
+
+  return (0);
+}
+
+gint
+mod_input_fini (void)
+{
+  bng_input_set_source (NULL);
+  Py_CLEAR (mod_input);
+  return (0);
+}
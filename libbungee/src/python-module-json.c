@@ -0,0 +1,353 @@
+/*
+python-module-json.c: Bungee.json module
+
+This file is part of Bungee.
+
+Copyright 2012 Red Hat, Inc.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+/*
+  $.name in scripts compiles to Bungee.json.get('name'), the member name
+  of $0 read as a JSON object. Like with fields, nothing happens until a
+  rule asks: the first get() after $0 changed indexes it (see json.c),
+  and only the values asked for are turned in to Python objects. Strings
+  without escapes, integers, true, false and null are converted here,
+  anything else goes through json.loads.
+*/
+
+/* Python.h should be the first header to include, even before system headers */
+#include <Python.h>
+#include <string.h>
+#include <glib.h>
+
+#include "local-defs.h"
+#include "logger.h"
+#include "python-bungee-globals.h"
+#include "python-bungee-record.h"
+#include "json.h"
+
+static PyObject *mod_json; /* hold a reference Bungee.json module created by mod_json_init */
+static PyObject *json_loads; /* json.loads, imported on first use */
+
+/* The index of the current record. */
+static PyObject *json_record;   /* $0 the index is of */
+static PyObject *json_bytes;    /* UTF-8 of $0 when str could not hand it out */
+static const gchar *json_data;
+static gboolean json_indexed;   /* json_members is up to date */
+static GArray *json_members;
+static PyObject **json_values;  /* Values made so far, by member */
+static PyObject **json_keys;    /* Escaped keys decoded so far, by member */
+static guint json_cache_size;
+
+/************* JSON PRIMITIVES ***************/
+static PyObject* emb_json_get (PyObject *self, PyObject *arg);
+static PyObject* emb_json_keys (PyObject *self, PyObject *args);
+
+static PyMethodDef JsonMethods[] = {
+  {"get", emb_json_get, METH_O,
+   N_("Member of the current record as a JSON object. Used by compiled scripts for $.name.")},
+  {"keys", emb_json_keys, METH_NOARGS,
+   N_("Member names of the current record as a JSON object.")},
+  {NULL, NULL, 0, NULL}
+};
+
+static void
+json_reset (void)
+{
+  guint i;
+
+  for (i = 0; i < json_cache_size; i++)
+    {
+      Py_CLEAR (json_values[i]);
+      Py_CLEAR (json_keys[i]);
+    }
+  Py_CLEAR (json_bytes);
+  json_indexed = FALSE;
+}
+
+/* Index $0 unless that is done already. */
+static gint
+json_sync (void)
+{
+  PyObject *record = bungee_globals_get_record ();
+  gsize len;
+
+  if (record != json_record)
+    {
+      json_reset ();
+      Py_XINCREF (record);
+      Py_XDECREF (json_record);
+      json_record = record;
+    }
+
+  /* Bytes of records move when they are copied off the input. */
+  if (record && bungee_record_check (record))
+    json_data = bungee_record_data (record, &len);
+
+  if (json_indexed)
+    return (0);
+
+  json_data = bungee_record_utf8 (record, &len, &json_bytes, "JSON members");
+  if (json_data == NULL)
+    return (-1);
+
+  /* A record that is not an object has no members. */
+  bng_json_index (json_data, len, json_members);
+
+  if (json_members->len > json_cache_size)
+    {
+      json_values = g_renew (PyObject *, json_values, json_members->len);
+      json_keys = g_renew (PyObject *, json_keys, json_members->len);
+      memset (json_values + json_cache_size, 0,
+	      (json_members->len - json_cache_size) * sizeof (PyObject *));
+      memset (json_keys + json_cache_size, 0,
+	      (json_members->len - json_cache_size) * sizeof (PyObject *));
+      json_cache_size = json_members->len;
+    }
+
+  json_indexed = TRUE;
+  return (0);
+}
+
+/* json.loads of len bytes of JSON text at text. */
+static PyObject *
+json_parse (const gchar *text, gsize len)
+{
+  PyObject *str, *value;
+
+  if (json_loads == NULL)
+    {
+      PyObject *module = PyImport_ImportModule ("json");
+      if (module == NULL)
+	return NULL;
+      json_loads = PyObject_GetAttrString (module, "loads");
+      Py_DECREF (module);
+      if (json_loads == NULL)
+	return NULL;
+    }
+
+  str = PyUnicode_DecodeUTF8 (text, len, "surrogateescape");
+  if (str == NULL)
+    return NULL;
+  value = PyObject_CallOneArg (json_loads, str);
+  Py_DECREF (str);
+  return value;
+}
+
+/* Integers that fit in 18 digits, the common case of numbers in logs. */
+static gboolean
+json_small_int (const gchar *text, gsize len, gint64 *value)
+{
+  gboolean negative = (text[0] == '-');
+  gsize i = negative ? 1 : 0;
+
+  if (len - i == 0 || len - i > 18 || (text[i] == '0' && len - i > 1))
+    return FALSE;
+
+  for (*value = 0; i < len; i++)
+    {
+      if (text[i] < '0' || text[i] > '9')
+	return FALSE;
+      *value = *value * 10 + (text[i] - '0');
+    }
+
+  if (negative)
+    *value = -*value;
+  return TRUE;
+}
+
+static PyObject *
+json_value_new (bng_json_member_t *member)
+{
+  const gchar *text = json_data + member->value_start;
+  gsize len = member->value_len;
+  gint64 number;
+
+  switch (text[0])
+    {
+    case '"':
+      if (!member->value_escaped && len >= 2 && text[len - 1] == '"')
+	return PyUnicode_DecodeUTF8 (text + 1, len - 2, "surrogateescape");
+      break;
+    case 't':
+      if (len == 4 && memcmp (text, "true", 4) == 0)
+	Py_RETURN_TRUE;
+      break;
+    case 'f':
+      if (len == 5 && memcmp (text, "false", 5) == 0)
+	Py_RETURN_FALSE;
+      break;
+    case 'n':
+      if (len == 4 && memcmp (text, "null", 4) == 0)
+	Py_RETURN_NONE;
+      break;
+    default:
+      if (json_small_int (text, len, &number))
+	return PyLong_FromLongLong (number);
+    }
+
+  return json_parse (text, len);
+}
+
+/* Key of member i, decoded from its escapes. Borrowed reference. */
+static PyObject *
+json_key (guint i)
+{
+  bng_json_member_t *member = &g_array_index (json_members, bng_json_member_t, i);
+
+  if (json_keys[i] == NULL)
+    {
+      if (member->key_escaped)
+	json_keys[i] = json_parse (json_data + member->key_start - 1, member->key_len + 2);
+      else
+	json_keys[i] = PyUnicode_DecodeUTF8 (json_data + member->key_start, member->key_len,
+					     "surrogateescape");
+    }
+  return json_keys[i];
+}
+
+/*
+  # Bungee.json.get(name)
+
+  Returns member name of $0 read as a JSON object, None when $0 has no
+  such member or is not an object. With repeated names the last one
+  counts, like in json.loads.
+ */
+static PyObject*
+emb_json_get (PyObject *self, PyObject *arg)
+{
+  const gchar *name;
+  Py_ssize_t name_len;
+  guint i;
+
+  name = PyUnicode_AsUTF8AndSize (arg, &name_len);
+  if (name == NULL)
+    return NULL;
+
+  if (json_sync () != 0)
+    return NULL;
+
+  for (i = json_members->len; i-- > 0; )
+    {
+      bng_json_member_t *member = &g_array_index (json_members, bng_json_member_t, i);
+
+      if (member->key_escaped)
+	{
+	  PyObject *key = json_key (i);
+	  if (key == NULL)
+	    return NULL;
+	  if (PyUnicode_Compare (key, arg) != 0)
+	    continue;
+	}
+      else if ((gsize) name_len != member->key_len
+	       || memcmp (json_data + member->key_start, name, name_len) != 0)
+	continue;
+
+      if (json_values[i] == NULL)
+	{
+	  json_values[i] = json_value_new (member);
+	  if (json_values[i] == NULL)
+	    return NULL;
+	}
+      Py_INCREF (json_values[i]);
+      return json_values[i];
+    }
+
+  Py_RETURN_NONE;
+}
+
+/*
+  # Bungee.json.keys()
+
+  Returns the member names of $0 read as a JSON object, in the order of
+  the record. Empty when $0 is not an object.
+ */
+static PyObject*
+emb_json_keys (PyObject *self, PyObject *args)
+{
+  PyObject *keys;
+  guint i;
+
+  if (json_sync () != 0)
+    return NULL;
+
+  keys = PyList_New (json_members->len);
+  if (keys == NULL)
+    return NULL;
+
+  for (i = 0; i < json_members->len; i++)
+    {
+      PyObject *key = json_key (i);
+      if (key == NULL)
+	{
+	  Py_DECREF (keys);
+	  return NULL;
+	}
+      Py_INCREF (key);
+      PyList_SET_ITEM (keys, i, key);
+    }
+
+  return keys;
+}
+
+/****************************************/
+/* >>>> Insert new primitives here <<<< */
+/****************************************/
+
+/************* JSON MODULE ***************/
+static PyModuleDef JsonModule = {
+  PyModuleDef_HEAD_INIT, "Bungee.json", NULL, -1, JsonMethods,
+  NULL, NULL, NULL, NULL
+};
+
+/* Create Bungee.json module and attach it to mod_bungee. */
+gint
+mod_json_init (PyObject *mod_bungee)
+{
+  json_members = g_array_new (FALSE, FALSE, sizeof (bng_json_member_t));
+
+  mod_json = PyModule_Create (&JsonModule);
+  if (mod_json == NULL)
+    return (-1);
+
+  /* PyModule_AddObject steals a reference, keep ours. */
+  Py_INCREF (mod_json);
+  if (PyModule_AddObject (mod_bungee, "json", mod_json) != 0)
+    {
+      Py_DECREF (mod_json);
+      return (-1);
+    }
+
+  return (0);
+}
+
+gint
+mod_json_fini (void)
+{
+  json_reset ();
+  Py_CLEAR (json_record);
+  Py_CLEAR (json_loads);
+  Py_CLEAR (mod_json);
+
+  g_free (json_values);
+  g_free (json_keys);
+  json_values = json_keys = NULL;
+  json_cache_size = 0;
+  if (json_members)
+    g_array_free (json_members, TRUE);
+  json_members = NULL;
+
+  return (0);
+}
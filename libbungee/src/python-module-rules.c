@@ -24,6 +24,7 @@ limitations under the License.
 
 #include "local-defs.h"
 #include "logger.h"
+#include "python-embedding.h"
 
 
 /************* RULES PRIMITIVES ***************/
@@ -52,21 +53,35 @@ static PyObject *mod_rules; /* hold a reference RULE module imported by mod_rule
 			 |    ...     |
 			 +------------+
 
+   The keyed tables are only used while rules are declared. Before the
+   engine runs, mod_rules_compile flattens them in to rule_array, a
+   contiguous array ordered by group and rule declaration order, which is
+   what mod_rules_eval walks for every record.
 */
 static GData *group_table;
 
-/* String key to GLOBAL rule_table in group_table. This static const string
-   is used for quark id lookup optimization. */
-static const gchar *global_group_name = "_global";
+typedef struct
+{
+  GData *rule_table; /* Rules of this group indexed by rule_name. */
+  guint seq; /* Declaration order of the group. */
+} group_t;
 
 typedef struct
 {
   // gchar *group_name; /* You can find group_name by converting quark from group_table. */
   // gchar *rule_name; /* You can find rule_name by converting quark from rule_table. */
-  PyObject *condt; /*  Function pointer to condition. */
-  PyObject *action; /* Function pointer to action. */
+  guint group_seq; /* Declaration order of the group this rule belongs to. */
+  guint seq; /* Declaration order of the rule. */
+  PyObject *condt; /*  Function pointer to condition. NULL means always true. */
+  PyObject *action; /* Function pointer to action. NULL until resolved from action_name. */
+  gchar *action_name; /* Name of the action function in __main__. */
 } rule_t;
 
+/* Flattened rules, owns a reference to every condt and action. */
+static GArray *rule_array;
+static gboolean rules_dirty; /* Rules were appended since last compile. */
+static guint decl_seq; /* Declaration sequence counter. */
+
 static PyMethodDef RulesMethods[] =
   {
     {"append", emb_append_rule, METH_VARARGS,
@@ -77,39 +92,91 @@ static PyMethodDef RulesMethods[] =
 
 /************* MISC ROUTINES *************/
 
-/* Pointer to group_table entry containing all the default global rules with
-   "GLOBAL" string as key. */
-static GQuark get_global_rule_table_id (void)
+/* Destroy function fo group stored in group_table */
+static void
+group_destroy (void *group)
 {
-  static GQuark global_rule_table_id;
+  group_t *_group = (group_t *) group;
+
+  g_datalist_clear (&_group->rule_table);
+  g_slice_free (group_t, _group);
+}
 
-  if (!global_rule_table_id)
-    global_rule_table_id = g_quark_from_static_string (global_group_name);
+/* Destroy function fo rule stored in rule_table */
+static void
+rule_destroy (void *rule)
+{
+  rule_t *_rule = (rule_t *) rule;
 
-  return global_rule_table_id;
+  Py_XDECREF (_rule->condt);  /* Decrement a reference to new callback */
+  Py_XDECREF (_rule->action);  /* Decrement a reference to new callback */
+  g_free (_rule->action_name);
+  g_slice_free (rule_t, _rule);
 }
 
-/* Pointer to group_table entry containing all the default global rules with
-   "GLOBAL" string as key. */
-static inline GData * get_global_rule_table (void)
+/* Drop rule_array and the references it holds. */
+static void
+rule_array_clear (void)
 {
-  return g_dataset_id_get_data (group_table, get_global_rule_table_id ());
+  guint i;
+
+  if (rule_array == NULL)
+    return;
+
+  for (i = 0; i < rule_array->len; i++)
+    {
+      rule_t *rule = &g_array_index (rule_array, rule_t, i);
+      Py_XDECREF (rule->condt);
+      Py_XDECREF (rule->action);
+    }
+  g_array_set_size (rule_array, 0);
 }
 
-/* Destroy function fo rule_table stored in group_table */
-void rule_table_destroy (void *rule_table)
+/* g_datalist_foreach callback: copy a rule in to rule_array. */
+static void
+flatten_rule (GQuark rule_id, gpointer data, gpointer group)
 {
-  GData *_rule_table = (GData *) rule_table;
-  g_dataset_destroy (_rule_table);
+  rule_t *rule = (rule_t *) data;
+  rule_t flat = *rule;
+
+  flat.group_seq = ((group_t *) group)->seq;
+  flat.action_name = NULL; /* Not needed past this point. */
+
+  if (flat.action == NULL)
+    {
+      flat.action = bng_py_hook_get (rule->action_name);
+      if (flat.action == NULL)
+	{
+	  BNG_WARN (_("Action [%s] of rule [%s] is not declared, rule is ignored"),
+		    rule->action_name, g_quark_to_string (rule_id));
+	  return;
+	}
+    }
+
+  Py_XINCREF (flat.condt);
+  Py_INCREF (flat.action);
+  g_array_append_val (rule_array, flat);
 }
 
-/* Destroy function fo rule stored in rule_table */
-void rule_destroy (void *rule)
+/* g_datalist_foreach callback: flatten all the rules of a group. */
+static void
+flatten_group (GQuark group_id, gpointer data, gpointer user_data)
 {
-  rule_t *_rule = (rule_t *) rule;
+  group_t *group = (group_t *) data;
+  g_datalist_foreach (&group->rule_table, flatten_rule, group);
+}
 
-  Py_XDECREF (_rule->condt);  /* Decrement a reference to new callback */
-  Py_XDECREF (_rule->action);  /* Decrement a reference to new callback */
+/* Order rules by group declaration, then by rule declaration. */
+static gint
+rule_cmp (gconstpointer a, gconstpointer b)
+{
+  const rule_t *ra = a, *rb = b;
+
+  if (ra->group_seq != rb->group_seq)
+    return (ra->group_seq < rb->group_seq) ? -1 : 1;
+  if (ra->seq != rb->seq)
+    return (ra->seq < rb->seq) ? -1 : 1;
+  return 0;
 }
 
 
@@ -117,7 +184,7 @@ void rule_destroy (void *rule)
 /* >>>> Insert new primitives here <<<< */
 /****************************************/
 /*
-  # Rules.append('groupname', 'rulename', '''condition()''', 'action()'))
+  # Rules.append('groupname', 'rulename', lambda: condition, 'action'))
 
   rules.append primitive appends a new rule to the rule table. It uses event
   driven programming model, where condition determines the action.
@@ -125,67 +192,146 @@ void rule_destroy (void *rule)
   Arguments:
   ----------
   groupname - Group name as string.
-  rulename  - Rule name as string.
+  rulename  - Rule name as string. A rule appended again under the same
+              name in the same group replaces the previous one.
   condition()- Condition should evaluate to boolean.
              - Condition() is a callback Python function. It takes no
-	       argument and returns bool.
-  action()   - action() is callback python function. It takes dictionary
-               object returned by previous RULE or INPUT as argument and
-	       returns a new dictionary (may be same or modified).
+	       argument and returns bool. None means always true.
+  action()   - action() is callback python function or the name of one
+               in __main__. Names are resolved when the rules are
+	       compiled, so the action may be defined after the rule.
 
   Returns:
   --------
-  Returns the a FLOW tuple as dictated by ACTION or False upon failure.
+  Returns True upon success.
  */
 static PyObject*
 emb_append_rule (PyObject *self, PyObject *args)
 {
   gchar *group_name, *rule_name;
-  rule_t rule;
+  PyObject *condt, *action;
+  rule_t *rule;
+  group_t *group;
 
-  if(!PyArg_ParseTuple (args, "ssO!O!:append", &group_name, &rule_name,
-			&PyFunction_Type, &rule.condt,
-			&PyFunction_Type, &rule.action))
+  if(!PyArg_ParseTuple (args, "ssOO:append", &group_name, &rule_name,
+			&condt, &action))
     {
       BNG_DBG (_("Error parsing Rules.append(...) rule."));
+      return NULL;
     }
 
-/* Let PyArg_ParseTuple do the validation via O!. */
-/*
-  if (!PyFunction_Check (&rule.condt))
+  if (condt != Py_None && !PyCallable_Check (condt))
     {
-      BNG_DBG (_("CONDT is not a callable function in RULE \"%s\".", rule_name));
-      Py_RETURN_NONE;
+      PyErr_Format (PyExc_TypeError, "condition of rule \"%s\" is not callable", rule_name);
+      return NULL;
     }
 
-  if (!PyFunction_Check (&rule.action))
+  if (!PyUnicode_Check (action) && !PyCallable_Check (action))
     {
-      BNG_DBG (_("ACTION is not a callable function in RULE \"%s\".", rule_name));
-      Py_RETURN_NONE;
+      PyErr_Format (PyExc_TypeError, "action of rule \"%s\" is not callable", rule_name);
+      return NULL;
     }
-*/
 
-  Py_XINCREF(rule.condt);  /* Increment a reference to new callback */
-  Py_XINCREF(rule.action); /* Increment a reference to new callback */
+  rule = g_slice_new0 (rule_t);
+  rule->seq = decl_seq++;
 
-  GData **rule_table = g_dataset_get_data (&group_table, group_name);
-  if (!rule_table)  /* Initialize this rule_table. */
+  if (condt != Py_None)
     {
-      g_datalist_init (rule_table);
-      /* Insert this rule under rule_name into rule_table. */
-      g_datalist_set_data_full (rule_table, rule_name, &rule, rule_destroy);
-      /* Insert this rule_table into group_table under group_name. */
-      g_datalist_set_data_full (&group_table, group_name, rule_table, rule_table_destroy);
+      Py_INCREF (condt);  /* Increment a reference to new callback */
+      rule->condt = condt;
     }
-  else /* rule_table already exists under this group_name. */
+
+  if (PyUnicode_Check (action))
+    {
+      rule->action_name = g_strdup (PyUnicode_AsUTF8 (action));
+    }
+  else
+    {
+      Py_INCREF (action); /* Increment a reference to new callback */
+      rule->action = action;
+    }
+
+  group = g_datalist_get_data (&group_table, group_name);
+  if (!group)  /* Initialize this rule_table. */
     {
-      /* Add this rule under rule_name into rule_table. */
-      g_datalist_set_data_full (rule_table, rule_name, &rule, rule_destroy);
+      group = g_slice_new0 (group_t);
+      group->seq = decl_seq++;
+      g_datalist_init (&group->rule_table);
+      /* Insert this rule_table into group_table under group_name. */
+      g_datalist_set_data_full (&group_table, group_name, group, group_destroy);
     }
 
+  /* Add this rule under rule_name into rule_table. */
+  g_datalist_set_data_full (&group->rule_table, rule_name, rule, rule_destroy);
+  rules_dirty = TRUE;
+
   Py_RETURN_TRUE;
 }
 
+/* Flatten group_table in to rule_array and resolve actions declared by
+   name. Must be called after the script is loaded and before records are
+   evaluated. */
+gint
+mod_rules_compile (void)
+{
+  if (rule_array == NULL)
+    rule_array = g_array_new (FALSE, FALSE, sizeof (rule_t));
+
+  rule_array_clear ();
+  g_datalist_foreach (&group_table, flatten_group, NULL);
+  g_array_sort (rule_array, rule_cmp);
+  rules_dirty = FALSE;
+
+  return (0);
+}
+
+/* Evaluate every rule against the current record. Rules whose condition
+   holds have their action called. Returns -1 with a Python exception set
+   if a condition or an action raised. */
+gint
+mod_rules_eval (void)
+{
+  guint i;
+  PyObject *py_val;
+
+  if (G_UNLIKELY (rules_dirty))
+    mod_rules_compile ();
+
+  for (i = 0; i < rule_array->len; i++)
+    {
+      rule_t *rule = &g_array_index (rule_array, rule_t, i);
+
+      if (rule->condt)
+	{
+	  gint truth;
+
+	  py_val = bng_py_call_noargs (rule->condt);
+	  if (py_val == NULL)
+	    return (-1);
+
+	  if (py_val == Py_True)
+	    truth = 1;
+	  else if (py_val == Py_False || py_val == Py_None)
+	    truth = 0;
+	  else
+	    truth = PyObject_IsTrue (py_val);
+	  Py_DECREF (py_val);
+
+	  if (truth < 0)
+	    return (-1);
+	  if (truth == 0)
+	    continue;
+	}
+
+      py_val = bng_py_call_noargs (rule->action);
+      if (py_val == NULL)
+	return (-1);
+      Py_DECREF (py_val);
+    }
+
+  return (0);
+}
+
 /************* RULES MODULE ***************/
 static PyObject* PyInit_rules (void);
 
@@ -239,6 +385,7 @@ gint
 mod_rules_init ()
 {
   g_datalist_init (&group_table);
+  rule_array = g_array_new (FALSE, FALSE, sizeof (rule_t));
 
   mod_rules = import_mod_rules ();
   if (mod_rules == NULL)
@@ -251,6 +398,12 @@ gint
 mod_rules_fini ()
 {
   /* Empty our RULE table. */
+  rule_array_clear ();
+  if (rule_array)
+    {
+      g_array_free (rule_array, TRUE);
+      rule_array = NULL;
+    }
   // g_datalist_destroy (&group_table);
   g_datalist_clear (&group_table);
 
@@ -28,6 +28,8 @@ extern "C" {
 gint mod_rules_register (void);
 gint mod_rules_init (void);
 gint mod_rules_fini (void);
+gint mod_rules_compile (void);
+gint mod_rules_eval (void);
 
 #ifdef __cplusplus
 }
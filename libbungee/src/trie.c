@@ -22,335 +22,711 @@
 */
 
 /*
- * Search for the 'most similar' word in the dictionary
- * Usage: ./trie /usr/share/dict/words funkyword
+ * Search for the 'most similar' word in the dictionary.
+ *
+ * Nodes are 16 bytes each and allocated from a single growing array, a
+ * walk touches memory in allocation order instead of chasing 255 child
+ * pointers per node.
  */
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <glib.h>
+#include <glib/gstdio.h>
+
+#include "local-defs.h"
+#include "logger.h"
+#include "trie.h"
 
 #define _min(a,b) ((a) < (b) ? (a) : (b))
 
-#define DISTANCE_EDIT 1
-#define DISTANCE_INS  1
-#define DISTANCE_DEL  1
+/* Initial arena size in nodes, doubles when full. */
+#define TRIE_INITIAL_NODES 1024
+
+/*
+  Dictionary file: a header followed by the node array exactly as it is in
+  memory. Nodes refer to each other by index, so the file is position
+  independent and is used in place through a read-only mapping, shared in
+  the page cache by every process that opens it. Files are native byte
+  order, the header records it.
+*/
+#define TRIE_FILE_MAGIC "BNGDICT"
+#define TRIE_FILE_VERSION 1
+#define TRIE_FILE_BYTE_ORDER 0x01020304
+
+typedef struct
+{
+  gchar magic[8];
+  guint32 version;
+  guint32 byte_order;
+  guint32 node_size;
+  guint32 node_count;
+  guint32 word_count;
+  guint32 max_depth;
+  guint32 reserved[8];
+} trie_file_header_t;
+
+G_STATIC_ASSERT (sizeof (trie_file_header_t) == 64);
+G_STATIC_ASSERT (sizeof (bng_trie_node_t) == 16);
 
 bng_trie_t *
-bng_trie_new (const gchar *word)
+bng_trie_new (void)
 {
-  bng_trie_t  *trie = NULL;
+  bng_trie_t *trie = NULL;
+
+  trie = g_new0 (bng_trie_t, 1);
+  trie->capacity = TRIE_INITIAL_NODES;
+  trie->nodes = g_new0 (bng_trie_node_t, trie->capacity);
+  trie->node_count = 1; /* Root */
+
+  return trie;
+}
 
-  trie = calloc (sizeof (*trie), 1);
+void
+bng_trie_free (bng_trie_t *trie)
+{
   if (!trie)
+    return;
+
+  if (trie->map)
+    munmap (trie->map, trie->map_len);
+  else
+    g_free (trie->nodes);
+  g_free (trie);
+}
+
+/* Do the count nodes of a mapped file form a trie the walks can trust?
+   Every link is in range, children are one deeper than their parent
+   (bounded by max_depth) and siblings come in increasing id order, so
+   no walk leaves the array or goes round in circles. */
+static gboolean
+trie_file_check (const bng_trie_node_t *nodes, guint32 count, guint32 max_depth)
+{
+  guint32 i;
+
+  if (nodes[BNG_TRIE_ROOT].depth != 0 || nodes[BNG_TRIE_ROOT].next_sibling != 0)
+    return FALSE;
+
+  for (i = 0; i < count; i++)
+    {
+      const bng_trie_node_t *node = &nodes[i];
+
+      if (node->first_child >= count || node->next_sibling >= count
+	  || node->parent >= count || node->depth > max_depth)
+	return FALSE;
+
+      if (i != BNG_TRIE_ROOT && nodes[node->parent].depth + 1 != node->depth)
+	return FALSE;
+
+      if (node->first_child && nodes[node->first_child].parent != i)
+	return FALSE;
+
+      if (node->next_sibling
+	  && (nodes[node->next_sibling].parent != node->parent
+	      || nodes[node->next_sibling].id <= node->id))
+	return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Map a dictionary file written by bng_trie_save. The trie is read-only.
+   Returns NULL with errno ENOEXEC when path is not a dictionary file,
+   EINVAL when its header does not fit this build or its nodes are
+   damaged. */
+bng_trie_t *
+bng_trie_open (const gchar *path)
+{
+  const trie_file_header_t *hdr;
+  struct stat stat_buf;
+  bng_trie_t *trie;
+  gpointer map;
+  gint fd, _errno;
+
+  fd = open (path, O_RDONLY);
+  if (fd < 0)
     return NULL;
 
-  trie->word = g_strdup (word);
-  if (!trie->word)
+  if (fstat (fd, &stat_buf) != 0)
+    goto ERROR;
+
+  if (stat_buf.st_size < (off_t) sizeof (trie_file_header_t))
+    {
+      errno = ENOEXEC;
+      goto ERROR;
+    }
+
+  map = mmap (NULL, stat_buf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED)
+    goto ERROR;
+  close (fd);
+
+  hdr = map;
+  if (memcmp (hdr->magic, TRIE_FILE_MAGIC, sizeof (hdr->magic)) != 0)
     {
-      free (trie);
-      trie = NULL;
+      errno = ENOEXEC;
+      goto UNMAP;
     }
 
-  trie->root.data = calloc (sizeof (int), strlen (trie->word));
-  if (!trie->root.data)
+  if (hdr->version != TRIE_FILE_VERSION
+      || hdr->byte_order != TRIE_FILE_BYTE_ORDER
+      || hdr->node_size != sizeof (bng_trie_node_t)
+      || hdr->node_count == 0
+      || (guint64) stat_buf.st_size != sizeof (*hdr) + (guint64) hdr->node_count * sizeof (bng_trie_node_t))
     {
-      free ((void *)trie->word);
-      free (trie);
-      trie = NULL;
+      BNG_DBG (_("Dictionary [%s] was built for a different version or machine"), path);
+      errno = EINVAL;
+      goto UNMAP;
     }
 
+  madvise (map, stat_buf.st_size, MADV_WILLNEED);
+
+  /* Searches index rows by depth and follow links unchecked. */
+  if (!trie_file_check ((const bng_trie_node_t *) ((const gchar *) map + sizeof (*hdr)),
+			hdr->node_count, hdr->max_depth))
+    {
+      BNG_DBG (_("Dictionary [%s] is damaged"), path);
+      errno = EINVAL;
+      goto UNMAP;
+    }
+
+  trie = g_new0 (bng_trie_t, 1);
+  trie->map = map;
+  trie->map_len = stat_buf.st_size;
+  trie->nodes = (bng_trie_node_t *) ((gchar *) map + sizeof (*hdr));
+  trie->node_count = trie->capacity = hdr->node_count;
+  trie->word_count = hdr->word_count;
+  trie->max_depth = hdr->max_depth;
+
   return trie;
+
+ UNMAP:
+  _errno = errno;
+  munmap (map, stat_buf.st_size);
+  errno = _errno;
+  return NULL;
+
+ ERROR:
+  _errno = errno;
+  close (fd);
+  errno = _errno;
+  return NULL;
 }
 
-bng_trie_node_t *
-bng_trie_sub_node (bng_trie_t *trie, bng_trie_node_t *node, gint id)
+/* Write trie as a dictionary file for bng_trie_open. The file is replaced
+   atomically, processes using the old one keep their mapping. */
+gint
+bng_trie_save (bng_trie_t *trie, const gchar *path)
 {
-  bng_trie_node_t *sub_node = NULL;
+  trie_file_header_t hdr;
+  gchar *tmp_path;
+  mode_t mask;
+  FILE *fp;
+  gint fd, _errno;
+
+  memset (&hdr, 0, sizeof (hdr));
+  memcpy (hdr.magic, TRIE_FILE_MAGIC, sizeof (hdr.magic));
+  hdr.version = TRIE_FILE_VERSION;
+  hdr.byte_order = TRIE_FILE_BYTE_ORDER;
+  hdr.node_size = sizeof (bng_trie_node_t);
+  hdr.node_count = trie->node_count;
+  hdr.word_count = trie->word_count;
+  hdr.max_depth = trie->max_depth;
+
+  /* A name of its own, concurrent builds of the same file do not mix. */
+  tmp_path = g_strdup_printf ("%s.XXXXXX", path);
+  fd = g_mkstemp (tmp_path);
+  if (fd < 0)
+    goto ERROR;
+
+  /* mkstemp creates 0600, give it the permissions fopen would. */
+  mask = umask (0);
+  umask (mask);
+  fchmod (fd, 0666 & ~mask);
+
+  fp = fdopen (fd, "w");
+  if (!fp)
+    {
+      _errno = errno;
+      close (fd);
+      g_unlink (tmp_path);
+      errno = _errno;
+      goto ERROR;
+    }
 
-  sub_node = node->sub_nodes[id];
-  if (!sub_node)
+  if (fwrite (&hdr, sizeof (hdr), 1, fp) != 1
+      || fwrite (trie->nodes, sizeof (bng_trie_node_t), trie->node_count, fp) != trie->node_count)
     {
-      sub_node = calloc (sizeof (*sub_node), 1);
-      if (!sub_node)
-	return NULL;
+      _errno = errno;
+      fclose (fp);
+      g_unlink (tmp_path);
+      errno = _errno;
+      goto ERROR;
+    }
 
-      sub_node->id        = id;
-      sub_node->depth     = node->depth + 1;
-      sub_node->data      = calloc (sizeof (int), strlen (trie->word));
+  if (fclose (fp) != 0)
+    {
+      _errno = errno;
+      g_unlink (tmp_path);
+      errno = _errno;
+      goto ERROR;
+    }
 
-      node->sub_nodes[id] = sub_node;
-      sub_node->parent    = node;
-      trie->node_count++;
+  if (g_rename (tmp_path, path) != 0)
+    {
+      _errno = errno;
+      g_unlink (tmp_path);
+      errno = _errno;
+      goto ERROR;
     }
 
-  return sub_node;
-}
+  g_free (tmp_path);
+  return 0;
 
+ ERROR:
+  _errno = errno;
+  BNG_DBG (_("Unable to write dictionary [%s], %s"), path, strerror (errno));
+  g_free (tmp_path);
+  errno = _errno;
+  return -1;
+}
 
-gint bng_trie_add (bng_trie_t *trie, const gchar *word)
+/* Child id of node, created if missing. Returns NULL on overflow. The
+   node array may move, pointers to nodes are invalidated. */
+bng_trie_node_t *
+bng_trie_sub_node (bng_trie_t *trie, guint32 node, guchar id)
 {
-  bng_trie_node_t *node = NULL;
-  int              i = 0;
-  char             id = 0;
-  bng_trie_node_t *sub_node = NULL;
+  guint32 prev = 0, trav, sub;
+  bng_trie_node_t *sub_node;
 
-  node = &trie->root;
+  if (trie->map)
+    {
+      errno = EROFS; /* Mapped dictionary files are read-only. */
+      return NULL;
+    }
 
-  for (i = 0; i < strlen (word); i++)
+  /* Children are sorted by id. */
+  for (trav = trie->nodes[node].first_child; trav; trav = trie->nodes[trav].next_sibling)
     {
-      if (isspace (word[i]))
+      if (trie->nodes[trav].id == id)
+	return &trie->nodes[trav];
+      if (trie->nodes[trav].id > id)
 	break;
+      prev = trav;
+    }
+
+  if (trie->node_count == trie->capacity)
+    {
+      if (trie->capacity > G_MAXUINT32 / 2)
+	{
+	  errno = ENOMEM;
+	  return NULL;
+	}
+      trie->capacity *= 2;
+      trie->nodes = g_renew (bng_trie_node_t, trie->nodes, trie->capacity);
+    }
 
-      id = word[i];
+  sub = trie->node_count++;
+  sub_node = &trie->nodes[sub];
+  sub_node->id = id;
+  sub_node->eow = 0;
+  sub_node->depth = trie->nodes[node].depth + 1;
+  sub_node->parent = node;
+  sub_node->first_child = 0;
+  sub_node->next_sibling = trav;
 
-      sub_node = trie_sub_node (trie, node, id);
+  if (prev)
+    trie->nodes[prev].next_sibling = sub;
+  else
+    trie->nodes[node].first_child = sub;
+
+  return sub_node;
+}
+
+/* Add word, up to the first white space. */
+gint
+bng_trie_add (bng_trie_t *trie, const gchar *word)
+{
+  guint32 node = BNG_TRIE_ROOT;
+  bng_trie_node_t *sub_node = NULL;
+  gint i = 0;
+
+  for (i = 0; word[i] && !isspace ((guchar) word[i]); i++)
+    {
+      if (i == G_MAXUINT16)
+	{
+	  errno = E2BIG;
+	  return -1;
+	}
+
+      sub_node = bng_trie_sub_node (trie, node, word[i]);
       if (!sub_node)
 	return -1;
-      node = sub_node;
+      node = BNG_TRIE_NODE_INDEX (trie, sub_node);
     }
 
-  node->eow = 1;
+  if (!trie->nodes[node].eow)
+    {
+      trie->nodes[node].eow = 1;
+      trie->word_count++;
+      trie->max_depth = MAX (trie->max_depth, (guint32) i);
+    }
 
   return 0;
 }
 
-gint
-trie_node_walk (bng_trie_node_t *node, gint (*fn)(bng_trie_node_t *node,
-                                                void *data),
-               void *data, int eow_only)
+/* Node of word, NULL when word is not in the trie. */
+bng_trie_node_t *
+bng_trie_lookup (bng_trie_t *trie, const gchar *word)
 {
-  bng_trie_node_t *trav = NULL;
-  int              i = 0;
-  int              ret = 0;
+  guint32 node = BNG_TRIE_ROOT, trav = 0;
+  gint i = 0;
 
-  if (!eow_only || node->eow)
-    ret = fn (node, data);
-
-  if (ret)
-    goto out;
+  for (i = 0; word[i]; i++)
+    {
+      for (trav = trie->nodes[node].first_child; trav; trav = trie->nodes[trav].next_sibling)
+	if (trie->nodes[trav].id >= (guchar) word[i])
+	  break;
 
-  for (i = 0; i < 255; i++) {
-    trav = node->sub_nodes[i];
+      if (!trav || trie->nodes[trav].id != (guchar) word[i])
+	return NULL;
+      node = trav;
+    }
 
-    if (trav)
-      ret += bng_trie_node_walk (trav, fn, data, eow_only);
+  return trie->nodes[node].eow ? &trie->nodes[node] : NULL;
+}
 
-    if (ret < 0)
-      goto out;
-  }
+/* Depth first walk of the subtree of node, children in id order. Runs
+   without recursion, the parent links lead back up. */
+gint
+bng_trie_node_walk (bng_trie_t *trie, guint32 node, bng_trie_walk_fn fn,
+		    gpointer data, gint eow_only)
+{
+  guint32 start = node;
+  gint ret = 0, r;
 
- out:
-  return ret;
+  while (1)
+    {
+      bng_trie_node_t *trav = &trie->nodes[node];
+
+      r = (!eow_only || trav->eow) ? fn (trie, trav, data) : 0;
+      if (r < 0)
+	return r;
+      ret += r;
+
+      if (r == 0 && trav->first_child)
+	{
+	  node = trav->first_child;
+	  continue;
+	}
+
+      /* Climb up to the next unvisited sibling. */
+      while (node != start && trie->nodes[node].next_sibling == 0)
+	node = trie->nodes[node].parent;
+      if (node == start)
+	return ret;
+      node = trie->nodes[node].next_sibling;
+    }
 }
 
 gint
-bng_trie_walk (bng_trie_t *trie, gint (*fn)(bng_trie_node_t *node, void *data),
-           void *data, gint eow_only)
+bng_trie_walk (bng_trie_t *trie, bng_trie_walk_fn fn, gpointer data, gint eow_only)
+{
+  return bng_trie_node_walk (trie, BNG_TRIE_ROOT, fn, data, eow_only);
+}
+
+/* Spell the word leading to node in to buf, NUL terminated. Returns the
+   word length, which may exceed size - 1 when buf is too small. */
+gsize
+bng_trie_node_word (bng_trie_t *trie, bng_trie_node_t *node, gchar *buf, gsize size)
 {
-  return bng_trie_node_walk (&trie->root, fn, data, eow_only);
+  gsize len = node->depth;
+  gsize i = len;
+
+  if (size == 0)
+    return len;
+
+  while (i > 0)
+    {
+      i--;
+      if (i < size - 1)
+	buf[i] = node->id;
+      node = &trie->nodes[node->parent];
+    }
+  buf[MIN (len, size - 1)] = '\0';
+
+  return len;
 }
 
+/* Add every line of filename. Returns the number of words or -1. */
 gint
 bng_load_dict (bng_trie_t *trie, const gchar *filename)
 {
   FILE *fp = NULL;
-  char  word[128] = {0};
-  int   cnt = 0;
-  int   ret = -1;
+  gchar *word = NULL;
+  size_t size = 0;
+  gint cnt = 0;
 
   fp = fopen (filename, "r");
   if (!fp)
-    return ret;
+    {
+      gint _errno = errno;
+      BNG_DBG (_("Unable to read [%s], %s"), filename, strerror (errno));
+      errno = _errno;
+      return -1;
+    }
 
-  while (fgets (word, 128, fp)) {
-    ret = bng_trie_add (trie, word);
-    if (ret)
-      break;
-    cnt++;
-  }
+  while (getline (&word, &size, fp) != -1)
+    {
+      if (bng_trie_add (trie, word) != 0)
+	{
+	  cnt = -1;
+	  break;
+	}
+      cnt++;
+    }
 
+  free (word);
   fclose (fp);
 
   return cnt;
 }
 
-gint bng_calc_dist (bng_trie_node_t *node, void *data)
+/*
+  Single depth first pass over the trie, one distance row per depth on a
+  stack. In preorder the row of depth d - 1 always belongs to the parent
+  of the node being visited.
+
+  A subtree is skipped as soon as its row minimum exceeds the bound. The
+  bound starts at max_dist and, once k matches are held, drops below the
+  worst of them: only strictly closer words can still make it. Matches
+  are kept in a max heap on (dist, visit order), ties go to the word that
+  sorts first.
+*/
+typedef struct
 {
-  const char *word = NULL;
-  int         i = 0;
-  int        *row = NULL;
-  int        *uprow = NULL;
-  int         distu = 0;
-  int         distl = 0;
-  int         distul = 0;
-
-  word = data;
-
-  row = node->data;
-
-  if (!node->parent) {
-    for (i = 0; i < strlen (word); i++)
-      row[i] = i+1;
-
-    return 0;
-  }
-
-  uprow = node->parent->data;
-
-  distu = node->depth;          /* up node */
-  distul = node->parent->depth; /* up-left node */
-
-  for (i = 0; i < strlen (word); i++) {
-    distl = uprow[i];     /* left node */
+  guint32 node;
+  gint dist;
+  guint32 seq;
+} candidate_t;
 
-    if (word[i] == node->id)
-      row[i] = distul;
-    else
-      row[i] = _min ((distul + DISTANCE_EDIT),
-		    _min ((distu + DISTANCE_DEL),
-			 (distl + DISTANCE_INS)));
+typedef struct
+{
+  const gchar *word;
+  gint len;
+  gint *rows;       /* (max_depth + 1) rows of len + 1 */
+  gint bound;
+  guint k;          /* 0: every match within max_dist */
+  guint32 seq;
+  GArray *heap;     /* candidate_t, worst first */
+} search_t;
+
+static gboolean
+candidate_worse (const candidate_t *a, const candidate_t *b)
+{
+  return a->dist > b->dist || (a->dist == b->dist && a->seq > b->seq);
+}
 
-    distu  = row[i];
-    distul = distl;
-  }
+static void
+heap_sift_down (GArray *heap, guint i)
+{
+  candidate_t *h = (candidate_t *) heap->data;
 
-  return 0;
+  while (1)
+    {
+      guint l = 2 * i + 1, r = l + 1, worst = i;
+      if (l < heap->len && candidate_worse (&h[l], &h[worst]))
+	worst = l;
+      if (r < heap->len && candidate_worse (&h[r], &h[worst]))
+	worst = r;
+      if (worst == i)
+	return;
+
+      candidate_t tmp = h[i];
+      h[i] = h[worst];
+      h[worst] = tmp;
+      i = worst;
+    }
 }
 
-gint
-bng_trie_measure (bng_trie_t *trie, const gchar *word, gchar **matched_words)
+static void
+heap_push (GArray *heap, const candidate_t *cand)
 {
-  int len = 0;
-  int ret = 0;
-  int i = 0;
+  candidate_t *h;
+  guint i;
 
-  len = strlen (word);
+  g_array_append_val (heap, *cand);
+  h = (candidate_t *) heap->data;
 
-  /* fprintf (stderr, "Calculating distances ... "); */
+  for (i = heap->len - 1; i > 0 && candidate_worse (&h[i], &h[(i - 1) / 2]); i = (i - 1) / 2)
+    {
+      candidate_t tmp = h[i];
+      h[i] = h[(i - 1) / 2];
+      h[(i - 1) / 2] = tmp;
+    }
+}
 
-  ret = bng_trie_walk (trie, calc_dist, (void *)word, 0);
+static gint
+search_node (bng_trie_t *trie, bng_trie_node_t *node, gpointer data)
+{
+  search_t *srch = data;
+  gint *row = srch->rows + (gsize) node->depth * (srch->len + 1);
+  gint min;
 
-  /*
-    fprintf (stderr, "done.\n");
-    fprintf (stderr, "Did you mean: ");
-  */
+  if (node->depth == 0)
+    return 0; /* Root row is preset. */
 
-  struct {
-    int len;
-    int wordlen;
-  } msg;
+  row[0] = node->depth;
+  min = bng_calc_dist (srch->word, srch->len, node->id, row - (srch->len + 1), row);
+  if (min > srch->bound)
+    return 1; /* Prune */
 
-  msg.wordlen = len;
-  for (i = 0; i < len; i++)
+  if (node->eow && row[srch->len] <= srch->bound)
     {
-      msg.len = i;
-      ret = bng_trie_walk (trie, print_if_equal, &msg, 1);
-      if (ret)
-	break;
+      candidate_t cand = { BNG_TRIE_NODE_INDEX (trie, node), row[srch->len], srch->seq++ };
+
+      if (srch->k && srch->heap->len == srch->k)
+	{
+	  /* Replace the worst match, which is farther by the bound. */
+	  g_array_index (srch->heap, candidate_t, 0) = cand;
+	  heap_sift_down (srch->heap, 0);
+	}
+      else
+	heap_push (srch->heap, &cand);
+
+      if (srch->k && srch->heap->len == srch->k)
+	srch->bound = MIN (srch->bound, g_array_index (srch->heap, candidate_t, 0).dist - 1);
     }
-  fflush (stdout);
-
-  /* fprintf (stderr, "\n"); */
 
-  return i;
+  return 0;
 }
 
-/*
-gint
-print_node (bng_trie_node_t *node)
+static gint
+candidate_cmp (gconstpointer a, gconstpointer b)
 {
-  if (node->parent)
-    {
-      print_node (node->parent);
-      printf ("%c", node->id);
-    }
+  const candidate_t *ca = a, *cb = b;
 
-  return 0;
+  if (ca->dist != cb->dist)
+    return ca->dist - cb->dist;
+  return (ca->seq > cb->seq) - (ca->seq < cb->seq);
 }
 
+/* Up to k words (all of them if k is 0) within max_dist edits of word,
+   closest first. A negative max_dist means no limit, which only makes
+   sense with k. Appends bng_trie_match_t to matches and returns how many,
+   or -1 on error. */
 gint
-bng_print_if_equal (bng_trie_node_t *node, void *data)
+bng_trie_search (bng_trie_t *trie, const gchar *word, gint max_dist, guint k,
+		 GArray *matches)
 {
-  int *row = NULL;
-  int  ret = 0;
-  struct {
-    int   len;
-    int   wordlen;
-  } *msg;
-
-  msg = data;
-  row = node->data;
-
-  if (row[msg->wordlen - 1] == msg->len) {
-    print_node (node);
-    printf (" ");
-    ret = 1;
-  }
-
-  return ret;
+  return bng_trie_search_len (trie, word, strlen (word), max_dist, k, matches);
 }
 
-void
-bng_trie_node_print (bng_trie_node_t *node)
+/* bng_trie_search for the len bytes at word, which may hold NULs. */
+gint
+bng_trie_search_len (bng_trie_t *trie, const gchar *word, gsize len, gint max_dist,
+		     guint k, GArray *matches)
 {
-  bng_trie_node_t *trav = NULL;
-  int              i = 0;
+  search_t srch;
+  guint i;
 
-  printf ("%c", node->id);
+  srch.word = word;
+  srch.len = len;
+  srch.bound = (max_dist < 0) ? G_MAXINT - 1 : max_dist;
+  srch.k = k;
+  srch.seq = 0;
 
-  for (i = 0; i < 255; i++) {
-    trav = node->sub_nodes[i];
-    if (trav) {
-      printf ("(");
-      bng_trie_node_print (trav);
-      printf (")");
+  if ((max_dist < 0 && k == 0) || len >= G_MAXINT)
+    {
+      errno = EINVAL;
+      return -1;
     }
-  }
-}
 
+  srch.rows = g_try_new (gint, (gsize) (trie->max_depth + 1) * (srch.len + 1));
+  if (!srch.rows)
+    {
+      errno = ENOMEM;
+      return -1;
+    }
 
-void bng_trie_print (bng_trie_t *trie)
-{
-  bng_trie_node_t *node = NULL;
+  for (i = 0; i <= (guint) srch.len; i++)
+    srch.rows[i] = i;
 
-  node = &trie->root;
+  srch.heap = g_array_new (FALSE, FALSE, sizeof (candidate_t));
 
-  bng_trie_node_print (node);
-  printf ("\n");
-}
+  /* The empty word is a match at the root. */
+  if (trie->nodes[BNG_TRIE_ROOT].eow && srch.len <= srch.bound)
+    {
+      candidate_t cand = { BNG_TRIE_ROOT, srch.len, srch.seq++ };
+      heap_push (srch.heap, &cand);
+    }
 
-int
-main (int argc, char *argv[])
-{
-  bng_trie_t *trie = NULL;
-  int          ret = 0;
-  char        *word = NULL;
+  bng_trie_walk (trie, search_node, &srch, 0);
+  g_free (srch.rows);
 
-  if (argc != 3) {
-    fprintf (stderr, "Usage: %s <dictfile> <word>\n",
-	     argv[0]);
-    return 1;
-  }
+  g_array_sort (srch.heap, candidate_cmp);
+  for (i = 0; i < srch.heap->len; i++)
+    {
+      candidate_t *cand = &g_array_index (srch.heap, candidate_t, i);
+      bng_trie_node_t *node = &trie->nodes[cand->node];
+      bng_trie_match_t match;
+
+      match.word = g_malloc (node->depth + 1);
+      bng_trie_node_word (trie, node, match.word, node->depth + 1);
+      match.dist = cand->dist;
+      g_array_append_val (matches, match);
+    }
 
-  word = argv[2];
+  i = srch.heap->len;
+  g_array_free (srch.heap, TRUE);
+  return i;
+}
 
-  trie = bng_trie_new (word);
+/* Release a bng_trie_match_t, fits g_array_set_clear_func. */
+void
+bng_trie_match_clear (gpointer match)
+{
+  g_free (((bng_trie_match_t *) match)->word);
+}
 
-  ret = bng_load_dict (trie, argv[1]);
+/* Words closest to word. Adds them (g_free'd strings) to matches and
+   returns their distance, or -1 on error. */
+gint
+bng_trie_measure (bng_trie_t *trie, const gchar *word, GPtrArray *matches)
+{
+  GArray *found;
+  gint dist = -1;
+  guint i;
 
-  if (ret <= 0)
-    return 1;
+  found = g_array_new (FALSE, FALSE, sizeof (bng_trie_match_t));
 
-  fprintf (stderr, "Loaded %d words (%d nodes)\n",
-	   ret, trie->node_count);
+  /* Closest distance first, then every word at that distance. */
+  if (bng_trie_search (trie, word, -1, 1, found) > 0)
+    {
+      dist = g_array_index (found, bng_trie_match_t, 0).dist;
+      bng_trie_match_clear (&g_array_index (found, bng_trie_match_t, 0));
+      g_array_set_size (found, 0);
 
+      if (bng_trie_search (trie, word, dist, 0, found) < 0)
+	dist = -1;
+    }
 
-  bng_trie_measure (trie, word);
-  bng_trie_print (trie);
+  for (i = 0; i < found->len; i++)
+    {
+      bng_trie_match_t *match = &g_array_index (found, bng_trie_match_t, i);
+      if (dist >= 0)
+	g_ptr_array_add (matches, match->word);
+      else
+	g_free (match->word);
+    }
+  g_array_free (found, TRUE);
 
-  return 0;
+  return dist;
 }
-*/
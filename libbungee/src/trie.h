@@ -28,35 +28,67 @@
 extern "C" {
 #endif
 
+/* Nodes live in one array (arena) and refer to each other by index.
+   Children of a node form a list sorted by id, linked via next_sibling.
+   Index 0 is the root, so 0 doubles as "no node". */
 typedef struct
 {
-  gchar id;
-  gchar eow;
-  gint depth;
-  void *data;
-  bng_trie_node_t *parent;
-  bng_trie_node_t *sub_nodes[255];
+  guint32 first_child;
+  guint32 next_sibling;
+  guint32 parent;
+  guchar id;
+  guchar eow;      /* A word ends at this node */
+  guint16 depth;
 } bng_trie_node_t;
 
 typedef struct
 {
-  bng_trie_node_t root;
-  gint node_count;
-  const gchar *word;
+  bng_trie_node_t *nodes;
+  guint32 node_count;
+  guint32 capacity;
+  guint32 word_count;
+  guint32 max_depth;  /* Length of the longest word */
+  gpointer map;       /* Read-only mapping of a dictionary file, or NULL */
+  gsize map_len;
 } bng_trie_t;
 
-bng_trie_t *trie_new (const gchar *word);
-bng_trie_node_t *trie_sub_node (bng_trie_t *trie, bng_trie_node_t *node, gint id);
-gint trie_add (bng_trie_t *trie, const gchar *word);
-gint trie_node_walk (bng_trie_node_t *node, gint (*fn)(bng_trie_node_t *node, void *data), \
-		     void *data, gint eow_only);
-gint trie_walk (bng_trie_t *trie, gint (*fn)(bng_trie_node_t *node, void *data), \
-		void *data, gint eow_only);
-gint bng_load_dict (bng_trie_t *trie, const gchar *filename);
-gint bng_calc_dist (bng_trie_node_t *node, void *data);
-gint bng_trie_measure (bng_trie_t *trie, const gchar *word);
+/* A word found by bng_trie_search. */
+typedef struct
+{
+  gchar *word;
+  gint dist;
+} bng_trie_match_t;
 
+#define BNG_TRIE_ROOT 0
 
+/* Prebuilt dictionary file, see bng_trie_save. */
+#define BNG_TRIE_FILE_SUFFIX ".bngd"
+#define BNG_TRIE_NODE_INDEX(trie, node) ((guint32) ((node) - (trie)->nodes))
+
+/* Walk callback. Return 0 to continue, a positive value to skip the
+   subtree of node (the values are summed up as the walk result) or a
+   negative value to abort the walk. */
+typedef gint (*bng_trie_walk_fn) (bng_trie_t *trie, bng_trie_node_t *node, gpointer data);
+
+bng_trie_t *bng_trie_new (void);
+void bng_trie_free (bng_trie_t *trie);
+bng_trie_t *bng_trie_open (const gchar *path);
+gint bng_trie_save (bng_trie_t *trie, const gchar *path);
+bng_trie_node_t *bng_trie_sub_node (bng_trie_t *trie, guint32 node, guchar id);
+gint bng_trie_add (bng_trie_t *trie, const gchar *word);
+bng_trie_node_t *bng_trie_lookup (bng_trie_t *trie, const gchar *word);
+gint bng_trie_node_walk (bng_trie_t *trie, guint32 node, bng_trie_walk_fn fn,
+			 gpointer data, gint eow_only);
+gint bng_trie_walk (bng_trie_t *trie, bng_trie_walk_fn fn, gpointer data, gint eow_only);
+gsize bng_trie_node_word (bng_trie_t *trie, bng_trie_node_t *node, gchar *buf, gsize size);
+gint bng_load_dict (bng_trie_t *trie, const gchar *filename);
+gint bng_calc_dist (const gchar *word, gint len, guchar id, const gint *uprow, gint *row);
+gint bng_trie_search (bng_trie_t *trie, const gchar *word, gint max_dist, guint k,
+		      GArray *matches);
+gint bng_trie_search_len (bng_trie_t *trie, const gchar *word, gsize len, gint max_dist,
+			  guint k, GArray *matches);
+void bng_trie_match_clear (gpointer match);
+gint bng_trie_measure (bng_trie_t *trie, const gchar *word, GPtrArray *matches);
 
 #ifdef __cplusplus
 }
@@ -23,6 +23,7 @@ limitations under the License.
 #include <sys/types.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <glib.h>
 #include <glib/gstdio.h>
 
@@ -33,19 +34,23 @@ const char *program_bug_address = PACKAGE_BUGREPORT;
 
 static gboolean show_version (const gchar *option_name, const gchar *value, gpointer data, GError **error);
 static gboolean compiler (const gchar *option_name, const gchar *value, gpointer data, GError **error);
+static gboolean dict_builder (const gchar *option_name, const gchar *value, gpointer data, GError **error);
+static gboolean log_decoder (const gchar *option_name, const gchar *value, gpointer data, GError **error);
 
 /* Rest of unparsed strings are stored here. How ever we only support
    one string i.e. script filename. */
 static gchar **rest_args = NULL;
 /* Option flags and variables. These are initialized in parse_opt.  */
-static gchar **log_devices = NULL; /* Log file */
-FILE *log_fp;
-static gchar **msg_devices = NULL; /* Log file */
-FILE *msg_fp;
+static gchar **log_devices = NULL; /* Log targets */
+static gchar **msg_devices = NULL; /* Message targets */
 static gchar *log_level = NULL;  /* Minimum log level */
+static gchar *log_rotate = NULL; /* Rotate log files at this size */
+static gint log_keep = 5;         /* Rotated log files to keep */
+static gchar *log_format = NULL; /* text or binary log FILE */
 
 static gchar *startup_script = NULL; /* Choose a different startup file other than "~/.bungeerc" */
 static gchar *bng_script = NULL;  /* Execute this bungee script  */
+static gint jobs = 0; /* Worker processes for the script */
 
 static GOptionEntry opt_entries[] = {
   { G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_STRING_ARRAY, &rest_args,
@@ -58,7 +63,7 @@ static GOptionEntry opt_entries[] = {
     N_("Use this startup FILE instead"), "FILE" },
 
   { "log", 'l', 0, G_OPTION_ARG_STRING_ARRAY, &log_devices,
-    N_("Send log messages to these targets"), "[stdout|*stderr|syslog|FILE|zmq]" },
+    N_("Send log messages to these targets"), "[stdout|*stderr|syslog|FILE|unix:PATH|tcp:HOST:PORT]" },
 
   { "log-level", 'L', 0, G_OPTION_ARG_STRING, &log_level,
     N_("Set minium log level"), "[fatal|error|*warning|info|debug]" },
@@ -66,8 +71,26 @@ static GOptionEntry opt_entries[] = {
   { "compile", 'c', 0, G_OPTION_ARG_CALLBACK, compiler,
     N_("Compile .bng source to .bngo"), "FILE" },
 
+  { "build-dict", 0, 0, G_OPTION_ARG_CALLBACK, dict_builder,
+    N_("Build a .bngd fuzzy match dictionary from a word list"), "FILE" },
+
   { "output", 'o', 0, G_OPTION_ARG_STRING_ARRAY, &msg_devices,
-    N_("Send console messages to these targets"), "[*stdout|syslog|FILE|zmq]" },
+    N_("Send console messages to these targets"), "[*stdout|syslog|FILE|unix:PATH|tcp:HOST:PORT]" },
+
+  { "log-rotate", 0, 0, G_OPTION_ARG_STRING, &log_rotate,
+    N_("Rotate log and output FILEs once they reach SIZE"), "SIZE[k|M|G]" },
+
+  { "log-keep", 0, 0, G_OPTION_ARG_INT, &log_keep,
+    N_("Keep N rotated files"), "N" },
+
+  { "log-format", 0, 0, G_OPTION_ARG_STRING, &log_format,
+    N_("Write the log FILE as text or binary events"), "[*text|binary]" },
+
+  { "decode-log", 0, 0, G_OPTION_ARG_CALLBACK, log_decoder,
+    N_("Print a binary log FILE as text"), "FILE" },
+
+  { "jobs", 'j', 0, G_OPTION_ARG_INT, &jobs,
+    N_("Split the input across N worker processes"), "N" },
 
   { NULL }
 };
@@ -109,6 +132,120 @@ static gboolean compiler (const gchar *option_name,
   exit (0);
 }
 
+static gboolean dict_builder (const gchar *option_name,
+			      const gchar *value,
+			      gpointer data, GError **error)
+{
+  bng_trie_t *trie;
+  gchar *out_name;
+  gint count;
+
+  out_name = g_strdup_printf ("%s"BNG_TRIE_FILE_SUFFIX, value);
+
+  trie = bng_trie_new ();
+  count = bng_load_dict (trie, value);
+  if (count < 0 || bng_trie_save (trie, out_name) != 0)
+    {
+      g_printf (_("ERROR: Unable to build dictionary from %s, %s.\n"), value, strerror (errno));
+      exit (1);
+    }
+
+  g_printf ("%s: %d words (%u nodes) built in to %s\n", value, count, trie->node_count, out_name);
+  bng_trie_free (trie);
+  g_free (out_name);
+
+  exit (0);
+}
+
+static gboolean log_decoder (const gchar *option_name,
+			     const gchar *value,
+			     gpointer data, GError **error)
+{
+  if (bng_log_decode (value, stdout) != 0)
+    {
+      g_printf (_("ERROR: Unable to decode %s, %s.\n"), value, strerror (errno));
+      exit (1);
+    }
+
+  exit (0);
+}
+
+/* Parse SIZE[k|M|G] in to bytes. */
+static gint
+parse_size (const gchar *value, gsize *size)
+{
+  gchar *end;
+  guint64 n;
+
+  n = g_ascii_strtoull (value, &end, 10);
+  if (end == value)
+    return (-1);
+
+  switch (*end)
+    {
+    case 'G': case 'g':
+      n <<= 10;
+      /* fall through */
+    case 'M': case 'm':
+      n <<= 10;
+      /* fall through */
+    case 'K': case 'k':
+      n <<= 10;
+      end++;
+    default:
+      break;
+    }
+
+  if (*end != '\0')
+    return (-1);
+
+  *size = n;
+  return (0);
+}
+
+/* Turn --log / --output targets in to a console. Every target named is
+   written to. Only one FILE and one socket per console. */
+static gint
+parse_devices (gchar **devices, bng_console_t *console)
+{
+  gint i;
+
+  for (i = 0; devices && devices[i] && devices[i][0]; i++)
+    {
+      if (g_strcmp0 (devices[i], "stdout") == 0)
+	console->type |= BNG_CONSOLE_TYPE_STDOUT;
+      else if (g_strcmp0 (devices[i], "stderr") == 0)
+	console->type |= BNG_CONSOLE_TYPE_STDERR;
+      else if (g_strcmp0 (devices[i], "syslog") == 0)
+	console->type |= BNG_CONSOLE_TYPE_SYSLOG;
+      else if (g_str_has_prefix (devices[i], "unix:") || g_str_has_prefix (devices[i], "tcp:"))
+	{
+	  if (console->type & BNG_CONSOLE_TYPE_SOCKET)
+	    {
+	      BNG_ERR (_("Only one socket target is supported, [%s] and [%s] given."),
+		       console->address, devices[i]);
+	      return (-1);
+	    }
+	  console->type |= BNG_CONSOLE_TYPE_SOCKET;
+	  console->address = devices[i];
+	}
+      else if (!(console->type & BNG_CONSOLE_TYPE_FILE))
+	{
+	  /* No other option matches. This means devices[i] must be FILE. */
+	  console->type |= BNG_CONSOLE_TYPE_FILE;
+	  console->path = devices[i];
+	}
+      else
+	{
+	  BNG_ERR (_("Only one FILE target is supported, [%s] and [%s] given."),
+		   console->path, devices[i]);
+	  return (-1);
+	}
+    }
+
+  return (0);
+}
+
 int
 main (int argc, char **argv)
 {
@@ -139,91 +276,47 @@ main (int argc, char **argv)
   memset (&log, 0, sizeof (log));
   memset (&msg, 0, sizeof (msg));
 
-  msg.type = BNG_CONSOLE_TYPE_FILE;
-  msg.device.fp = stdout;
-
-  /* Parse message devices */
-  gchar *msg_file = NULL;
-  msg.type = BNG_CONSOLE_TYPE_STDERR;
-  if (msg_devices)
+  gsize rotate_size = 0;
+  if (log_rotate && parse_size (log_rotate, &rotate_size) != 0)
     {
-      gint i;
-      for(i=0; msg_devices[i] && msg_devices[i][0]; i++)
-	{
-	  if (g_strcmp0 (msg_devices[i], "stdout") == 0)
-	    msg.type = msg.type | BNG_CONSOLE_TYPE_STDOUT;
-	  else if (g_strcmp0 (msg_devices[i], "stderr") == 0)
-	    msg.type = msg.type | BNG_CONSOLE_TYPE_STDERR;
-	  else if (g_strcmp0 (msg_devices[i], "syslog") == 0)
-	    msg.type = msg.type | BNG_CONSOLE_TYPE_SYSLOG;
-	  else if (g_strcmp0 (msg_devices[i], "zmq") == 0)
-	    msg.type = msg.type | BNG_CONSOLE_TYPE_ZMQ;
-	  else
-	    {
-	      /* No other option matches. This means msg_devices[i] must be FILE. */
-	      /* If we have not processed this option already in previous iterations */
-	      if (~(msg.type & BNG_CONSOLE_TYPE_FILE))
-		{
-		  msg.type = msg.type | BNG_CONSOLE_TYPE_FILE;
-		  msg.device.fp = g_fopen (msg_devices[i], "a");
-		  if (!msg.device.fp)
-		    {
-		      BNG_ERR (_("Unable to open msg file [%s]."), msg_devices[i]);
-		      exit (1);
-		    }
-		  /* We need to save the filename to compare with log filename. If they are same,
-		     have to reopen then. Remember to free this msg_file later. */
-		  msg_file = g_strdup (msg_devices[i]);
-		}
-	    }
-	}
+      BNG_ERR (_("Invalid size [%s] for --log-rotate."), log_rotate);
+      exit (1);
     }
-  g_strfreev (msg_devices);
 
+  /* Parse message devices, stdout by default */
+  if (parse_devices (msg_devices, &msg) != 0)
+    exit (1);
+  if (msg.type == 0)
+    msg.type = BNG_CONSOLE_TYPE_STDOUT;
+  msg.rotate_size = rotate_size;
+  msg.rotate_keep = log_keep;
+
+  /* Parse log devices, stderr by default */
+  if (parse_devices (log_devices, &log) != 0)
+    exit (1);
+  if (log.type == 0)
+    log.type = BNG_CONSOLE_TYPE_STDERR;
+  log.rotate_size = rotate_size;
+  log.rotate_keep = log_keep;
 
-    /* Parse log devices */
-  log.type = BNG_CONSOLE_TYPE_STDERR;
-  if (log_devices)
+  if (log_format && g_strcmp0 (log_format, "binary") == 0)
     {
-      gint i;
-      for(i=0; log_devices[i] && log_devices[i][0]; i++)
+      if (!(log.type & BNG_CONSOLE_TYPE_FILE))
 	{
-	  if (g_strcmp0 (log_devices[i], "stdout") == 0)
-	    log.type = log.type | BNG_CONSOLE_TYPE_STDOUT;
-	  else if (g_strcmp0 (log_devices[i], "stderr") == 0)
-	    log.type = log.type | BNG_CONSOLE_TYPE_STDERR;
-	  else if (g_strcmp0 (log_devices[i], "syslog") == 0)
-	    log.type = log.type | BNG_CONSOLE_TYPE_SYSLOG;
-	  else if (g_strcmp0 (log_devices[i], "zmq") == 0)
-	    log.type = log.type | BNG_CONSOLE_TYPE_ZMQ;
-	  else
-	    {
-	      /* No other option matches. This means log_devices[i] must be FILE. */
-	      /* If we have not processed this option already in previous iterations */
-	      if (~(log.type & BNG_CONSOLE_TYPE_FILE))
-		{
-		  log.type = log.type | BNG_CONSOLE_TYPE_FILE;
-
-		  if ((msg_file && msg_file[0]) && (g_strcmp0 (msg_file, log_devices[i]) == 0))
-		    {
-		      /* User requested msg and log to go to same file. We don't have to reopen again. */
-		      log.device.fp = msg.device.fp;
-		      g_free (msg_file);
-		    }
-		  else
-		    {
-		      log.device.fp = g_fopen (log_devices[i], "a");
-		      if (!log.device.fp)
-			{
-			  BNG_ERR (_("Unable to open log file [%s]."), log_devices[i]);
-			  exit (1);
-			}
-		    }
-		}
-	    }
+	  BNG_ERR (_("Binary log format needs a FILE log target."));
+	  exit (1);
 	}
+      log.binary = TRUE;
+      /* Messages sent to the same file become events too. */
+      if (g_strcmp0 (msg.path, log.path) == 0)
+	msg.binary = TRUE;
     }
-  g_strfreev (log_devices);
+  else if (log_format && g_strcmp0 (log_format, "text") != 0)
+    {
+      BNG_ERR (_("Unknown log format [%s]."), log_format);
+      exit (1);
+    }
+  g_free (log_format);
 
 
   /* Parse log level */
@@ -246,6 +339,8 @@ main (int argc, char **argv)
 	  BNG_ERR (_("Unknown log level [%s] passed. Assuming defaults."), log_level);
 	  exit (1);
 	}
+      if (_log_level > BNG_LOG_COMPILED_LEVEL)
+	BNG_WARN (_("Log level [%s] is not compiled in to this build."), log_level);
       g_free (log_level);
     }
 
@@ -263,9 +358,12 @@ main (int argc, char **argv)
 
   if (bng_init (msg, log, _log_level) != 0)
     {
-      BNG_ERR (_("Failed to intialize "PACKAGE));
+      BNG_ERR (_("Failed to intialize "PACKAGE", %s"), strerror (errno));
       exit (1);
     }
+  /* Console paths point in to them. */
+  g_strfreev (msg_devices);
+  g_strfreev (log_devices);
 
   /* Load BNG_RC startup script */
   if (startup_script)
@@ -275,6 +373,7 @@ main (int argc, char **argv)
 
   if (bng_script != NULL)
     {
+      bng_engine_set_jobs (jobs);
       status = bng_run (bng_script);
       if (status != 0)
 	{